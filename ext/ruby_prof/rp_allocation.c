@@ -4,6 +4,8 @@
 #include "rp_allocation.h"
 #include "rp_method.h"
 
+#include <math.h>
+
 VALUE cRpAllocation;
 
 // ------ prof_allocation_t ------
@@ -11,6 +13,11 @@ prof_allocation_t* prof_allocation_create(void)
 {
     prof_allocation_t* result = ALLOC(prof_allocation_t);
     result->count = 0;
+    result->samples = 0;
+    result->memory = 0;
+    result->max_memory = 0;
+    result->retained = 0;
+    result->retained_memory = 0;
     result->klass = Qnil;
     result->klass_name = Qnil;
     result->object = Qnil;
@@ -168,7 +175,8 @@ void allocations_table_insert(st_table* table, st_data_t key, prof_allocation_t*
     rb_st_insert(table, (st_data_t)key, (st_data_t)allocation);
 }
 
-prof_allocation_t* prof_allocate_increment(st_table* allocations_table, rb_trace_arg_t* trace_arg)
+/* Records an allocation. When allocations are sampled each recorded allocation stands for weight allocations. */
+prof_allocation_t* prof_allocate_increment(st_table* allocations_table, rb_trace_arg_t* trace_arg, uint64_t weight)
 {
     VALUE object = rb_tracearg_object(trace_arg);
     if (BUILTIN_TYPE(object) == T_IMEMO)
@@ -192,11 +200,49 @@ prof_allocation_t* prof_allocate_increment(st_table* allocations_table, rb_trace
         allocations_table_insert(allocations_table, key, allocation);
     }
 
-    allocation->count++;
+    allocation->count += weight;
+    allocation->samples++;
 
     return allocation;
 }
 
+/* Objects are not initialized when the newobj event fires, so the caller reads their size at a later event */
+void prof_allocate_memory(prof_allocation_t* allocation, VALUE object, uint64_t weight)
+{
+    uint64_t size = rb_obj_memsize_of(object);
+    allocation->memory += size * weight;
+    if (size > allocation->max_memory)
+        allocation->max_memory = size;
+}
+
+/* Records an allocated object that is still alive when the profile is stopped */
+void prof_allocate_retain(prof_allocation_t* allocation, VALUE object, uint64_t weight)
+{
+    allocation->retained += weight;
+    allocation->retained_memory += rb_obj_memsize_of(object) * weight;
+}
+
+/* Returns how many allocations to skip before recording the next one. Each allocation is recorded with a
+   probability of 1 / interval, so the gaps between recorded allocations are geometrically distributed. Unlike
+   recording every Nth allocation, this can not fall into step with code that allocates in a fixed pattern. */
+uint64_t prof_allocation_sample_gap(uint64_t* random_state, uint64_t interval)
+{
+    if (interval <= 1)
+        return 1;
+
+    // xorshift64*
+    uint64_t x = *random_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *random_state = x;
+    uint64_t random = x * 0x2545F4914F6CDD1DULL;
+
+    // Uniform in (0, 1]
+    double uniform = ((random >> 11) + 1) * (1.0 / 9007199254740992.0);
+    return 1 + (uint64_t)(log(uniform) / log(1.0 - 1.0 / interval));
+}
+
 // Returns an array of allocations
 VALUE prof_allocations_wrap(st_table* allocations_table)
 {
@@ -275,7 +321,59 @@ Returns the number of times this class has been allocated. */
 static VALUE prof_allocation_count(VALUE self)
 {
     prof_allocation_t* allocation = prof_allocation_get(self);
-    return INT2FIX(allocation->count);
+    return ULL2NUM(allocation->count);
+}
+
+/* call-seq:
+   samples -> number
+
+Returns the number of allocations that were recorded. This is the same as count unless the profile
+sampled allocations, in which case count is estimated by scaling up samples. */
+static VALUE prof_allocation_samples(VALUE self)
+{
+    prof_allocation_t* allocation = prof_allocation_get(self);
+    return ULL2NUM(allocation->samples);
+}
+
+/* call-seq:
+   memory -> number
+
+Returns the number of bytes used by the allocated objects. */
+static VALUE prof_allocation_memory(VALUE self)
+{
+    prof_allocation_t* allocation = prof_allocation_get(self);
+    return ULL2NUM(allocation->memory);
+}
+
+/* call-seq:
+   max_memory -> number
+
+Returns the number of bytes used by the largest allocated object. */
+static VALUE prof_allocation_max_memory(VALUE self)
+{
+    prof_allocation_t* allocation = prof_allocation_get(self);
+    return ULL2NUM(allocation->max_memory);
+}
+
+/* call-seq:
+   retained -> number
+
+Returns the number of allocated objects that were still alive when the profile was stopped. Only
+recorded by profiles that track retained objects. */
+static VALUE prof_allocation_retained(VALUE self)
+{
+    prof_allocation_t* allocation = prof_allocation_get(self);
+    return ULL2NUM(allocation->retained);
+}
+
+/* call-seq:
+   retained_memory -> number
+
+Returns the number of bytes used by the retained objects when the profile was stopped. */
+static VALUE prof_allocation_retained_memory(VALUE self)
+{
+    prof_allocation_t* allocation = prof_allocation_get(self);
+    return ULL2NUM(allocation->retained_memory);
 }
 
 /* :nodoc: */
@@ -290,7 +388,12 @@ static VALUE prof_allocation_dump(VALUE self)
     rb_hash_aset(result, ID2SYM(rb_intern("klass_flags")), INT2FIX(allocation->klass_flags));
     rb_hash_aset(result, ID2SYM(rb_intern("source_file")), allocation->source_file);
     rb_hash_aset(result, ID2SYM(rb_intern("source_line")), INT2FIX(allocation->source_line));
-    rb_hash_aset(result, ID2SYM(rb_intern("count")), INT2FIX(allocation->count));
+    rb_hash_aset(result, ID2SYM(rb_intern("count")), ULL2NUM(allocation->count));
+    rb_hash_aset(result, ID2SYM(rb_intern("samples")), ULL2NUM(allocation->samples));
+    rb_hash_aset(result, ID2SYM(rb_intern("memory")), ULL2NUM(allocation->memory));
+    rb_hash_aset(result, ID2SYM(rb_intern("max_memory")), ULL2NUM(allocation->max_memory));
+    rb_hash_aset(result, ID2SYM(rb_intern("retained")), ULL2NUM(allocation->retained));
+    rb_hash_aset(result, ID2SYM(rb_intern("retained_memory")), ULL2NUM(allocation->retained_memory));
 
     return result;
 }
@@ -306,7 +409,21 @@ static VALUE prof_allocation_load(VALUE self, VALUE data)
     allocation->klass_flags = FIX2INT(rb_hash_aref(data, ID2SYM(rb_intern("klass_flags"))));
     allocation->source_file = rb_hash_aref(data, ID2SYM(rb_intern("source_file")));
     allocation->source_line = FIX2INT(rb_hash_aref(data, ID2SYM(rb_intern("source_line"))));
-    allocation->count = FIX2INT(rb_hash_aref(data, ID2SYM(rb_intern("count"))));
+    allocation->count = NUM2ULL(rb_hash_aref(data, ID2SYM(rb_intern("count"))));
+
+    // Older dumps recorded every allocation
+    VALUE samples = rb_hash_aref(data, ID2SYM(rb_intern("samples")));
+    allocation->samples = NIL_P(samples) ? allocation->count : NUM2ULL(samples);
+
+    // Older dumps do not record memory
+    VALUE memory = rb_hash_aref(data, ID2SYM(rb_intern("memory")));
+    allocation->memory = NIL_P(memory) ? 0 : NUM2ULL(memory);
+    VALUE max_memory = rb_hash_aref(data, ID2SYM(rb_intern("max_memory")));
+    allocation->max_memory = NIL_P(max_memory) ? 0 : NUM2ULL(max_memory);
+    VALUE retained = rb_hash_aref(data, ID2SYM(rb_intern("retained")));
+    allocation->retained = NIL_P(retained) ? 0 : NUM2ULL(retained);
+    VALUE retained_memory = rb_hash_aref(data, ID2SYM(rb_intern("retained_memory")));
+    allocation->retained_memory = NIL_P(retained_memory) ? 0 : NUM2ULL(retained_memory);
 
     return data;
 }
@@ -322,6 +439,11 @@ void rp_init_allocation(void)
     rb_define_method(cRpAllocation, "source_file", prof_allocation_source_file, 0);
     rb_define_method(cRpAllocation, "line", prof_allocation_source_line, 0);
     rb_define_method(cRpAllocation, "count", prof_allocation_count, 0);
+    rb_define_method(cRpAllocation, "samples", prof_allocation_samples, 0);
+    rb_define_method(cRpAllocation, "memory", prof_allocation_memory, 0);
+    rb_define_method(cRpAllocation, "max_memory", prof_allocation_max_memory, 0);
+    rb_define_method(cRpAllocation, "retained", prof_allocation_retained, 0);
+    rb_define_method(cRpAllocation, "retained_memory", prof_allocation_retained_memory, 0);
     rb_define_method(cRpAllocation, "_dump_data", prof_allocation_dump, 0);
     rb_define_method(cRpAllocation, "_load_data", prof_allocation_load, 1);
 }
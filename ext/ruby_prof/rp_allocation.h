@@ -13,13 +13,21 @@ typedef struct prof_allocation_t
     VALUE klass_name;                 /* Name of the class that was created */
     VALUE source_file;                /* Line number where allocation happens */
     int source_line;                  /* Line number where allocation happens */
-    int count;                        /* Number of allocations */
+    uint64_t count;                   /* Number of allocations, estimated when allocations are sampled */
+    uint64_t samples;                 /* Number of allocations that were recorded */
+    uint64_t memory;                  /* Bytes allocated, estimated when allocations are sampled */
+    uint64_t max_memory;              /* Bytes used by the largest object allocated */
+    uint64_t retained;                /* Number of allocated objects still alive when the profile stopped */
+    uint64_t retained_memory;         /* Bytes used by the retained objects */
     VALUE object;                     /* Cache to wrapped object */
 } prof_allocation_t;
 
 // Allocation (prof_allocation_t*)
 void rp_init_allocation(void);
-prof_allocation_t* prof_allocate_increment(st_table* allocations_table, rb_trace_arg_t* trace_arg);
+prof_allocation_t* prof_allocate_increment(st_table* allocations_table, rb_trace_arg_t* trace_arg, uint64_t weight);
+void prof_allocate_memory(prof_allocation_t* allocation, VALUE object, uint64_t weight);
+void prof_allocate_retain(prof_allocation_t* allocation, VALUE object, uint64_t weight);
+uint64_t prof_allocation_sample_gap(uint64_t* random_state, uint64_t interval);
 
 // Allocations (st_table*)
 st_table* prof_allocations_create(void);
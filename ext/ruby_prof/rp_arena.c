@@ -0,0 +1,66 @@
+/* Copyright (C) 2005-2019 Shugo Maeda <shugo@ruby-lang.org> and Charlie Savage <cfis@savagexi.com>
+   Please see the LICENSE file for copyright and distribution information */
+
+#include "rp_arena.h"
+
+/* Blocks start small since most threads only call a few methods and double up to the maximum size */
+#define ARENA_MIN_BLOCK_SIZE (16 * 1024)
+#define ARENA_MAX_BLOCK_SIZE (1024 * 1024)
+
+/* Enough for the int64_t, double and pointer members of the allocated structs */
+#define ARENA_ALIGNMENT 8
+#define ARENA_ALIGN(size) (((size) + ARENA_ALIGNMENT - 1) & ~((size_t)ARENA_ALIGNMENT - 1))
+
+#define ARENA_HEADER_SIZE ARENA_ALIGN(sizeof(prof_arena_block_t))
+
+static prof_arena_block_t* prof_arena_block_create(prof_arena_t* arena, size_t size)
+{
+    size_t block_size = arena->block ? arena->block->size * 2 : ARENA_MIN_BLOCK_SIZE;
+    if (block_size > ARENA_MAX_BLOCK_SIZE)
+        block_size = ARENA_MAX_BLOCK_SIZE;
+    if (block_size < ARENA_HEADER_SIZE + size)
+        block_size = ARENA_HEADER_SIZE + size;
+
+    prof_arena_block_t* result = (prof_arena_block_t*)xmalloc(block_size);
+    result->next = arena->block;
+    result->size = block_size;
+    result->used = ARENA_HEADER_SIZE;
+
+    arena->block = result;
+    arena->size += block_size;
+    return result;
+}
+
+prof_arena_t* prof_arena_create(void)
+{
+    prof_arena_t* result = ALLOC(prof_arena_t);
+    result->block = NULL;
+    result->size = 0;
+    return result;
+}
+
+/* Returns uninitialized memory that stays valid until the arena is freed */
+void* prof_arena_alloc(prof_arena_t* arena, size_t size)
+{
+    size = ARENA_ALIGN(size);
+
+    prof_arena_block_t* block = arena->block;
+    if (!block || block->size - block->used < size)
+        block = prof_arena_block_create(arena, size);
+
+    void* result = (char*)block + block->used;
+    block->used += size;
+    return result;
+}
+
+void prof_arena_free(prof_arena_t* arena)
+{
+    prof_arena_block_t* block = arena->block;
+    while (block)
+    {
+        prof_arena_block_t* next = block->next;
+        xfree(block);
+        block = next;
+    }
+    xfree(arena);
+}
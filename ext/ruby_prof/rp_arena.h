@@ -0,0 +1,25 @@
+/* Copyright (C) 2005-2019 Shugo Maeda <shugo@ruby-lang.org> and Charlie Savage <cfis@savagexi.com>
+   Please see the LICENSE file for copyright and distribution information */
+
+#pragma once
+
+#include "ruby_prof.h"
+
+typedef struct prof_arena_block_t
+{
+    struct prof_arena_block_t* next;
+    size_t size;
+    size_t used;
+} prof_arena_block_t;
+
+/* Bump allocator for the call trees and measurements created while profiling a thread. Memory is only
+   released when the whole arena is freed. */
+typedef struct prof_arena_t
+{
+    prof_arena_block_t* block;        /* Block being allocated from, earlier blocks follow it */
+    size_t size;                      /* Bytes reserved by all blocks */
+} prof_arena_t;
+
+prof_arena_t* prof_arena_create(void);
+void* prof_arena_alloc(prof_arena_t* arena, size_t size);
+void prof_arena_free(prof_arena_t* arena);
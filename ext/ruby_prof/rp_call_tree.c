@@ -3,34 +3,155 @@
 
 #include "rp_call_tree.h"
 #include "rp_call_trees.h"
+#include "rp_profile.h"
 #include "rp_thread.h"
 
+#include <string.h>
+
 VALUE cRpCallTree;
 
+/* =======  Call Tree Table   ========*/
+/* Method keys are hashes, so their low bits are used as is */
+static inline uint32_t call_tree_table_bin(call_tree_table_t* table, st_data_t key)
+{
+    return (uint32_t)key & (2 * table->capacity - 1);
+}
+
+static void call_tree_table_resize(call_tree_table_t* table, uint32_t capacity)
+{
+    call_tree_table_entry_t* entries = ALLOC_N(call_tree_table_entry_t, capacity);
+    uint32_t* bins = ZALLOC_N(uint32_t, 2 * capacity);
+
+    call_tree_table_entry_t* old_entries = table->capacity ? table->entries : table->inline_entries;
+    memcpy(entries, old_entries, table->count * sizeof(call_tree_table_entry_t));
+    if (table->capacity)
+    {
+        xfree(table->entries);
+        xfree(table->bins);
+    }
+
+    table->entries = entries;
+    table->bins = bins;
+    table->capacity = capacity;
+
+    for (uint32_t i = 0; i < table->count; i++)
+    {
+        uint32_t bin = call_tree_table_bin(table, entries[i].key);
+        while (bins[bin])
+            bin = (bin + 1) & (2 * capacity - 1);
+        bins[bin] = i + 1;
+    }
+}
+
+/* Returns the entry for key, or if there is none where it should be added */
+static call_tree_table_entry_t* call_tree_table_find(call_tree_table_t* table, st_data_t key, uint32_t** bin_result)
+{
+    if (!table->capacity)
+    {
+        for (uint32_t i = 0; i < table->count; i++)
+        {
+            if (table->inline_entries[i].key == key)
+                return &table->inline_entries[i];
+        }
+        return NULL;
+    }
+
+    uint32_t bin = call_tree_table_bin(table, key);
+    while (table->bins[bin])
+    {
+        call_tree_table_entry_t* entry = &table->entries[table->bins[bin] - 1];
+        if (entry->key == key)
+            return entry;
+        bin = (bin + 1) & (2 * table->capacity - 1);
+    }
+
+    if (bin_result)
+        *bin_result = &table->bins[bin];
+    return NULL;
+}
+
+static void call_tree_table_insert(call_tree_table_t* table, st_data_t key, prof_call_tree_t* val)
+{
+    uint32_t* bin = NULL;
+    call_tree_table_entry_t* entry = call_tree_table_find(table, key, &bin);
+    if (entry)
+    {
+        entry->call_tree = val;
+        return;
+    }
+
+    uint32_t capacity = table->capacity ? table->capacity : CALL_TREE_TABLE_INLINE;
+    if (table->count == capacity)
+    {
+        call_tree_table_resize(table, table->capacity ? table->capacity * 2 : 8);
+        call_tree_table_find(table, key, &bin);
+    }
+
+    entry = table->capacity ? &table->entries[table->count] : &table->inline_entries[table->count];
+    entry->key = key;
+    entry->call_tree = val;
+    table->count++;
+
+    if (bin)
+        *bin = table->count;
+}
+
+prof_call_tree_t* call_tree_table_lookup(call_tree_table_t* table, st_data_t key)
+{
+    call_tree_table_entry_t* entry = call_tree_table_find(table, key, NULL);
+    return entry ? entry->call_tree : NULL;
+}
+
+/* Calls func for each child in the order they were added. Its return value is ignored. */
+void call_tree_table_foreach(call_tree_table_t* table, st_foreach_callback_func* func, st_data_t data)
+{
+    call_tree_table_entry_t* entries = table->capacity ? table->entries : table->inline_entries;
+    for (uint32_t i = 0; i < table->count; i++)
+        func(entries[i].key, (st_data_t)entries[i].call_tree, data);
+}
+
+static void call_tree_table_free(call_tree_table_t* table)
+{
+    if (table->capacity)
+    {
+        xfree(table->entries);
+        xfree(table->bins);
+    }
+    table->count = 0;
+    table->capacity = 0;
+}
+
 /* =======  prof_call_tree_t   ========*/
-prof_call_tree_t* prof_call_tree_create(prof_method_t* method, prof_call_tree_t* parent, VALUE source_file, int source_line)
+/* Call trees created while profiling are allocated, along with their extra measurements, from the thread's
+   arena. Those created by Ruby or by merging results pass a NULL arena. Only call trees created while
+   profiling are pinned, the others mark their objects themselves. */
+prof_call_tree_t* prof_call_tree_create(prof_arena_t* arena, prof_method_t* method, prof_call_tree_t* parent, VALUE source_file, int source_line)
 {
-    prof_call_tree_t* result = ALLOC(prof_call_tree_t);
+    prof_call_tree_t* result = arena ? prof_arena_alloc(arena, sizeof(prof_call_tree_t)) : ALLOC(prof_call_tree_t);
     result->owner = OWNER_C;
+    result->in_arena = arena != NULL;
+    result->pinned = arena != NULL;
     result->method = method;
     result->parent = parent;
     result->object = Qnil;
     result->visits = 0;
     result->source_line = source_line;
     result->source_file = source_file;
-    result->children = rb_st_init_numtable();
-    result->measurement = prof_measurement_create();
+    if (result->pinned)
+        prof_profile_pin_value(method->profile, source_file);
+    result->children.count = 0;
+    result->children.capacity = 0;
+    prof_measurement_init(&result->measurement, method ? method->measurement.resolution : MEASUREMENT_DEFAULT_RESOLUTION);
+    prof_measurements_init(arena, result->extra_measurements, method ? method->extra_measurements : NULL);
 
     return result;
 }
 
 prof_call_tree_t* prof_call_tree_copy(prof_call_tree_t* other)
 {
-    prof_call_tree_t* result = prof_call_tree_create(other->method, other->parent, other->source_file, other->source_line);
-
-    // Free the measurement created by prof_call_tree_create before replacing it with the copy
-    prof_measurement_free(result->measurement);
-    result->measurement = prof_measurement_copy(other->measurement);
+    prof_call_tree_t* result = prof_call_tree_create(NULL, other->method, other->parent, other->source_file, other->source_line);
+    prof_measurement_copy_values(&result->measurement, &other->measurement);
+    prof_measurements_copy(result->extra_measurements, other->extra_measurements);
 
     return result;
 }
@@ -43,10 +164,27 @@ static int prof_call_tree_collect_children(st_data_t key, st_data_t value, st_da
     return ST_CONTINUE;
 }
 
+/* Adds a Ruby object created for a pinned call tree, such as its wrapper, to its profile's values table */
+static VALUE prof_call_tree_pin(prof_call_tree_t* call_tree, VALUE value)
+{
+    if (call_tree->pinned)
+        prof_profile_pin_value(call_tree->method->profile, value);
+
+    return value;
+}
+
+static void prof_call_tree_pin_measurements(prof_call_tree_t* call_tree)
+{
+    prof_call_tree_pin(call_tree, call_tree->measurement.object);
+
+    for (int i = 0; i < MAX_EXTRA_MEASUREMENTS && call_tree->extra_measurements[i]; i++)
+        prof_call_tree_pin(call_tree, call_tree->extra_measurements[i]->object);
+}
+
 static int prof_call_tree_mark_children(st_data_t key, st_data_t value, st_data_t data)
 {
     prof_call_tree_t* call_tree = (prof_call_tree_t*)value;
-    rb_st_foreach(call_tree->children, prof_call_tree_mark_children, data);
+    call_tree_table_foreach(&call_tree->children, prof_call_tree_mark_children, data);
     prof_call_tree_mark(call_tree);
     return ST_CONTINUE;
 }
@@ -58,6 +196,13 @@ void prof_call_tree_mark(void* data)
 
     prof_call_tree_t* call_tree = (prof_call_tree_t*)data;
 
+    // The profile marks everything a pinned call tree references, so just keep the profile alive
+    if (call_tree->pinned)
+    {
+        prof_method_mark(call_tree->method);
+        return;
+    }
+
     if (call_tree->object != Qnil)
         rb_gc_mark_movable(call_tree->object);
 
@@ -65,12 +210,14 @@ void prof_call_tree_mark(void* data)
         rb_gc_mark(call_tree->source_file);
 
     prof_method_mark(call_tree->method);
-    prof_measurement_mark(call_tree->measurement);
+    prof_measurement_mark(&call_tree->measurement);
+    prof_measurements_mark(call_tree->extra_measurements);
 
     // Recurse down through the whole call tree but only from the top node
-    // to avoid calling mark over and over and over.
-    if (!call_tree->parent)
-        rb_st_foreach(call_tree->children, prof_call_tree_mark_children, 0);
+    // to avoid calling mark over and over and over. Call trees added to a pinned
+    // call tree from Ruby are the top of their own tree, see prof_call_tree_add_child.
+    if (!call_tree->parent || call_tree->parent->pinned)
+        call_tree_table_foreach(&call_tree->children, prof_call_tree_mark_children, 0);
 }
 
 void prof_call_tree_compact(void* data)
@@ -97,14 +244,16 @@ void prof_call_tree_free(prof_call_tree_t* call_tree_data)
     }
 
     // Free children
-    rb_st_foreach(call_tree_data->children, prof_call_tree_free_children, 0);
-    rb_st_free_table(call_tree_data->children);
+    call_tree_table_foreach(&call_tree_data->children, prof_call_tree_free_children, 0);
+    call_tree_table_free(&call_tree_data->children);
 
-    // Free measurement
-    prof_measurement_free(call_tree_data->measurement);
+    // Unlink the measurements from their Ruby objects and free the extra ones
+    prof_measurement_free(&call_tree_data->measurement);
+    prof_measurements_free(call_tree_data->extra_measurements);
 
-    // Finally free self
-    xfree(call_tree_data);
+    // Finally free self unless the arena will
+    if (!call_tree_data->in_arena)
+        xfree(call_tree_data);
 }
 
 static void prof_call_tree_ruby_gc_free(void* data)
@@ -151,14 +300,14 @@ VALUE prof_call_tree_wrap(prof_call_tree_t* call_tree)
 {
     if (call_tree->object == Qnil)
     {
-        call_tree->object = TypedData_Wrap_Struct(cRpCallTree, &call_tree_type, call_tree);
+        call_tree->object = prof_call_tree_pin(call_tree, TypedData_Wrap_Struct(cRpCallTree, &call_tree_type, call_tree));
     }
     return call_tree->object;
 }
 
 static VALUE prof_call_tree_allocate(VALUE klass)
 {
-    prof_call_tree_t* call_tree = prof_call_tree_create(NULL, NULL, Qnil, 0);
+    prof_call_tree_t* call_tree = prof_call_tree_create(NULL, NULL, NULL, Qnil, 0);
     // This object is being created by Ruby
     call_tree->owner = OWNER_RUBY;
     call_tree->object = prof_call_tree_wrap(call_tree);
@@ -177,25 +326,6 @@ prof_call_tree_t* prof_get_call_tree(VALUE self)
     return result;
 }
 
-/* =======  Call Tree Table   ========*/
-static size_t call_tree_table_insert(st_table* table, st_data_t key, prof_call_tree_t* val)
-{
-    return rb_st_insert(table, (st_data_t)key, (st_data_t)val);
-}
-
-prof_call_tree_t* call_tree_table_lookup(st_table* table, st_data_t key)
-{
-    st_data_t val;
-    if (rb_st_lookup(table, (st_data_t)key, &val))
-    {
-        return (prof_call_tree_t*)val;
-    }
-    else
-    {
-        return NULL;
-    }
-}
-
 uint32_t prof_call_tree_figure_depth(prof_call_tree_t* call_tree)
 {
     uint32_t result = 0;
@@ -215,7 +345,7 @@ int prof_call_tree_collect_methods(st_data_t key, st_data_t value, st_data_t res
   VALUE arr = (VALUE)result;
   rb_ary_push(arr, prof_method_wrap(call_tree->method));
 
-  rb_st_foreach(call_tree->children, prof_call_tree_collect_methods, result);
+  call_tree_table_foreach(&call_tree->children, prof_call_tree_collect_methods, result);
   return ST_CONTINUE;
 };
 
@@ -224,7 +354,7 @@ VALUE prof_call_tree_methods(prof_call_tree_t* call_tree)
     VALUE result = rb_ary_new();
     rb_ary_push(result, prof_method_wrap(call_tree->method));
 
-    rb_st_foreach(call_tree->children, prof_call_tree_collect_methods, result);
+    call_tree_table_foreach(&call_tree->children, prof_call_tree_collect_methods, result);
 
     return result;
 }
@@ -237,10 +367,14 @@ void prof_call_tree_add_parent(prof_call_tree_t* self, prof_call_tree_t* parent)
 
 void prof_call_tree_add_child(prof_call_tree_t* self, prof_call_tree_t* child)
 {
-    call_tree_table_insert(self->children, child->method->key, child);
+    call_tree_table_insert(&self->children, child->method->key, child);
     
     // The child is now managed by C since its parent will free it
     child->owner = OWNER_C;
+
+    // A call tree added from Ruby is not pinned, so its wrapper is kept by the profile to mark it
+    if (self->pinned && !child->pinned)
+        prof_call_tree_pin(self, prof_call_tree_wrap(child));
 }
 
 /* =======  RubyProf::CallTree   ========*/
@@ -279,7 +413,7 @@ static VALUE prof_call_tree_children(VALUE self)
 {
     prof_call_tree_t* call_tree = prof_get_call_tree(self);
     VALUE result = rb_ary_new();
-    rb_st_foreach(call_tree->children, prof_call_tree_collect_children, result);
+    call_tree_table_foreach(&call_tree->children, prof_call_tree_collect_children, result);
     return result;
 }
 
@@ -295,7 +429,7 @@ static VALUE prof_call_tree_add_child_ruby(VALUE self, VALUE child)
   prof_call_tree_t* parent_ptr = prof_get_call_tree(self);
   prof_call_tree_t* child_ptr = prof_get_call_tree(child);
 
-  prof_call_tree_t* existing_ptr = call_tree_table_lookup(parent_ptr->children, child_ptr->method->key);
+  prof_call_tree_t* existing_ptr = call_tree_table_lookup(&parent_ptr->children, child_ptr->method->key);
   if (existing_ptr)
   {
     rb_raise(rb_eIndexError, "Child call tree already exists");
@@ -323,7 +457,21 @@ Returns the measurement associated with this call_tree. */
 static VALUE prof_call_tree_measurement(VALUE self)
 {
     prof_call_tree_t* call_tree = prof_get_call_tree(self);
-    return prof_measurement_wrap(call_tree->measurement);
+    VALUE result = prof_measurement_wrap(&call_tree->measurement);
+    prof_call_tree_pin_measurements(call_tree);
+    return result;
+}
+
+/* call-seq:
+   measurements -> [Measurement]
+
+Returns a measurement for each of the profile's measure modes. The first is the same as measurement. */
+static VALUE prof_call_tree_measurements(VALUE self)
+{
+    prof_call_tree_t* call_tree = prof_get_call_tree(self);
+    VALUE result = prof_measurements_wrap(&call_tree->measurement, call_tree->extra_measurements);
+    prof_call_tree_pin_measurements(call_tree);
+    return result;
 }
 
 /* call-seq:
@@ -373,11 +521,12 @@ static int prof_call_tree_merge_children(st_data_t key, st_data_t value, st_data
     self_info_t* self_info = (self_info_t*)data;
     prof_call_tree_t* self_ptr = self_info->call_tree;
 
-    prof_call_tree_t* self_child = call_tree_table_lookup(self_ptr->children, other_child_ptr->method->key);
+    prof_call_tree_t* self_child = call_tree_table_lookup(&self_ptr->children, other_child_ptr->method->key);
     if (self_child)
     {
         // Merge measurements
-        prof_measurement_merge_internal(self_child->measurement, other_child_ptr->measurement);
+        prof_measurement_merge_internal(&self_child->measurement, &other_child_ptr->measurement);
+        prof_measurements_merge(self_child->extra_measurements, other_child_ptr->extra_measurements);
     }
     else
     {
@@ -387,15 +536,17 @@ static int prof_call_tree_merge_children(st_data_t key, st_data_t value, st_data
         // Now copy the other call tree, reset its method pointer, and add it as a child
         self_child = prof_call_tree_copy(other_child_ptr);
         self_child->method = method_ptr;
+        // Merged threads belong to the same profile, so the copy's objects are already pinned
+        self_child->pinned = self_ptr->pinned;
         prof_call_tree_add_child(self_ptr, self_child);
 
         // Now tell the method that this call tree invoked it
-        prof_add_call_tree(method_ptr->call_trees, self_child);
+        prof_method_add_call_tree(method_ptr, self_child);
     }
 
     // Recurse down a level to merge children
     self_info_t child_info = { .call_tree = self_child, .method_table = self_info->method_table };
-    rb_st_foreach(other_child_ptr->children, prof_call_tree_merge_children, (st_data_t)&child_info);
+    call_tree_table_foreach(&other_child_ptr->children, prof_call_tree_merge_children, (st_data_t)&child_info);
 
     return ST_CONTINUE;
 }
@@ -420,11 +571,12 @@ void prof_call_tree_merge_internal(prof_call_tree_t* self, prof_call_tree_t* oth
     }
 
     // Merge measurements
-    prof_measurement_merge_internal(self->measurement, other->measurement);
+    prof_measurement_merge_internal(&self->measurement, &other->measurement);
+    prof_measurements_merge(self->extra_measurements, other->extra_measurements);
 
     // Now recursively descend through the call trees
     self_info_t self_info = { .call_tree = self, .method_table = self_method_table };
-    rb_st_foreach(other->children, prof_call_tree_merge_children, (st_data_t)&self_info);
+    call_tree_table_foreach(&other->children, prof_call_tree_merge_children, (st_data_t)&self_info);
 }
 
 /* :nodoc: */
@@ -435,7 +587,9 @@ static VALUE prof_call_tree_dump(VALUE self)
 
     rb_hash_aset(result, ID2SYM(rb_intern("owner")), INT2FIX(call_tree_data->owner));
 
-    rb_hash_aset(result, ID2SYM(rb_intern("measurement")), prof_measurement_wrap(call_tree_data->measurement));
+    rb_hash_aset(result, ID2SYM(rb_intern("measurement")), prof_measurement_wrap(&call_tree_data->measurement));
+    rb_hash_aset(result, ID2SYM(rb_intern("extra_measurements")), prof_measurements_wrap(NULL, call_tree_data->extra_measurements));
+    prof_call_tree_pin_measurements(call_tree_data);
 
     rb_hash_aset(result, ID2SYM(rb_intern("source_file")), call_tree_data->source_file);
     rb_hash_aset(result, ID2SYM(rb_intern("source_line")), INT2FIX(call_tree_data->source_line));
@@ -458,7 +612,8 @@ static VALUE prof_call_tree_load(VALUE self, VALUE data)
     call_tree->owner = FIX2INT(rb_hash_aref(data, ID2SYM(rb_intern("owner"))));
 
     VALUE measurement = rb_hash_aref(data, ID2SYM(rb_intern("measurement")));
-    call_tree->measurement = prof_get_measurement(measurement);
+    prof_measurement_copy_values(&call_tree->measurement, prof_get_measurement(measurement));
+    prof_measurements_unwrap(call_tree->extra_measurements, rb_hash_aref(data, ID2SYM(rb_intern("extra_measurements"))));
 
     call_tree->source_file = rb_hash_aref(data, ID2SYM(rb_intern("source_file")));
     call_tree->source_line = FIX2INT(rb_hash_aref(data, ID2SYM(rb_intern("source_line"))));
@@ -474,7 +629,7 @@ static VALUE prof_call_tree_load(VALUE self, VALUE data)
         prof_call_tree_t* call_tree_data = prof_get_call_tree(call_tree_object);
 
         st_data_t key = call_tree_data->method ? call_tree_data->method->key : method_key(Qnil, 0);
-        call_tree_table_insert(call_tree->children, key, call_tree_data);
+        call_tree_table_insert(&call_tree->children, key, call_tree_data);
     }
 
     target = rb_hash_aref(data, ID2SYM(rb_intern("target")));
@@ -492,6 +647,7 @@ void rp_init_call_tree(void)
 
     rb_define_method(cRpCallTree, "target", prof_call_tree_target, 0);
     rb_define_method(cRpCallTree, "measurement", prof_call_tree_measurement, 0);
+    rb_define_method(cRpCallTree, "measurements", prof_call_tree_measurements, 0);
     rb_define_method(cRpCallTree, "parent", prof_call_tree_parent, 0);
     rb_define_method(cRpCallTree, "children", prof_call_tree_children, 0);
     rb_define_method(cRpCallTree, "add_child", prof_call_tree_add_child_ruby, 1);
@@ -9,14 +9,44 @@
 
 extern VALUE cRpCallTree;
 
+/* Number of children stored in a call tree before switching to a separately allocated table */
+#define CALL_TREE_TABLE_INLINE 3
+
+typedef struct call_tree_table_entry_t
+{
+    st_data_t key;                          /* Method key of the child */
+    struct prof_call_tree_t* call_tree;
+} call_tree_table_entry_t;
+
+/* Children of a call tree. Most call trees have only a few children, so they are kept inline and found by a
+   linear scan. Past CALL_TREE_TABLE_INLINE the entries move to an array indexed by open addressing bins.
+   Either way children are visited in the order they were added. */
+typedef struct call_tree_table_t
+{
+    uint32_t count;
+    uint32_t capacity;                      /* Zero while the entries are inline */
+    union
+    {
+        call_tree_table_entry_t inline_entries[CALL_TREE_TABLE_INLINE];
+        struct
+        {
+            call_tree_table_entry_t* entries;
+            uint32_t* bins;                 /* 2 * capacity entry indexes plus one, zero if empty */
+        };
+    };
+} call_tree_table_t;
+
 /* Callers and callee information for a method. */
 typedef struct prof_call_tree_t
 {
     prof_owner_t owner;
+    bool in_arena;                  /* Allocated from a thread's arena, so it is freed with the arena */
+    bool pinned;                    /* Its objects are in its profile's values table, see prof_profile_pin_value */
     prof_method_t* method;
     struct prof_call_tree_t* parent;
-    st_table* children;             /* Call infos that this call info calls */
-    prof_measurement_t* measurement;
+    prof_measurement_t measurement; /* Embedded since it is updated on every return */
+    call_tree_table_t children;     /* Call infos that this call info calls */
+    prof_measurement_t* extra_measurements[MAX_EXTRA_MEASUREMENTS]; /* Profiles recording several measure modes */
     VALUE object;
 
     int visits;                             /* Current visits on the stack */
@@ -25,11 +55,12 @@ typedef struct prof_call_tree_t
     VALUE source_file;
 } prof_call_tree_t;
 
-prof_call_tree_t* prof_call_tree_create(prof_method_t* method, prof_call_tree_t* parent, VALUE source_file, int source_line);
+prof_call_tree_t* prof_call_tree_create(prof_arena_t* arena, prof_method_t* method, prof_call_tree_t* parent, VALUE source_file, int source_line);
 prof_call_tree_t* prof_call_tree_copy(prof_call_tree_t* other);
 void prof_call_tree_merge_internal(prof_call_tree_t* destination, prof_call_tree_t* other, st_table* method_table);
 void prof_call_tree_mark(void* data);
-prof_call_tree_t* call_tree_table_lookup(st_table* table, st_data_t key);
+prof_call_tree_t* call_tree_table_lookup(call_tree_table_t* table, st_data_t key);
+void call_tree_table_foreach(call_tree_table_t* table, st_foreach_callback_func* func, st_data_t data);
 
 void prof_call_tree_add_parent(prof_call_tree_t* self, prof_call_tree_t* parent);
 void prof_call_tree_add_child(prof_call_tree_t* self, prof_call_tree_t* child);
@@ -86,7 +86,8 @@ static int prof_call_trees_collect_callees(st_data_t key, st_data_t value, st_da
 
     if (rb_st_lookup(callers, call_tree_data->method->key, (st_data_t*)&aggregate_call_tree_data))
     {
-      prof_measurement_merge_internal(aggregate_call_tree_data->measurement, call_tree_data->measurement);
+      prof_measurement_merge_internal(&aggregate_call_tree_data->measurement, &call_tree_data->measurement);
+      prof_measurements_merge(aggregate_call_tree_data->extra_measurements, call_tree_data->extra_measurements);
     }
     else
     {
@@ -214,7 +215,8 @@ VALUE prof_call_trees_callers(VALUE self)
 
         if (rb_st_lookup(callers, parent->method->key, (st_data_t*)&aggregate_call_tree_data))
         {
-          prof_measurement_merge_internal(aggregate_call_tree_data->measurement, (*p_call_tree)->measurement);
+          prof_measurement_merge_internal(&aggregate_call_tree_data->measurement, &(*p_call_tree)->measurement);
+          prof_measurements_merge(aggregate_call_tree_data->extra_measurements, (*p_call_tree)->extra_measurements);
         }
         else
         {
@@ -244,7 +246,7 @@ VALUE prof_call_trees_callees(VALUE self)
     prof_call_trees_t* call_trees = prof_get_call_trees(self);
     for (prof_call_tree_t** call_tree = call_trees->start; call_tree < call_trees->ptr; call_tree++)
     {
-        rb_st_foreach((*call_tree)->children, prof_call_trees_collect_callees, (st_data_t)callees);
+        call_tree_table_foreach(&(*call_tree)->children, prof_call_trees_collect_callees, (st_data_t)callees);
     }
 
     VALUE result = rb_ary_new_capa((long)callees->num_entries);
@@ -0,0 +1,199 @@
+/* Copyright (C) 2005-2019 Shugo Maeda <shugo@ruby-lang.org> and Charlie Savage <cfis@savagexi.com>
+   Please see the LICENSE file for copyright and distribution information */
+
+/* Deferred aggregation support. Instead of building call trees while the profiled code runs, the event hook
+   appends each event to a per-thread log. The logs are replayed into call trees and methods when the profile
+   is stopped, which moves call tree lookups and allocations off the profiled code's critical path. */
+
+#include "rp_event_log.h"
+
+static prof_event_chunk_t* prof_event_chunk_create(size_t capacity)
+{
+    prof_event_chunk_t* result = (prof_event_chunk_t*)xmalloc(sizeof(prof_event_chunk_t) + capacity * sizeof(prof_event_t));
+    result->next = NULL;
+    result->count = 0;
+    result->capacity = capacity;
+    return result;
+}
+
+prof_event_log_t* prof_event_log_create(void)
+{
+    prof_event_log_t* result = ALLOC(prof_event_log_t);
+    result->head = result->tail = NULL;
+    result->lines = NULL;
+    result->line_count = 0;
+    result->line_capacity = 0;
+    result->source_files = rb_st_init_numtable();
+    result->last_source_file = Qnil;
+    return result;
+}
+
+void prof_event_log_free(prof_event_log_t* log)
+{
+    prof_event_chunk_t* chunk = log->head;
+    while (chunk)
+    {
+        prof_event_chunk_t* next = chunk->next;
+        xfree(chunk);
+        chunk = next;
+    }
+
+    xfree(log->lines);
+    rb_st_free_table(log->source_files);
+    xfree(log);
+}
+
+static int mark_source_files(st_data_t key, st_data_t value, st_data_t data)
+{
+    rb_gc_mark((VALUE)key);
+    return ST_CONTINUE;
+}
+
+void prof_event_log_mark(prof_event_log_t* log)
+{
+    rb_st_foreach(log->source_files, mark_source_files, 0);
+}
+
+prof_event_chunk_t* prof_event_log_grow(prof_event_log_t* log)
+{
+    size_t capacity = EVENT_LOG_FIRST_CHUNK_SIZE;
+    if (log->tail)
+        capacity = log->tail->capacity < EVENT_LOG_CHUNK_SIZE / 2 ? log->tail->capacity * 2 : EVENT_LOG_CHUNK_SIZE;
+
+    prof_event_chunk_t* chunk = prof_event_chunk_create(capacity);
+    if (log->tail)
+        log->tail->next = chunk;
+    else
+        log->head = chunk;
+    log->tail = chunk;
+    return chunk;
+}
+
+void prof_event_log_grow_lines(prof_event_log_t* log)
+{
+    log->line_capacity = log->line_capacity ? log->line_capacity * 2 : EVENT_LOG_FIRST_CHUNK_SIZE;
+    REALLOC_N(log->lines, prof_line_event_t, log->line_capacity);
+}
+
+static void replay_event(prof_profile_t* profile, thread_data_t* thread_data, prof_event_t* event, prof_line_event_t** line, bool* paused)
+{
+    prof_frame_t* frame = prof_frame_current(thread_data->stack);
+
+    switch (event->kind)
+    {
+        case EVENT_LOG_CALL:
+        {
+            if (!event->method)
+            {
+                if (frame)
+                    frame->excluded_depth++;
+                break;
+            }
+
+            frame = prof_enter_method(profile, thread_data, event->method, event->measurement, *paused);
+            frame->traced = true;
+            break;
+        }
+        case EVENT_LOG_RETURN:
+        {
+            if (!frame)
+                break;
+
+            if (frame->excluded_depth > 0)
+            {
+                frame->excluded_depth--;
+                break;
+            }
+
+            if (!frame->traced && !event->method)
+                break;
+
+            prof_frame_pop(thread_data->stack, event->measurement);
+            break;
+        }
+        case EVENT_LOG_LINE:
+        {
+            prof_line_event_t* location = (*line)++;
+
+            if (!frame)
+            {
+                if (!event->method)
+                    break;
+
+                frame = prof_enter_running_method(thread_data, event->method, event->measurement, *paused);
+            }
+
+            frame->source_file = location->source_file;
+            frame->source_line = location->source_line;
+            break;
+        }
+        case EVENT_LOG_SUSPEND:
+        {
+            if (frame)
+                frame->switch_time = event->measurement;
+            break;
+        }
+        case EVENT_LOG_RESUME:
+        {
+            if (frame && frame->switch_time >= 0)
+            {
+                frame->wait_time += event->measurement - frame->switch_time;
+                frame->switch_time = -1;
+            }
+            break;
+        }
+        case EVENT_LOG_PAUSE:
+        {
+            *paused = true;
+            prof_frame_pause(thread_data->stack, frame, event->measurement);
+            break;
+        }
+        case EVENT_LOG_UNPAUSE:
+        {
+            *paused = false;
+            if (frame)
+                prof_frame_unpause(thread_data->stack, frame, event->measurement);
+            break;
+        }
+        case EVENT_LOG_GC:
+        {
+            prof_charge_gc(thread_data, event->gc_count, event->measurement);
+            break;
+        }
+    }
+}
+
+/* Replays a thread's events into its call tree and then frees the log. Since replaying takes time, frames
+   still on the stack are popped using the measurement taken when the profile was stopped. */
+void prof_event_log_replay(prof_profile_t* profile, thread_data_t* thread_data, int64_t stop_measurement)
+{
+    prof_event_log_t* log = thread_data->event_log;
+    if (!log)
+        return;
+
+    // Methods created while replaying are added to the last thread
+    thread_data_t* last_thread_data = profile->last_thread_data;
+    profile->last_thread_data = thread_data;
+
+    bool paused = false;
+    prof_line_event_t* line = log->lines;
+    for (prof_event_chunk_t* chunk = log->head; chunk; chunk = chunk->next)
+    {
+        for (size_t i = 0; i < chunk->count; i++)
+            replay_event(profile, thread_data, &chunk->events[i], &line, &paused);
+    }
+
+    // Fibers other than the one that stopped the profile are waiting until the end
+    if (thread_data != last_thread_data)
+    {
+        prof_event_t resume = {.measurement = stop_measurement, .method = NULL, .kind = EVENT_LOG_RESUME, .gc_count = 0};
+        replay_event(profile, thread_data, &resume, &line, &paused);
+    }
+
+    while (prof_frame_pop(thread_data->stack, stop_measurement));
+
+    profile->last_thread_data = last_thread_data;
+
+    thread_data->event_log = NULL;
+    prof_event_log_free(log);
+}
@@ -0,0 +1,94 @@
+/* Copyright (C) 2005-2019 Shugo Maeda <shugo@ruby-lang.org> and Charlie Savage <cfis@savagexi.com>
+   Please see the LICENSE file for copyright and distribution information */
+
+#pragma once
+
+#include "ruby_prof.h"
+#include "rp_profile.h"
+
+/* Chunks start small, since every thread and fiber gets a log, and double up to the maximum size */
+#define EVENT_LOG_FIRST_CHUNK_SIZE 64
+#define EVENT_LOG_CHUNK_SIZE 4096
+
+typedef enum
+{
+    EVENT_LOG_CALL,                       // Method called, method is NULL if excluded
+    EVENT_LOG_RETURN,                     // Method returned, method is NULL if excluded
+    EVENT_LOG_LINE,                       // New line executed, its location is the next line record
+    EVENT_LOG_SUSPEND,                    // Switched away from this fiber
+    EVENT_LOG_RESUME,                     // Switched back to this fiber
+    EVENT_LOG_PAUSE,                      // Profile paused
+    EVENT_LOG_UNPAUSE,                    // Profile resumed
+    EVENT_LOG_GC                          // Garbage collection, measurement is its duration
+} prof_event_kind_t;
+
+/* A single recorded event. These are kept small since one is written for every traced event. */
+typedef struct prof_event_t
+{
+    int64_t measurement;
+    prof_method_t* method;
+    prof_event_kind_t kind;
+    unsigned int gc_count;                // Collections for EVENT_LOG_GC
+} prof_event_t;
+
+/* Where a line event happened. Only line events need a location, so they are kept apart from the events
+   and replayed in the same order. */
+typedef struct prof_line_event_t
+{
+    VALUE source_file;
+    int source_line;
+} prof_line_event_t;
+
+typedef struct prof_event_chunk_t
+{
+    struct prof_event_chunk_t* next;
+    size_t count;
+    size_t capacity;
+    prof_event_t events[];
+} prof_event_chunk_t;
+
+/* Events recorded for a thread while profiling with deferred: true. They are replayed into call trees
+   when the profile is stopped. */
+typedef struct prof_event_log_t
+{
+    prof_event_chunk_t* head;             // NULL until the first event
+    prof_event_chunk_t* tail;
+    prof_line_event_t* lines;
+    size_t line_count;
+    size_t line_capacity;
+    st_table* source_files;               // Source files referenced by line events, kept alive until replay
+    VALUE last_source_file;
+} prof_event_log_t;
+
+prof_event_log_t* prof_event_log_create(void);
+void prof_event_log_free(prof_event_log_t* log);
+void prof_event_log_mark(prof_event_log_t* log);
+prof_event_chunk_t* prof_event_log_grow(prof_event_log_t* log);
+void prof_event_log_grow_lines(prof_event_log_t* log);
+void prof_event_log_replay(prof_profile_t* profile, thread_data_t* thread_data, int64_t stop_measurement);
+
+static inline prof_event_t* prof_event_log_append(prof_event_log_t* log, prof_event_kind_t kind, prof_method_t* method, int64_t measurement)
+{
+    prof_event_chunk_t* chunk = log->tail;
+    if (!chunk || chunk->count == chunk->capacity)
+        chunk = prof_event_log_grow(log);
+
+    prof_event_t* event = &chunk->events[chunk->count++];
+    event->kind = kind;
+    event->method = method;
+    event->measurement = measurement;
+    event->gc_count = 0;
+    return event;
+}
+
+static inline void prof_event_log_append_line(prof_event_log_t* log, prof_method_t* method, int64_t measurement, VALUE source_file, int source_line)
+{
+    prof_event_log_append(log, EVENT_LOG_LINE, method, measurement);
+
+    if (log->line_count == log->line_capacity)
+        prof_event_log_grow_lines(log);
+
+    prof_line_event_t* line = &log->lines[log->line_count++];
+    line->source_file = source_file;
+    line->source_line = source_line;
+}
@@ -0,0 +1,102 @@
+/* Copyright (C) 2005-2019 Shugo Maeda <shugo@ruby-lang.org> and Charlie Savage <cfis@savagexi.com>
+   Please see the LICENSE file for copyright and distribution information */
+
+/* Splits the time a thread waits for other threads into time spent waiting to acquire the GVL and time spent
+   blocked, for example sleeping or doing IO. Ruby 3.2 added thread event hooks that report when a thread
+   is ready to run (it wants the GVL) and when it resumes (it acquired the GVL). The hooks run on the thread
+   that is waiting, without holding the GVL, so they can only read the clock and update memory that is
+   owned by that native thread.
+
+   Each native thread has a thread local pointer to the prof_gvl_wait_t of the profiled thread (or fiber)
+   that last ran on it. The pointer is tagged with the id of the profile run that set it so hooks ignore
+   pointers left behind by earlier runs. When a thread is suspended the profiler records its GVL wait total,
+   and when it is resumed the increase is charged to the frame as GVL wait time. */
+
+#include "rp_gvl.h"
+#include "rp_profile.h"
+
+#include <ruby/thread.h>
+#include <ruby/version.h>
+
+#if RUBY_API_VERSION_CODE >= 30200
+#define RP_HAVE_THREAD_EVENTS 1
+#endif
+
+typedef struct prof_gvl_current_t
+{
+    uintptr_t id;
+    prof_gvl_wait_t* wait;
+} prof_gvl_current_t;
+
+static RP_THREAD_LOCAL prof_gvl_current_t gvl_current = {0, NULL};
+
+/* Ids are never reused, so a stale thread local pointer can not match a later run */
+static uintptr_t gvl_last_id = 0;
+
+bool prof_gvl_supported(prof_profile_t* profile)
+{
+#if defined(RP_HAVE_THREAD_EVENTS)
+    // The hook reads the clock without the GVL, so only clocks that are safe to read and comparable
+    // across threads are supported
+    return !profile->deferred && !profile->sampling &&
+           (profile->measurer->mode == MEASURE_WALL_TIME || profile->measurer->mode == MEASURE_TSC_TIME);
+#else
+    return false;
+#endif
+}
+
+#if defined(RP_HAVE_THREAD_EVENTS)
+static void prof_gvl_event_hook(rb_event_flag_t event, const rb_internal_thread_event_data_t* event_data, void* data)
+{
+    prof_profile_t* profile = (prof_profile_t*)data;
+    prof_gvl_wait_t* wait = gvl_current.wait;
+
+    if (!wait || gvl_current.id != profile->gvl_id)
+        return;
+
+    if (event == RUBY_INTERNAL_THREAD_EVENT_READY)
+    {
+        wait->ready_time = prof_measure(profile->measurer, NULL);
+    }
+    else if (wait->ready_time >= 0)
+    {
+        wait->total_time += prof_measure(profile->measurer, NULL) - wait->ready_time;
+        wait->ready_time = -1;
+    }
+}
+#endif
+
+void prof_gvl_install(prof_profile_t* profile)
+{
+#if defined(RP_HAVE_THREAD_EVENTS)
+    if (!prof_gvl_supported(profile) || profile->gvl_hook)
+        return;
+
+    profile->gvl_id = ++gvl_last_id;
+    profile->gvl_hook = rb_internal_thread_add_event_hook(prof_gvl_event_hook,
+                                                          RUBY_INTERNAL_THREAD_EVENT_READY | RUBY_INTERNAL_THREAD_EVENT_RESUMED,
+                                                          profile);
+#endif
+}
+
+void prof_gvl_remove(prof_profile_t* profile)
+{
+#if defined(RP_HAVE_THREAD_EVENTS)
+    // Removing the hook waits for hooks that are running on other threads
+    if (profile->gvl_hook)
+        rb_internal_thread_remove_event_hook((rb_internal_thread_event_hook_t*)profile->gvl_hook);
+#endif
+    profile->gvl_hook = NULL;
+    profile->gvl_id = 0;
+}
+
+/* Called on the native thread that is running the thread (or fiber) that owns wait */
+void prof_gvl_attach(prof_profile_t* profile, prof_gvl_wait_t* wait)
+{
+    if (!profile->gvl_hook)
+        return;
+
+    wait->ready_time = -1;
+    gvl_current.id = profile->gvl_id;
+    gvl_current.wait = wait;
+}
@@ -0,0 +1,20 @@
+/* Copyright (C) 2005-2019 Shugo Maeda <shugo@ruby-lang.org> and Charlie Savage <cfis@savagexi.com>
+   Please see the LICENSE file for copyright and distribution information */
+
+#pragma once
+
+#include "ruby_prof.h"
+
+struct prof_profile_t;
+
+/* Time a thread spent waiting to acquire the GVL. Updated by the thread event hook, which runs without the GVL. */
+typedef struct prof_gvl_wait_t
+{
+    volatile int64_t ready_time;   /* Measurement when the thread asked for the GVL, -1 if it is not waiting */
+    volatile int64_t total_time;   /* Time spent waiting for the GVL */
+} prof_gvl_wait_t;
+
+bool prof_gvl_supported(struct prof_profile_t* profile);
+void prof_gvl_install(struct prof_profile_t* profile);
+void prof_gvl_remove(struct prof_profile_t* profile);
+void prof_gvl_attach(struct prof_profile_t* profile, prof_gvl_wait_t* wait);
@@ -0,0 +1,133 @@
+/* Copyright (C) 2005-2019 Shugo Maeda <shugo@ruby-lang.org> and Charlie Savage <cfis@savagexi.com>
+   Please see the LICENSE file for copyright and distribution information */
+
+/* Tracks which recorded objects are still alive so retained objects can be charged to their allocations when
+   a profile is stopped. Objects are removed when Ruby frees them and rekeyed when compaction moves them,
+   both of which happen during garbage collection when Ruby's allocator can not be used. Thus this is a
+   small open addressing table that uses the C library's allocator. */
+
+#include "rp_live_objects.h"
+
+#include <stdlib.h>
+
+#define INITIAL_CAPACITY 1024
+
+static inline size_t live_object_index(prof_live_objects_t* live_objects, VALUE object)
+{
+    // Objects are aligned, so mix the address before masking
+    return (size_t)(((uint64_t)object >> 3) * 0x9E3779B97F4A7C15ULL) & (live_objects->capacity - 1);
+}
+
+static prof_live_object_t* live_objects_allocate(size_t capacity)
+{
+    prof_live_object_t* result = calloc(capacity, sizeof(prof_live_object_t));
+    if (!result)
+        rb_bug("ruby-prof could not allocate memory for live objects");
+    return result;
+}
+
+static void live_objects_put(prof_live_objects_t* live_objects, VALUE object, prof_allocation_t* allocation)
+{
+    size_t index = live_object_index(live_objects, object);
+    while (live_objects->slots[index].object && live_objects->slots[index].object != object)
+        index = (index + 1) & (live_objects->capacity - 1);
+
+    if (!live_objects->slots[index].object)
+        live_objects->count++;
+
+    live_objects->slots[index].object = object;
+    live_objects->slots[index].allocation = allocation;
+}
+
+/* Moves the objects into new slots, updating the address of objects moved by compaction */
+static void live_objects_rehash(prof_live_objects_t* live_objects, size_t capacity)
+{
+    prof_live_object_t* slots = live_objects->slots;
+    size_t old_capacity = live_objects->capacity;
+
+    live_objects->slots = live_objects_allocate(capacity);
+    live_objects->capacity = capacity;
+    live_objects->count = 0;
+
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (slots[i].object)
+            live_objects_put(live_objects, rb_gc_location(slots[i].object), slots[i].allocation);
+    }
+
+    free(slots);
+}
+
+prof_live_objects_t* prof_live_objects_create(void)
+{
+    prof_live_objects_t* result = ALLOC(prof_live_objects_t);
+    result->slots = live_objects_allocate(INITIAL_CAPACITY);
+    result->capacity = INITIAL_CAPACITY;
+    result->count = 0;
+    return result;
+}
+
+void prof_live_objects_free(prof_live_objects_t* live_objects)
+{
+    free(live_objects->slots);
+    xfree(live_objects);
+}
+
+void prof_live_objects_insert(prof_live_objects_t* live_objects, VALUE object, prof_allocation_t* allocation)
+{
+    // Keep the table at most half full so probe sequences stay short
+    if ((live_objects->count + 1) * 2 > live_objects->capacity)
+        live_objects_rehash(live_objects, live_objects->capacity * 2);
+
+    live_objects_put(live_objects, object, allocation);
+}
+
+/* Called when an object is freed, most of which were never recorded */
+void prof_live_objects_delete(prof_live_objects_t* live_objects, VALUE object)
+{
+    size_t mask = live_objects->capacity - 1;
+    size_t index = live_object_index(live_objects, object);
+
+    while (live_objects->slots[index].object != object)
+    {
+        if (!live_objects->slots[index].object)
+            return;
+        index = (index + 1) & mask;
+    }
+
+    /* Shift following objects back into the hole so lookups do not stop early. An object can move to the
+       hole if its home slot is not cyclically between the hole and its current slot. */
+    size_t hole = index;
+    size_t next = (hole + 1) & mask;
+    while (live_objects->slots[next].object)
+    {
+        size_t home = live_object_index(live_objects, live_objects->slots[next].object);
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            live_objects->slots[hole] = live_objects->slots[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+
+    live_objects->slots[hole].object = 0;
+    live_objects->slots[hole].allocation = NULL;
+    live_objects->count--;
+}
+
+/* Called by the profile's compaction callback. Objects are not marked, so they are not kept alive, but live
+   ones may have moved. */
+void prof_live_objects_compact(prof_live_objects_t* live_objects)
+{
+    live_objects_rehash(live_objects, live_objects->capacity);
+}
+
+/* Charges the objects that are still alive to the allocations that created them */
+void prof_live_objects_retain(prof_live_objects_t* live_objects, uint64_t weight)
+{
+    for (size_t i = 0; i < live_objects->capacity; i++)
+    {
+        if (live_objects->slots[i].object)
+            prof_allocate_retain(live_objects->slots[i].allocation, live_objects->slots[i].object, weight);
+    }
+}
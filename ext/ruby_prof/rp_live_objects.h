@@ -0,0 +1,28 @@
+/* Copyright (C) 2005-2019 Shugo Maeda <shugo@ruby-lang.org> and Charlie Savage <cfis@savagexi.com>
+   Please see the LICENSE file for copyright and distribution information */
+
+#pragma once
+
+#include "ruby_prof.h"
+#include "rp_allocation.h"
+
+typedef struct prof_live_object_t
+{
+    VALUE object;                     /* Zero if the slot is empty */
+    prof_allocation_t* allocation;
+} prof_live_object_t;
+
+/* Recorded objects that have not been freed, keyed on their address */
+typedef struct prof_live_objects_t
+{
+    prof_live_object_t* slots;
+    size_t capacity;                  /* Always a power of two */
+    size_t count;
+} prof_live_objects_t;
+
+prof_live_objects_t* prof_live_objects_create(void);
+void prof_live_objects_free(prof_live_objects_t* live_objects);
+void prof_live_objects_insert(prof_live_objects_t* live_objects, VALUE object, prof_allocation_t* allocation);
+void prof_live_objects_delete(prof_live_objects_t* live_objects, VALUE object);
+void prof_live_objects_compact(prof_live_objects_t* live_objects);
+void prof_live_objects_retain(prof_live_objects_t* live_objects, uint64_t weight);
@@ -6,12 +6,12 @@
 #include "rp_measurement.h"
 
 static VALUE cMeasureAllocations;
+static VALUE cMeasureAllocatedBytes;
 VALUE total_allocated_objects_key;
 
-static double measure_allocations(rb_trace_arg_t* trace_arg)
+/* Each profile (and each of its measure modes) has its own measurer, and so its own running total */
+static int64_t measure_allocations(prof_measurer_t* measurer, rb_trace_arg_t* trace_arg)
 {
-    static double result = 0;
-
     if (trace_arg)
     {
         // Only process creation of new objects
@@ -20,10 +20,10 @@ static double measure_allocations(rb_trace_arg_t* trace_arg)
             // Don't count allocations of internal IMemo objects
             VALUE object = rb_tracearg_object(trace_arg);
             if (BUILTIN_TYPE(object) != T_IMEMO)
-                result++;
+                measurer->count++;
         }
     }
-    return result;
+    return measurer->count;
 }
 
 prof_measurer_t* prof_measurer_allocations(bool track_allocations)
@@ -31,7 +31,41 @@ prof_measurer_t* prof_measurer_allocations(bool track_allocations)
     prof_measurer_t* measure = ALLOC(prof_measurer_t);
     measure->mode = MEASURE_ALLOCATIONS;
     measure->measure = measure_allocations;
-    measure->multiplier = 1;
+    measure->resolution = 1;
+    measure->thread_local = false;
+    // Need to track allocations to get RUBY_INTERNAL_EVENT_NEWOBJ event
+    measure->track_allocations = true;
+
+    return measure;
+}
+
+static int64_t measure_allocated_bytes(prof_measurer_t* measurer, rb_trace_arg_t* trace_arg)
+{
+    // Objects are not initialized when the newobj event fires, so their size is added at the next measurement
+    if (measurer->pending_object != Qnil)
+    {
+        measurer->count += rb_obj_memsize_of(measurer->pending_object);
+        measurer->pending_object = Qnil;
+    }
+
+    // Don't count allocations of internal IMemo objects
+    if (trace_arg && rb_tracearg_event_flag(trace_arg) == RUBY_INTERNAL_EVENT_NEWOBJ)
+    {
+        VALUE object = rb_tracearg_object(trace_arg);
+        if (BUILTIN_TYPE(object) != T_IMEMO)
+            measurer->pending_object = object;
+    }
+
+    return measurer->count;
+}
+
+prof_measurer_t* prof_measurer_allocated_bytes(bool track_allocations)
+{
+    prof_measurer_t* measure = ALLOC(prof_measurer_t);
+    measure->mode = MEASURE_ALLOCATED_BYTES;
+    measure->measure = measure_allocated_bytes;
+    measure->resolution = 1;
+    measure->thread_local = false;
     // Need to track allocations to get RUBY_INTERNAL_EVENT_NEWOBJ event
     measure->track_allocations = true;
 
@@ -42,6 +76,8 @@ void rp_init_measure_allocations(void)
 {
     total_allocated_objects_key = ID2SYM(rb_intern("total_allocated_objects"));
     rb_define_const(mProf, "ALLOCATIONS", INT2NUM(MEASURE_ALLOCATIONS));
+    rb_define_const(mProf, "ALLOCATED_BYTES", INT2NUM(MEASURE_ALLOCATED_BYTES));
 
     cMeasureAllocations = rb_define_class_under(mMeasure, "Allocations", rb_cObject);
+    cMeasureAllocatedBytes = rb_define_class_under(mMeasure, "AllocatedBytes", rb_cObject);
 }
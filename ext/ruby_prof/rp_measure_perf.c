@@ -0,0 +1,250 @@
+/* Copyright (C) 2005-2019 Shugo Maeda <shugo@ruby-lang.org> and Charlie Savage <cfis@savagexi.com>
+   Please see the LICENSE file for copyright and distribution information */
+
+   /* :nodoc: */
+/* Needed for syscall since the extension is compiled in strict C mode */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE 1
+#endif
+
+#include "rp_measurement.h"
+
+#if defined(__linux__)
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static VALUE cMeasurePerfEvent;
+
+/* Measure modes backed by perf_event_open, in the order of the MEASURE_INSTRUCTIONS..MEASURE_CONTEXT_SWITCHES
+   values of prof_measure_mode_t */
+#define PERF_EVENT_COUNT (MEASURE_CONTEXT_SWITCHES - MEASURE_INSTRUCTIONS + 1)
+
+static inline int perf_event_index(prof_measure_mode_t mode)
+{
+    return mode - MEASURE_INSTRUCTIONS;
+}
+
+#if defined(__linux__)
+typedef struct
+{
+    uint32_t type;
+    uint64_t config;
+    double resolution;
+} perf_event_spec_t;
+
+static const perf_event_spec_t perf_event_specs[PERF_EVENT_COUNT] =
+{
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 1},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 1},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, 1},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 1},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, 1000000000.0},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, 1},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, 1}
+};
+
+/* Counters only count the thread that opened them, so each native thread opens its own the first time it is
+   measured. They are closed when the thread exits. */
+typedef struct
+{
+    int fds[PERF_EVENT_COUNT];
+} perf_event_fds_t;
+
+static pthread_key_t perf_event_key;
+
+static void perf_event_fds_free(void* data)
+{
+    perf_event_fds_t* fds = (perf_event_fds_t*)data;
+    for (int i = 0; i < PERF_EVENT_COUNT; i++)
+    {
+        if (fds->fds[i] >= 0)
+            close(fds->fds[i]);
+    }
+    free(fds);
+}
+
+static int perf_event_open_counter(prof_measure_mode_t mode)
+{
+    const perf_event_spec_t* spec = &perf_event_specs[perf_event_index(mode)];
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = spec->type;
+    attr.config = spec->config;
+    attr.exclude_hv = 1;
+
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+
+    // Unprivileged processes may only be allowed to count user space events
+    if (fd < 0 && (errno == EACCES || errno == EPERM))
+    {
+        attr.exclude_kernel = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+
+    return fd;
+}
+
+static int perf_event_fd(prof_measure_mode_t mode)
+{
+    perf_event_fds_t* fds = pthread_getspecific(perf_event_key);
+
+    if (!fds)
+    {
+        fds = malloc(sizeof(perf_event_fds_t));
+        if (!fds)
+            return -1;
+        for (int i = 0; i < PERF_EVENT_COUNT; i++)
+            fds->fds[i] = -2;
+        pthread_setspecific(perf_event_key, fds);
+    }
+
+    int index = perf_event_index(mode);
+    if (fds->fds[index] == -2)
+        fds->fds[index] = perf_event_open_counter(mode);
+
+    return fds->fds[index];
+}
+
+static inline int64_t perf_event_read(prof_measure_mode_t mode)
+{
+    int fd = perf_event_fd(mode);
+    uint64_t count = 0;
+
+    if (fd >= 0 && read(fd, &count, sizeof(count)) != sizeof(count))
+        count = 0;
+
+    return (int64_t)count;
+}
+
+static int64_t measure_instructions(prof_measurer_t* measurer, rb_trace_arg_t* trace_arg)
+{
+    return perf_event_read(MEASURE_INSTRUCTIONS);
+}
+
+static int64_t measure_cpu_cycles(prof_measurer_t* measurer, rb_trace_arg_t* trace_arg)
+{
+    return perf_event_read(MEASURE_CPU_CYCLES);
+}
+
+static int64_t measure_cache_misses(prof_measurer_t* measurer, rb_trace_arg_t* trace_arg)
+{
+    return perf_event_read(MEASURE_CACHE_MISSES);
+}
+
+static int64_t measure_branch_misses(prof_measurer_t* measurer, rb_trace_arg_t* trace_arg)
+{
+    return perf_event_read(MEASURE_BRANCH_MISSES);
+}
+
+static int64_t measure_task_clock(prof_measurer_t* measurer, rb_trace_arg_t* trace_arg)
+{
+    return perf_event_read(MEASURE_TASK_CLOCK);
+}
+
+static int64_t measure_page_faults(prof_measurer_t* measurer, rb_trace_arg_t* trace_arg)
+{
+    return perf_event_read(MEASURE_PAGE_FAULTS);
+}
+
+static int64_t measure_context_switches(prof_measurer_t* measurer, rb_trace_arg_t* trace_arg)
+{
+    return perf_event_read(MEASURE_CONTEXT_SWITCHES);
+}
+
+static const get_measurement perf_event_measures[PERF_EVENT_COUNT] =
+{
+    measure_instructions,
+    measure_cpu_cycles,
+    measure_cache_misses,
+    measure_branch_misses,
+    measure_task_clock,
+    measure_page_faults,
+    measure_context_switches
+};
+
+/* Returns 0 if the counter can be opened, otherwise the error */
+static int perf_event_check(prof_measure_mode_t mode)
+{
+    int fd = perf_event_open_counter(mode);
+    if (fd < 0)
+        return errno;
+
+    close(fd);
+    return 0;
+}
+#endif
+
+prof_measurer_t* prof_measurer_perf_event(prof_measure_mode_t mode, bool track_allocations)
+{
+#if defined(__linux__)
+    int error = perf_event_check(mode);
+    if (error)
+    {
+        // Virtual machines often do not expose a hardware PMU, so count cpu time with the kernel's task clock instead
+        if (perf_event_specs[perf_event_index(mode)].type == PERF_TYPE_HARDWARE && perf_event_check(MEASURE_TASK_CLOCK) == 0)
+        {
+            rb_warn("Hardware performance counters are not available (%s), measuring task clock instead", strerror(error));
+            mode = MEASURE_TASK_CLOCK;
+        }
+        else
+        {
+            rb_raise(rb_eNotImpError, "Unable to open perf event counter: %s", strerror(error));
+        }
+    }
+
+    prof_measurer_t* measure = ALLOC(prof_measurer_t);
+    measure->mode = mode;
+    measure->measure = perf_event_measures[perf_event_index(mode)];
+    measure->resolution = perf_event_specs[perf_event_index(mode)].resolution;
+    // Counters are opened per thread
+    measure->thread_local = true;
+    measure->track_allocations = track_allocations;
+    return measure;
+#else
+    rb_raise(rb_eNotImpError, "Perf event measure modes are only supported on Linux");
+    return NULL;
+#endif
+}
+
+/* call-seq:
+   perf_event_supported?(mode) -> boolean
+
+   Returns whether the perf event counter for the given measure mode, for example RubyProf::INSTRUCTIONS, can be
+   opened by this process. */
+static VALUE prof_perf_event_supported(VALUE self, VALUE mode)
+{
+    int value = NUM2INT(mode);
+    if (value < MEASURE_INSTRUCTIONS || value > MEASURE_CONTEXT_SWITCHES)
+        rb_raise(rb_eArgError, "Not a perf event measure mode: %d", value);
+
+#if defined(__linux__)
+    return perf_event_check((prof_measure_mode_t)value) == 0 ? Qtrue : Qfalse;
+#else
+    return Qfalse;
+#endif
+}
+
+void rp_init_measure_perf_event(void)
+{
+#if defined(__linux__)
+    pthread_key_create(&perf_event_key, perf_event_fds_free);
+#endif
+
+    rb_define_const(mProf, "INSTRUCTIONS", INT2NUM(MEASURE_INSTRUCTIONS));
+    rb_define_const(mProf, "CPU_CYCLES", INT2NUM(MEASURE_CPU_CYCLES));
+    rb_define_const(mProf, "CACHE_MISSES", INT2NUM(MEASURE_CACHE_MISSES));
+    rb_define_const(mProf, "BRANCH_MISSES", INT2NUM(MEASURE_BRANCH_MISSES));
+    rb_define_const(mProf, "TASK_CLOCK", INT2NUM(MEASURE_TASK_CLOCK));
+    rb_define_const(mProf, "PAGE_FAULTS", INT2NUM(MEASURE_PAGE_FAULTS));
+    rb_define_const(mProf, "CONTEXT_SWITCHES", INT2NUM(MEASURE_CONTEXT_SWITCHES));
+
+    cMeasurePerfEvent = rb_define_class_under(mMeasure, "PerfEvent", rb_cObject);
+    rb_define_singleton_method(mProf, "perf_event_supported?", prof_perf_event_supported, 1);
+}
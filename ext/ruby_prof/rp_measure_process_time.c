@@ -9,7 +9,7 @@
 
 static VALUE cMeasureProcessTime;
 
-static double measure_process_time(rb_trace_arg_t* trace_arg)
+static int64_t measure_process_time(prof_measurer_t* measurer, rb_trace_arg_t* trace_arg)
 {
 #if defined(_WIN32)
     FILETIME  createTime;
@@ -27,21 +27,21 @@ static double measure_process_time(rb_trace_arg_t* trace_arg)
     userTimeInt.LowPart = userTime.dwLowDateTime;
     userTimeInt.HighPart = userTime.dwHighDateTime;
 
-    return (double)(kernelTimeInt.QuadPart + userTimeInt.QuadPart);
+    return (int64_t)(kernelTimeInt.QuadPart + userTimeInt.QuadPart);
 #else
     struct timespec clock;
     clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &clock);
-    return clock.tv_sec + (clock.tv_nsec / 1000000000.0);
+    return (int64_t)clock.tv_sec * 1000000000 + clock.tv_nsec;
 #endif
 }
 
-static double multiplier_process_time(void)
+static double resolution_process_time(void)
 {
 #if defined(_WIN32)
     // Times are in 100-nanosecond time units.  So instead of 10-9 use 10-7
-    return 1.0 / 10000000.0;
+    return 10000000.0;
 #else
-    return 1.0;
+    return 1000000000.0;
 #endif
 }
 
@@ -50,7 +50,8 @@ prof_measurer_t* prof_measurer_process_time(bool track_allocations)
     prof_measurer_t* measure = ALLOC(prof_measurer_t);
     measure->mode = MEASURE_PROCESS_TIME;
     measure->measure = measure_process_time;
-    measure->multiplier = multiplier_process_time();
+    measure->resolution = resolution_process_time();
+    measure->thread_local = false;
     measure->track_allocations = track_allocations;
     return measure;
 }
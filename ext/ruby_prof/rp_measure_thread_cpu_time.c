@@ -0,0 +1,65 @@
+/* Copyright (C) 2005-2019 Shugo Maeda <shugo@ruby-lang.org> and Charlie Savage <cfis@savagexi.com>
+   Please see the LICENSE file for copyright and distribution information */
+
+   /* :nodoc: */
+#include "rp_measurement.h"
+
+#if !defined(_WIN32)
+#include <time.h>
+#endif
+
+static VALUE cMeasureThreadCpuTime;
+
+static int64_t measure_thread_cpu_time(prof_measurer_t* measurer, rb_trace_arg_t* trace_arg)
+{
+#if defined(_WIN32)
+    FILETIME  createTime;
+    FILETIME  exitTime;
+    FILETIME  kernelTime;
+    FILETIME  userTime;
+
+    ULARGE_INTEGER kernelTimeInt;
+    ULARGE_INTEGER userTimeInt;
+
+    GetThreadTimes(GetCurrentThread(), &createTime, &exitTime, &kernelTime, &userTime);
+
+    kernelTimeInt.LowPart = kernelTime.dwLowDateTime;
+    kernelTimeInt.HighPart = kernelTime.dwHighDateTime;
+    userTimeInt.LowPart = userTime.dwLowDateTime;
+    userTimeInt.HighPart = userTime.dwHighDateTime;
+
+    return (int64_t)(kernelTimeInt.QuadPart + userTimeInt.QuadPart);
+#else
+    struct timespec clock;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &clock);
+    return (int64_t)clock.tv_sec * 1000000000 + clock.tv_nsec;
+#endif
+}
+
+static double resolution_thread_cpu_time(void)
+{
+#if defined(_WIN32)
+    // Times are in 100-nanosecond time units.  So instead of 10-9 use 10-7
+    return 10000000.0;
+#else
+    return 1000000000.0;
+#endif
+}
+
+prof_measurer_t* prof_measurer_thread_cpu_time(bool track_allocations)
+{
+    prof_measurer_t* measure = ALLOC(prof_measurer_t);
+    measure->mode = MEASURE_THREAD_CPU_TIME;
+    measure->measure = measure_thread_cpu_time;
+    measure->resolution = resolution_thread_cpu_time();
+    measure->thread_local = true;
+    measure->track_allocations = track_allocations;
+    return measure;
+}
+
+void rp_init_measure_thread_cpu_time(void)
+{
+    rb_define_const(mProf, "THREAD_CPU_TIME", INT2NUM(MEASURE_THREAD_CPU_TIME));
+
+    cMeasureThreadCpuTime = rb_define_class_under(mMeasure, "ThreadCpuTime", rb_cObject);
+}
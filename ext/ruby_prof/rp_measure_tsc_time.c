@@ -0,0 +1,161 @@
+/* Copyright (C) 2005-2019 Shugo Maeda <shugo@ruby-lang.org> and Charlie Savage <cfis@savagexi.com>
+   Please see the LICENSE file for copyright and distribution information */
+
+   /* :nodoc: */
+#include "rp_measurement.h"
+
+#if defined(_WIN32)
+#include <intrin.h>
+#else
+#include <time.h>
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h>
+#include <x86intrin.h>
+#define RP_HAVE_TSC 1
+#elif defined(_M_X64)
+#define RP_HAVE_TSC 1
+#elif defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+#define RP_HAVE_TSC 1
+#endif
+
+/* How long to compare the counter against the system clock when calibrating */
+#define CALIBRATION_SECONDS 0.01
+
+static VALUE cMeasureTscTime;
+
+prof_measurer_t* prof_measurer_wall_time(bool track_allocations);
+
+/* Ticks per second, zero until calibrated and negative if the counter can not be used */
+static double tsc_resolution = 0;
+
+#if defined(RP_HAVE_TSC)
+static int64_t measure_tsc_time(prof_measurer_t* measurer, rb_trace_arg_t* trace_arg)
+{
+#if defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(ticks));
+    return (int64_t)ticks;
+#else
+    return (int64_t)__rdtsc();
+#endif
+}
+
+static bool tsc_invariant(void)
+{
+#if defined(__aarch64__)
+    // The generic timer runs at a constant frequency by definition
+    return true;
+#elif defined(_M_X64)
+    int registers[4];
+    __cpuid(registers, 0x80000000);
+    if ((unsigned int)registers[0] < 0x80000007)
+        return false;
+    __cpuid(registers, 0x80000007);
+    return (registers[3] & (1 << 8)) != 0;
+#else
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if (__get_cpuid_max(0x80000000, NULL) < 0x80000007)
+        return false;
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return (edx & (1 << 8)) != 0;
+#endif
+}
+
+static double system_clock(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER time;
+    LARGE_INTEGER frequency;
+    QueryPerformanceCounter(&time);
+    QueryPerformanceFrequency(&frequency);
+    return (double)time.QuadPart / frequency.QuadPart;
+#else
+    struct timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec + (tv.tv_nsec / 1000000000.0);
+#endif
+}
+
+static double calibrate_tsc(void)
+{
+#if defined(__aarch64__)
+    uint64_t frequency;
+    __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(frequency));
+    if (frequency > 0)
+        return (double)frequency;
+#endif
+
+    if (!tsc_invariant())
+        return -1;
+
+    double start_time = system_clock();
+    int64_t start_ticks = measure_tsc_time(NULL, NULL);
+    double end_time;
+    int64_t end_ticks;
+
+    do
+    {
+        end_time = system_clock();
+        end_ticks = measure_tsc_time(NULL, NULL);
+    } while (end_time - start_time < CALIBRATION_SECONDS);
+
+    if (end_ticks <= start_ticks)
+        return -1;
+
+    return (end_ticks - start_ticks) / (end_time - start_time);
+}
+#endif
+
+static bool tsc_available(void)
+{
+#if defined(RP_HAVE_TSC)
+    if (tsc_resolution == 0)
+        tsc_resolution = calibrate_tsc();
+#else
+    tsc_resolution = -1;
+#endif
+    return tsc_resolution > 0;
+}
+
+prof_measurer_t* prof_measurer_tsc_time(bool track_allocations)
+{
+    prof_measurer_t* measure;
+
+#if defined(RP_HAVE_TSC)
+    if (tsc_available())
+    {
+        measure = ALLOC(prof_measurer_t);
+        measure->measure = measure_tsc_time;
+        measure->resolution = tsc_resolution;
+        measure->thread_local = false;
+        measure->track_allocations = track_allocations;
+    }
+    else
+#endif
+    {
+        // No usable counter, so measure the same way as wall time
+        measure = prof_measurer_wall_time(track_allocations);
+    }
+
+    measure->mode = MEASURE_TSC_TIME;
+    return measure;
+}
+
+/* call-seq:
+   tsc_invariant? -> boolean
+
+   Returns whether RubyProf::TSC_TIME reads the cpu's time stamp counter. If false it falls back to the same clock as RubyProf::WALL_TIME.*/
+static VALUE prof_tsc_invariant(VALUE self)
+{
+    return tsc_available() ? Qtrue : Qfalse;
+}
+
+void rp_init_measure_tsc_time(void)
+{
+    rb_define_const(mProf, "TSC_TIME", INT2NUM(MEASURE_TSC_TIME));
+
+    cMeasureTscTime = rb_define_class_under(mMeasure, "TscTime", rb_cObject);
+    rb_define_singleton_method(mProf, "tsc_invariant?", prof_tsc_invariant, 0);
+}
@@ -10,27 +10,27 @@
 
 static VALUE cMeasureWallTime;
 
-static double measure_wall_time(rb_trace_arg_t* trace_arg)
+static int64_t measure_wall_time(prof_measurer_t* measurer, rb_trace_arg_t* trace_arg)
 {
 #if defined(_WIN32)
     LARGE_INTEGER time;
     QueryPerformanceCounter(&time);
-    return (double)time.QuadPart;
+    return time.QuadPart;
 #else
     struct timespec tv;
     clock_gettime(CLOCK_MONOTONIC, &tv);
-    return tv.tv_sec + (tv.tv_nsec / 1000000000.0);
+    return (int64_t)tv.tv_sec * 1000000000 + tv.tv_nsec;
 #endif
 }
 
-static double multiplier_wall_time(void)
+static double resolution_wall_time(void)
 {
 #if defined(_WIN32)
     LARGE_INTEGER frequency;
     QueryPerformanceFrequency(&frequency);
-    return 1.0 / frequency.QuadPart;
+    return (double)frequency.QuadPart;
 #else
-    return 1.0;
+    return 1000000000.0;
 #endif
 }
 
@@ -39,7 +39,8 @@ prof_measurer_t* prof_measurer_wall_time(bool track_allocations)
     prof_measurer_t* measure = ALLOC(prof_measurer_t);
     measure->mode = MEASURE_WALL_TIME;
     measure->measure = measure_wall_time;
-    measure->multiplier = multiplier_wall_time();
+    measure->resolution = resolution_wall_time();
+    measure->thread_local = false;
     measure->track_allocations = track_allocations;
     return measure;
 }
@@ -3,51 +3,119 @@
 
 #include "rp_measurement.h"
 
+#include <math.h>
+
 VALUE mMeasure;
 VALUE cRpMeasurement;
 
+prof_measurer_t* prof_measurer_allocated_bytes(bool track_allocations);
 prof_measurer_t* prof_measurer_allocations(bool track_allocations);
+prof_measurer_t* prof_measurer_perf_event(prof_measure_mode_t mode, bool track_allocations);
 prof_measurer_t* prof_measurer_process_time(bool track_allocations);
+prof_measurer_t* prof_measurer_thread_cpu_time(bool track_allocations);
+prof_measurer_t* prof_measurer_tsc_time(bool track_allocations);
 prof_measurer_t* prof_measurer_wall_time(bool track_allocations);
 
 void rp_init_measure_allocations(void);
+void rp_init_measure_perf_event(void);
 void rp_init_measure_process_time(void);
+void rp_init_measure_thread_cpu_time(void);
+void rp_init_measure_tsc_time(void);
 void rp_init_measure_wall_time(void);
 
 prof_measurer_t* prof_measurer_create(prof_measure_mode_t measure, bool track_allocations)
 {
+    prof_measurer_t* result = NULL;
+
     switch (measure)
     {
     case MEASURE_WALL_TIME:
-        return prof_measurer_wall_time(track_allocations);
+        result = prof_measurer_wall_time(track_allocations);
+        break;
     case MEASURE_PROCESS_TIME:
-        return prof_measurer_process_time(track_allocations);
+        result = prof_measurer_process_time(track_allocations);
+        break;
+    case MEASURE_THREAD_CPU_TIME:
+        result = prof_measurer_thread_cpu_time(track_allocations);
+        break;
     case MEASURE_ALLOCATIONS:
-        return prof_measurer_allocations(track_allocations);
+        result = prof_measurer_allocations(track_allocations);
+        break;
+    case MEASURE_ALLOCATED_BYTES:
+        result = prof_measurer_allocated_bytes(track_allocations);
+        break;
+    case MEASURE_TSC_TIME:
+        result = prof_measurer_tsc_time(track_allocations);
+        break;
+    case MEASURE_INSTRUCTIONS:
+    case MEASURE_CPU_CYCLES:
+    case MEASURE_CACHE_MISSES:
+    case MEASURE_BRANCH_MISSES:
+    case MEASURE_TASK_CLOCK:
+    case MEASURE_PAGE_FAULTS:
+    case MEASURE_CONTEXT_SWITCHES:
+        result = prof_measurer_perf_event(measure, track_allocations);
+        break;
     default:
         rb_raise(rb_eArgError, "Unknown measure mode: %d", measure);
     }
-};
 
-double prof_measure(prof_measurer_t* measurer, rb_trace_arg_t* trace_arg)
+    result->count = 0;
+    result->pending_object = Qnil;
+    return result;
+}
+
+int64_t prof_measure(prof_measurer_t* measurer, rb_trace_arg_t* trace_arg)
 {
-    double measurement = measurer->measure(trace_arg);
-    return measurement * measurer->multiplier;
+    return measurer->measure(measurer, trace_arg);
+}
+
+void prof_measurer_mark(prof_measurer_t* measurer)
+{
+    // Pinned since its size is not read until the next measurement
+    rb_gc_mark(measurer->pending_object);
+}
+
+/* Returns whether the measurer counts newobj events, so it must see every allocation */
+bool prof_measurer_counts_allocations(prof_measurer_t* measurer)
+{
+    return measurer->mode == MEASURE_ALLOCATIONS || measurer->mode == MEASURE_ALLOCATED_BYTES;
 }
 
 /* =======  prof_measurement_t   ========*/
-prof_measurement_t* prof_measurement_create(void)
-{
-    prof_measurement_t* result = ALLOC(prof_measurement_t);
-    result->owner = OWNER_C;
-    result->total_time = 0;
-    result->self_time = 0;
-    result->wait_time = 0;
-    result->called = 0;
-    result->object = Qnil;
+/* Initializes a measurement embedded in another struct. Its Ruby object is only created if Ruby asks for it. */
+void prof_measurement_init(prof_measurement_t* measurement, double resolution)
+{
+    measurement->owner = OWNER_C;
+    measurement->heap_allocated = false;
+    measurement->total_time = 0;
+    measurement->self_time = 0;
+    measurement->wait_time = 0;
+    measurement->gvl_wait_time = 0;
+    measurement->called = 0;
+    measurement->resolution = resolution;
+    measurement->object = Qnil;
+}
+
+/* Allocates the measurement from arena if it is not NULL */
+prof_measurement_t* prof_measurement_create(prof_arena_t* arena, double resolution)
+{
+    prof_measurement_t* result = arena ? prof_arena_alloc(arena, sizeof(prof_measurement_t)) : ALLOC(prof_measurement_t);
+    prof_measurement_init(result, resolution);
+    result->heap_allocated = arena == NULL;
     return result;
 }
 
+static VALUE prof_measurement_ticks_to_value(prof_measurement_t* measurement, int64_t ticks)
+{
+    return rb_float_new((double)ticks / measurement->resolution);
+}
+
+static int64_t prof_measurement_value_to_ticks(prof_measurement_t* measurement, VALUE value)
+{
+    return llround(NUM2DBL(value) * measurement->resolution);
+}
+
 /* call-seq:
      new(total_time, self_time, wait_time, called) -> Measurement
 
@@ -56,25 +124,32 @@ static VALUE prof_measurement_initialize(VALUE self, VALUE total_time, VALUE sel
 {
   prof_measurement_t* result = prof_get_measurement(self);
 
-  result->total_time = NUM2DBL(total_time);
-  result->self_time = NUM2DBL(self_time);
-  result->wait_time = NUM2DBL(wait_time);
-  result->called = NUM2INT(called);
+  result->total_time = prof_measurement_value_to_ticks(result, total_time);
+  result->self_time = prof_measurement_value_to_ticks(result, self_time);
+  result->wait_time = prof_measurement_value_to_ticks(result, wait_time);
+  result->called = NUM2ULL(called);
   result->object = self;
   return self;
 }
 
 prof_measurement_t* prof_measurement_copy(prof_measurement_t* other)
 {
-  prof_measurement_t* result = prof_measurement_create();
-  result->called = other->called;
-  result->total_time = other->total_time;
-  result->self_time = other->self_time;
-  result->wait_time = other->wait_time;
-
+  prof_measurement_t* result = prof_measurement_create(NULL, other->resolution);
+  prof_measurement_copy_values(result, other);
   return result;
 }
 
+/* Copies the counters, but not the owner or Ruby object, of other */
+void prof_measurement_copy_values(prof_measurement_t* destination, prof_measurement_t* other)
+{
+  destination->called = other->called;
+  destination->total_time = other->total_time;
+  destination->self_time = other->self_time;
+  destination->wait_time = other->wait_time;
+  destination->gvl_wait_time = other->gvl_wait_time;
+  destination->resolution = other->resolution;
+}
+
 static VALUE prof_measurement_initialize_copy(VALUE self, VALUE other)
 {
   // This object was created by Ruby either via Measurment#clone or Measurement#dup 
@@ -85,11 +160,7 @@ static VALUE prof_measurement_initialize_copy(VALUE self, VALUE other)
 
   prof_measurement_t* self_ptr = prof_get_measurement(self);
   prof_measurement_t* other_ptr = prof_get_measurement(other);
-
-  self_ptr->called = other_ptr->called;
-  self_ptr->total_time = other_ptr->total_time;
-  self_ptr->self_time = other_ptr->self_time;
-  self_ptr->wait_time = other_ptr->wait_time;
+  prof_measurement_copy_values(self_ptr, other_ptr);
 
   return self;
 }
@@ -120,7 +191,8 @@ void prof_measurement_free(prof_measurement_t* measurement)
         measurement->object = Qnil;
     }
 
-    xfree(measurement);
+    if (measurement->heap_allocated)
+        xfree(measurement);
 }
 
 static void prof_measurement_ruby_gc_free(void* data)
@@ -174,7 +246,7 @@ VALUE prof_measurement_wrap(prof_measurement_t* measurement)
 
 static VALUE prof_measurement_allocate(VALUE klass)
 {
-    prof_measurement_t* measurement = prof_measurement_create();
+    prof_measurement_t* measurement = prof_measurement_create(NULL, MEASUREMENT_DEFAULT_RESOLUTION);
     // This object is being created by Ruby
     measurement->owner = OWNER_RUBY;
     measurement->object = prof_measurement_wrap(measurement);
@@ -200,7 +272,7 @@ Returns the total amount of time spent in this method and its children. */
 static VALUE prof_measurement_total_time(VALUE self)
 {
     prof_measurement_t* result = prof_get_measurement(self);
-    return rb_float_new(result->total_time);
+    return prof_measurement_ticks_to_value(result, result->total_time);
 }
 
 /* call-seq:
@@ -210,7 +282,7 @@ Sets the call count to n. */
 static VALUE prof_measurement_set_total_time(VALUE self, VALUE value)
 {
   prof_measurement_t* result = prof_get_measurement(self);
-  result->total_time = NUM2DBL(value);
+  result->total_time = prof_measurement_value_to_ticks(result, value);
   return value;
 }
 
@@ -223,7 +295,7 @@ prof_measurement_self_time(VALUE self)
 {
     prof_measurement_t* result = prof_get_measurement(self);
 
-    return rb_float_new(result->self_time);
+    return prof_measurement_ticks_to_value(result, result->self_time);
 }
 
 /* call-seq:
@@ -233,7 +305,7 @@ Sets the call count to value. */
 static VALUE prof_measurement_set_self_time(VALUE self, VALUE value)
 {
   prof_measurement_t* result = prof_get_measurement(self);
-  result->self_time = NUM2DBL(value);
+  result->self_time = prof_measurement_value_to_ticks(result, value);
   return value;
 }
 
@@ -245,7 +317,7 @@ static VALUE prof_measurement_wait_time(VALUE self)
 {
     prof_measurement_t* result = prof_get_measurement(self);
 
-    return rb_float_new(result->wait_time);
+    return prof_measurement_ticks_to_value(result, result->wait_time);
 }
 
 /* call-seq:
@@ -255,10 +327,22 @@ Sets the wait time to value. */
 static VALUE prof_measurement_set_wait_time(VALUE self, VALUE value)
 {
   prof_measurement_t* result = prof_get_measurement(self);
-  result->wait_time = NUM2DBL(value);
+  result->wait_time = prof_measurement_value_to_ticks(result, value);
   return value;
 }
 
+/* call-seq:
+   gvl_wait_time -> float
+
+Returns the part of wait_time this method spent ready to run but waiting to acquire the GVL. The rest of
+wait_time was spent blocked, for example sleeping or waiting on IO. Only recorded for wall time and tsc time
+profiles on Ruby 3.2 and later. */
+static VALUE prof_measurement_gvl_wait_time(VALUE self)
+{
+    prof_measurement_t* result = prof_get_measurement(self);
+    return prof_measurement_ticks_to_value(result, result->gvl_wait_time);
+}
+
 /* call-seq:
    called -> int
 
@@ -266,7 +350,7 @@ Returns the total amount of times this method was called. */
 static VALUE prof_measurement_called(VALUE self)
 {
     prof_measurement_t* result = prof_get_measurement(self);
-    return INT2NUM(result->called);
+    return ULL2NUM(result->called);
 }
 
 /* call-seq:
@@ -276,7 +360,7 @@ Sets the call count to value. */
 static VALUE prof_measurement_set_called(VALUE self, VALUE value)
 {
   prof_measurement_t* result = prof_get_measurement(self);
-  result->called = NUM2INT(value);
+  result->called = NUM2ULL(value);
   return value;
 }
 
@@ -284,9 +368,86 @@ static VALUE prof_measurement_set_called(VALUE self, VALUE value)
 void prof_measurement_merge_internal(prof_measurement_t* self, prof_measurement_t* other)
 {
   self->called += other->called;
-  self->total_time += other->total_time;
-  self->self_time += other->self_time;
-  self->wait_time += other->wait_time;
+
+  if (self->resolution == other->resolution)
+  {
+    self->total_time += other->total_time;
+    self->self_time += other->self_time;
+    self->wait_time += other->wait_time;
+    self->gvl_wait_time += other->gvl_wait_time;
+  }
+  else
+  {
+    // Measurements taken with different clocks, such as tsc time on two machines
+    double scale = self->resolution / other->resolution;
+    self->total_time += llround(other->total_time * scale);
+    self->self_time += llround(other->self_time * scale);
+    self->wait_time += llround(other->wait_time * scale);
+    self->gvl_wait_time += llround(other->gvl_wait_time * scale);
+  }
+}
+
+/* Creates empty extra measurements with the same resolutions as model, which may be NULL */
+void prof_measurements_init(prof_arena_t* arena, prof_measurement_t** measurements, prof_measurement_t** model)
+{
+    for (int i = 0; i < MAX_EXTRA_MEASUREMENTS; i++)
+        measurements[i] = model && model[i] ? prof_measurement_create(arena, model[i]->resolution) : NULL;
+}
+
+void prof_measurements_copy(prof_measurement_t** destination, prof_measurement_t** other)
+{
+    prof_measurements_free(destination);
+    for (int i = 0; i < MAX_EXTRA_MEASUREMENTS; i++)
+        destination[i] = other[i] ? prof_measurement_copy(other[i]) : NULL;
+}
+
+void prof_measurements_merge(prof_measurement_t** destination, prof_measurement_t** other)
+{
+    for (int i = 0; i < MAX_EXTRA_MEASUREMENTS && other[i]; i++)
+    {
+        if (destination[i])
+            prof_measurement_merge_internal(destination[i], other[i]);
+        else
+            destination[i] = prof_measurement_copy(other[i]);
+    }
+}
+
+void prof_measurements_mark(prof_measurement_t** measurements)
+{
+    for (int i = 0; i < MAX_EXTRA_MEASUREMENTS && measurements[i]; i++)
+        prof_measurement_mark(measurements[i]);
+}
+
+void prof_measurements_free(prof_measurement_t** measurements)
+{
+    for (int i = 0; i < MAX_EXTRA_MEASUREMENTS && measurements[i]; i++)
+    {
+        prof_measurement_free(measurements[i]);
+        measurements[i] = NULL;
+    }
+}
+
+// Returns an array of the measurement followed by the extra measurements
+VALUE prof_measurements_wrap(prof_measurement_t* measurement, prof_measurement_t** measurements)
+{
+    VALUE result = rb_ary_new();
+    if (measurement)
+        rb_ary_push(result, prof_measurement_wrap(measurement));
+
+    for (int i = 0; i < MAX_EXTRA_MEASUREMENTS && measurements[i]; i++)
+        rb_ary_push(result, prof_measurement_wrap(measurements[i]));
+
+    return result;
+}
+
+void prof_measurements_unwrap(prof_measurement_t** measurements, VALUE array)
+{
+    prof_measurements_free(measurements);
+    if (NIL_P(array))
+        return;
+
+    for (int i = 0; i < MAX_EXTRA_MEASUREMENTS && i < rb_array_len(array); i++)
+        measurements[i] = prof_get_measurement(rb_ary_entry(array, i));
 }
 
 /* call-seq:
@@ -308,10 +469,12 @@ static VALUE prof_measurement_dump(VALUE self)
     VALUE result = rb_hash_new();
 
     rb_hash_aset(result, ID2SYM(rb_intern("owner")), INT2FIX(measurement_data->owner));
-    rb_hash_aset(result, ID2SYM(rb_intern("total_time")), rb_float_new(measurement_data->total_time));
-    rb_hash_aset(result, ID2SYM(rb_intern("self_time")), rb_float_new(measurement_data->self_time));
-    rb_hash_aset(result, ID2SYM(rb_intern("wait_time")), rb_float_new(measurement_data->wait_time));
-    rb_hash_aset(result, ID2SYM(rb_intern("called")), INT2FIX(measurement_data->called));
+    rb_hash_aset(result, ID2SYM(rb_intern("total_time")), LL2NUM(measurement_data->total_time));
+    rb_hash_aset(result, ID2SYM(rb_intern("self_time")), LL2NUM(measurement_data->self_time));
+    rb_hash_aset(result, ID2SYM(rb_intern("wait_time")), LL2NUM(measurement_data->wait_time));
+    rb_hash_aset(result, ID2SYM(rb_intern("gvl_wait_time")), LL2NUM(measurement_data->gvl_wait_time));
+    rb_hash_aset(result, ID2SYM(rb_intern("called")), ULL2NUM(measurement_data->called));
+    rb_hash_aset(result, ID2SYM(rb_intern("resolution")), rb_float_new(measurement_data->resolution));
 
     return result;
 }
@@ -324,10 +487,27 @@ prof_measurement_load(VALUE self, VALUE data)
     measurement->object = self;
 
     measurement->owner = FIX2INT(rb_hash_aref(data, ID2SYM(rb_intern("owner"))));
-    measurement->total_time = rb_num2dbl(rb_hash_aref(data, ID2SYM(rb_intern("total_time"))));
-    measurement->self_time = rb_num2dbl(rb_hash_aref(data, ID2SYM(rb_intern("self_time"))));
-    measurement->wait_time = rb_num2dbl(rb_hash_aref(data, ID2SYM(rb_intern("wait_time"))));
-    measurement->called = FIX2INT(rb_hash_aref(data, ID2SYM(rb_intern("called"))));
+    measurement->called = NUM2ULL(rb_hash_aref(data, ID2SYM(rb_intern("called"))));
+
+    VALUE resolution = rb_hash_aref(data, ID2SYM(rb_intern("resolution")));
+    if (NIL_P(resolution))
+    {
+        // Dumped by an older version that stored times as seconds
+        measurement->resolution = MEASUREMENT_DEFAULT_RESOLUTION;
+        measurement->total_time = prof_measurement_value_to_ticks(measurement, rb_hash_aref(data, ID2SYM(rb_intern("total_time"))));
+        measurement->self_time = prof_measurement_value_to_ticks(measurement, rb_hash_aref(data, ID2SYM(rb_intern("self_time"))));
+        measurement->wait_time = prof_measurement_value_to_ticks(measurement, rb_hash_aref(data, ID2SYM(rb_intern("wait_time"))));
+    }
+    else
+    {
+        measurement->resolution = NUM2DBL(resolution);
+        measurement->total_time = NUM2LL(rb_hash_aref(data, ID2SYM(rb_intern("total_time"))));
+        measurement->self_time = NUM2LL(rb_hash_aref(data, ID2SYM(rb_intern("self_time"))));
+        measurement->wait_time = NUM2LL(rb_hash_aref(data, ID2SYM(rb_intern("wait_time"))));
+
+        VALUE gvl_wait_time = rb_hash_aref(data, ID2SYM(rb_intern("gvl_wait_time")));
+        measurement->gvl_wait_time = NIL_P(gvl_wait_time) ? 0 : NUM2LL(gvl_wait_time);
+    }
 
     return data;
 }
@@ -337,7 +517,10 @@ void rp_init_measure(void)
     mMeasure = rb_define_module_under(mProf, "Measure");
     rp_init_measure_wall_time();
     rp_init_measure_process_time();
+    rp_init_measure_thread_cpu_time();
     rp_init_measure_allocations();
+    rp_init_measure_tsc_time();
+    rp_init_measure_perf_event();
 
     cRpMeasurement = rb_define_class_under(mProf, "Measurement", rb_cObject);
     rb_define_alloc_func(cRpMeasurement, prof_measurement_allocate);
@@ -353,6 +536,7 @@ void rp_init_measure(void)
     rb_define_method(cRpMeasurement, "self_time=", prof_measurement_set_self_time, 1);
     rb_define_method(cRpMeasurement, "wait_time", prof_measurement_wait_time, 0);
     rb_define_method(cRpMeasurement, "wait_time=", prof_measurement_set_wait_time, 1);
+    rb_define_method(cRpMeasurement, "gvl_wait_time", prof_measurement_gvl_wait_time, 0);
 
     rb_define_method(cRpMeasurement, "_dump_data", prof_measurement_dump, 0);
     rb_define_method(cRpMeasurement, "_load_data", prof_measurement_load, 1);
@@ -4,46 +4,87 @@
 #pragma once
 
 #include "ruby_prof.h"
+#include "rp_arena.h"
 
 extern VALUE mMeasure;
 
-typedef double (*get_measurement)(rb_trace_arg_t* trace_arg);
+/* Resolution of measurements created from Ruby code, in nanoseconds */
+#define MEASUREMENT_DEFAULT_RESOLUTION 1000000000.0
+
+/* Number of measure modes a profile can record at once. The first is kept in the usual measurement and the
+   others in fixed size vectors of extra measurements. */
+#define MAX_MEASURE_MODES 4
+#define MAX_EXTRA_MEASUREMENTS (MAX_MEASURE_MODES - 1)
+
+/* Measurements are kept as integer ticks of the measurer's clock or counter and are only converted to
+   seconds (or allocations) when they are read. */
+struct prof_measurer_t;
+typedef int64_t (*get_measurement)(struct prof_measurer_t* measurer, rb_trace_arg_t* trace_arg);
 
 typedef enum
 {
     MEASURE_WALL_TIME,
     MEASURE_PROCESS_TIME,
-    MEASURE_ALLOCATIONS
+    MEASURE_ALLOCATIONS,
+    MEASURE_TSC_TIME,
+    MEASURE_INSTRUCTIONS,
+    MEASURE_CPU_CYCLES,
+    MEASURE_CACHE_MISSES,
+    MEASURE_BRANCH_MISSES,
+    MEASURE_TASK_CLOCK,
+    MEASURE_PAGE_FAULTS,
+    MEASURE_CONTEXT_SWITCHES,
+    MEASURE_ALLOCATED_BYTES,
+    MEASURE_THREAD_CPU_TIME
 } prof_measure_mode_t;
 
 typedef struct prof_measurer_t
 {
     get_measurement measure;
     prof_measure_mode_t mode;
-    double multiplier;
+    double resolution;         /* Ticks per reported unit */
+    bool thread_local;         /* Only counts the running thread, so readings from different threads can not be compared */
     bool track_allocations;
+    int64_t count;             /* Running total of the measurers that count allocations */
+    VALUE pending_object;      /* Allocated object whose size is added at the next measurement */
 } prof_measurer_t;
 
 /* Callers and callee information for a method. */
 typedef struct prof_measurement_t
 {
     prof_owner_t owner;
-    double total_time;
-    double self_time;
-    double wait_time;
-    int called;
+    bool heap_allocated;        /* False if embedded in a call tree or method, or allocated from a thread's arena */
+    int64_t total_time;
+    int64_t self_time;
+    int64_t wait_time;
+    int64_t gvl_wait_time;      /* Part of wait_time spent waiting to acquire the GVL */
+    uint64_t called;
+    double resolution;
     VALUE object;
 } prof_measurement_t;
 
 prof_measurer_t* prof_measurer_create(prof_measure_mode_t measure, bool track_allocations);
-double prof_measure(prof_measurer_t* measurer, rb_trace_arg_t* trace_arg);
+int64_t prof_measure(prof_measurer_t* measurer, rb_trace_arg_t* trace_arg);
+void prof_measurer_mark(prof_measurer_t* measurer);
+bool prof_measurer_counts_allocations(prof_measurer_t* measurer);
 
-prof_measurement_t* prof_measurement_create(void);
+void prof_measurement_init(prof_measurement_t* measurement, double resolution);
+prof_measurement_t* prof_measurement_create(prof_arena_t* arena, double resolution);
 prof_measurement_t* prof_measurement_copy(prof_measurement_t* other);
+void prof_measurement_copy_values(prof_measurement_t* destination, prof_measurement_t* other);
 void prof_measurement_free(prof_measurement_t* measurement);
 VALUE prof_measurement_wrap(prof_measurement_t* measurement);
 prof_measurement_t* prof_get_measurement(VALUE self);
 void prof_measurement_mark(void* data);
 void prof_measurement_merge_internal(prof_measurement_t* destination, prof_measurement_t* other);
 
+/* Extra measurements (prof_measurement_t*[MAX_EXTRA_MEASUREMENTS]), unused entries are NULL */
+void prof_measurements_init(prof_arena_t* arena, prof_measurement_t** measurements, prof_measurement_t** model);
+void prof_measurements_copy(prof_measurement_t** destination, prof_measurement_t** other);
+void prof_measurements_merge(prof_measurement_t** destination, prof_measurement_t** other);
+void prof_measurements_mark(prof_measurement_t** measurements);
+void prof_measurements_free(prof_measurement_t** measurements);
+VALUE prof_measurements_wrap(prof_measurement_t* measurement, prof_measurement_t** measurements);
+void prof_measurements_unwrap(prof_measurement_t** measurements, VALUE array);
+
 void rp_init_measure(void);
@@ -112,6 +112,90 @@ st_data_t method_key(VALUE klass, VALUE msym)
     return hash;
 }
 
+/* ================  Method Descriptors  =================*/
+static prof_method_descriptor_t* prof_method_descriptor_create(VALUE klass, VALUE msym, VALUE source_file, int source_line)
+{
+    prof_method_descriptor_t* result = ALLOC(prof_method_descriptor_t);
+    result->klass_flags = 0;
+
+    /* Note we do not call resolve_klass_name now because that causes an object allocation that shows up
+       in the allocation results so we want to avoid it until after the profile run is complete. Resolving
+       the klass is also left until the profile stops, see method_descriptors_resolve. */
+    result->klass_resolved = false;
+    result->klass = klass;
+    result->klass_name = Qnil;
+    result->method_name = msym;
+
+    // Intern the path so most allocations can be attributed by comparing pointers, see prof_find_method
+    result->source_file = RB_TYPE_P(source_file, T_STRING) ? rb_str_to_interned_str(source_file) : source_file;
+    result->source_line = source_line;
+
+    return result;
+}
+
+static void prof_method_descriptor_resolve(prof_method_descriptor_t* descriptor)
+{
+    if (!descriptor->klass_resolved)
+    {
+        descriptor->klass = resolve_klass(descriptor->klass, &descriptor->klass_flags);
+        descriptor->klass_resolved = true;
+    }
+}
+
+static void prof_method_descriptor_mark(prof_method_descriptor_t* descriptor)
+{
+    rb_gc_mark(descriptor->klass_name);
+    rb_gc_mark(descriptor->method_name);
+    rb_gc_mark(descriptor->source_file);
+
+    if (descriptor->klass != Qnil)
+        rb_gc_mark(descriptor->klass);
+}
+
+/* A profile's descriptors keyed by method key. Each thread has its own methods, with their own measurements,
+   call trees and allocations, but threads that call the same method share its descriptor. */
+st_table* method_descriptors_create(void)
+{
+    return rb_st_init_numtable();
+}
+
+static int method_descriptors_mark_iterator(st_data_t key, st_data_t value, st_data_t data)
+{
+    prof_method_descriptor_mark((prof_method_descriptor_t*)value);
+    return ST_CONTINUE;
+}
+
+void method_descriptors_mark(st_table* table)
+{
+    rb_st_foreach(table, method_descriptors_mark_iterator, 0);
+}
+
+static int method_descriptors_resolve_iterator(st_data_t key, st_data_t value, st_data_t data)
+{
+    prof_method_descriptor_resolve((prof_method_descriptor_t*)value);
+    return ST_CONTINUE;
+}
+
+/* Resolves the klasses of methods seen while profiling. Called when the profile stops so the event hook
+   does not have to, and so singleton classes of objects are no longer kept alive. */
+void method_descriptors_resolve(st_table* table)
+{
+    rb_st_foreach(table, method_descriptors_resolve_iterator, 0);
+}
+
+static int method_descriptors_free_iterator(st_data_t key, st_data_t value, st_data_t data)
+{
+    xfree((prof_method_descriptor_t*)value);
+    return ST_CONTINUE;
+}
+
+/* Must be called after the methods using the descriptors are freed */
+void method_descriptors_free(st_table* table)
+{
+    rb_st_foreach(table, method_descriptors_free_iterator, 0);
+    rb_st_free_table(table);
+}
+
 /* ================  prof_method_t   =================*/
 prof_method_t* prof_get_method(VALUE self)
 {
@@ -125,42 +209,86 @@ prof_method_t* prof_get_method(VALUE self)
     return result;
 }
 
-prof_method_t* prof_method_create(struct prof_profile_t* profile, VALUE klass, VALUE msym, VALUE source_file, int source_line)
+prof_method_t* prof_method_create(struct prof_profile_t* profile, st_data_t key, VALUE klass, VALUE msym, VALUE source_file, int source_line)
 {
     prof_method_t* result = ALLOC(prof_method_t);
     result->profile = profile;
+    result->key = key;
 
-    result->key = method_key(klass, msym);
-    result->klass_flags = 0;
+    // Threads share the descriptor of a method so its class and source are only resolved once
+    if (profile)
+    {
+        st_data_t descriptor;
+        if (!rb_st_lookup(profile->method_descriptors, key, &descriptor))
+        {
+            descriptor = (st_data_t)prof_method_descriptor_create(klass, msym, source_file, source_line);
+            rb_st_insert(profile->method_descriptors, key, descriptor);
+        }
+        result->descriptor = (prof_method_descriptor_t*)descriptor;
+        result->owns_descriptor = false;
+    }
+    else
+    {
+        result->descriptor = prof_method_descriptor_create(klass, msym, source_file, source_line);
+        result->owns_descriptor = true;
+    }
 
-    /* Note we do not call resolve_klass_name now because that causes an object allocation that shows up
-       in the allocation results so we want to avoid it until after the profile run is complete. */
-    result->klass = resolve_klass(klass, &result->klass_flags);
-    result->klass_name = Qnil;
-    result->method_name = msym;
-    result->measurement = prof_measurement_create();
+    prof_measurement_init(&result->measurement, profile ? profile->measurer->resolution : MEASUREMENT_DEFAULT_RESOLUTION);
+    for (int i = 0; i < MAX_EXTRA_MEASUREMENTS; i++)
+    {
+        bool used = profile && i < profile->extra_measurer_count;
+        result->extra_measurements[i] = used ? prof_measurement_create(NULL, profile->extra_measurers[i]->resolution) : NULL;
+    }
 
-    result->call_trees = prof_call_trees_create();
-    result->allocations_table = prof_allocations_create();
+    // Created on first use since excluded methods have no call trees and most methods never allocate
+    result->call_trees = NULL;
+    result->allocations_table = NULL;
 
     result->visits = 0;
     result->recursive = false;
 
-    result->object = Qnil;
+    result->gc_count = 0;
+    result->gc_time = 0;
 
-    result->source_file = source_file;
-    result->source_line = source_line;
+    result->object = Qnil;
 
     return result;
 }
 
+VALUE prof_method_klass(prof_method_t* method)
+{
+    prof_method_descriptor_resolve(method->descriptor);
+    return method->descriptor->klass;
+}
+
+void prof_method_add_call_tree(prof_method_t* method, prof_call_tree_t* call_tree)
+{
+    if (!method->call_trees)
+        method->call_trees = prof_call_trees_create();
+
+    prof_add_call_tree(method->call_trees, call_tree);
+}
+
+st_table* prof_method_allocations_table(prof_method_t* method)
+{
+    if (!method->allocations_table)
+        method->allocations_table = prof_allocations_create();
+
+    return method->allocations_table;
+}
+
 prof_method_t* prof_method_copy(prof_method_t* other)
 {
-    prof_method_t* result = prof_method_create(other->profile, other->klass, other->method_name, other->source_file, other->source_line);
+    // The copy may outlive the other method's profile, so it gets its own descriptor
+    prof_method_t* result = prof_method_create(NULL, other->key, Qnil, Qnil, Qnil, 0);
+    result->profile = other->profile;
+    *result->descriptor = *other->descriptor;
 
-    // Free the measurement created by prof_method_create before replacing it with the copy
-    prof_measurement_free(result->measurement);
-    result->measurement = prof_measurement_copy(other->measurement);
+    prof_measurement_copy_values(&result->measurement, &other->measurement);
+    prof_measurements_copy(result->extra_measurements, other->extra_measurements);
+
+    result->gc_count = other->gc_count;
+    result->gc_time = other->gc_time;
 
     return result;
 }
@@ -190,9 +318,18 @@ static void prof_method_free(prof_method_t* method)
         method->object = Qnil;
     }
 
-    prof_allocations_free(method->allocations_table);
-    prof_call_trees_free(method->call_trees);
-    prof_measurement_free(method->measurement);
+    if (method->allocations_table)
+        prof_allocations_free(method->allocations_table);
+
+    if (method->call_trees)
+        prof_call_trees_free(method->call_trees);
+
+    prof_measurement_free(&method->measurement);
+    prof_measurements_free(method->extra_measurements);
+
+    if (method->owns_descriptor)
+        xfree(method->descriptor);
+
     xfree(method);
 }
 
@@ -215,28 +352,26 @@ void prof_method_mark(void* data)
     if (method->profile && method->profile->object != Qnil)
         rb_gc_mark(method->profile->object);
 
-    rb_gc_mark(method->klass_name);
-    rb_gc_mark(method->method_name);
-    rb_gc_mark(method->source_file);
+    // Shared descriptors are marked by the profile
+    if (method->owns_descriptor)
+        prof_method_descriptor_mark(method->descriptor);
 
-    if (method->klass != Qnil)
-        rb_gc_mark(method->klass);
+    prof_measurement_mark(&method->measurement);
+    prof_measurements_mark(method->extra_measurements);
 
-    prof_measurement_mark(method->measurement);
-    prof_allocations_mark(method->allocations_table);
+    if (method->allocations_table)
+        prof_allocations_mark(method->allocations_table);
 }
 
 void prof_method_compact(void* data)
 {
     prof_method_t* method = (prof_method_t*)data;
     method->object = rb_gc_location(method->object);
-    method->klass_name = rb_gc_location(method->klass_name);
-    method->method_name = rb_gc_location(method->method_name);
 }
 
 static VALUE prof_method_allocate(VALUE klass)
 {
-    prof_method_t* method_data = prof_method_create(NULL, Qnil, Qnil, Qnil, 0);
+    prof_method_t* method_data = prof_method_create(NULL, method_key(Qnil, Qnil), Qnil, Qnil, Qnil, 0);
     method_data->object = prof_method_wrap(method_data);
     return method_data->object;
 }
@@ -294,7 +429,10 @@ static int prof_method_table_merge_internal(st_data_t key, st_data_t value, st_d
     prof_method_t* self_child = method_table_lookup(self_table, other_child->key);
     if (self_child)
     {
-        prof_measurement_merge_internal(self_child->measurement, other_child->measurement);
+        prof_measurement_merge_internal(&self_child->measurement, &other_child->measurement);
+        prof_measurements_merge(self_child->extra_measurements, other_child->extra_measurements);
+        self_child->gc_count += other_child->gc_count;
+        self_child->gc_time += other_child->gc_time;
     }
     else
     {
@@ -341,8 +479,9 @@ a Ruby class and +method_name+ a symbol identifying one of its instance methods.
 static VALUE prof_method_initialize(VALUE self, VALUE klass, VALUE method_name)
 {
   prof_method_t* method_ptr = prof_get_method(self);
-  method_ptr->klass = klass;
-  method_ptr->method_name = method_name;
+  method_ptr->descriptor->klass = klass;
+  method_ptr->descriptor->klass_resolved = false;
+  method_ptr->descriptor->method_name = method_name;
 
   // Setup method key
   method_ptr->key = method_key(klass, method_name);
@@ -354,8 +493,8 @@ static VALUE prof_method_initialize(VALUE self, VALUE klass, VALUE method_name)
   VALUE location_array = rb_funcall(ruby_method, rb_intern("source_location"), 0);
   if (location_array != Qnil && RARRAY_LEN(location_array) == 2)
   {
-    method_ptr->source_file = rb_ary_entry(location_array, 0);
-    method_ptr->source_line = NUM2INT(rb_ary_entry(location_array, 1));
+    method_ptr->descriptor->source_file = rb_ary_entry(location_array, 0);
+    method_ptr->descriptor->source_line = NUM2INT(rb_ary_entry(location_array, 1));
   }
 
   return self;
@@ -379,7 +518,7 @@ Returns an array of allocation information.*/
 static VALUE prof_method_allocations(VALUE self)
 {
     prof_method_t* method = prof_get_method(self);
-    return prof_allocations_wrap(method->allocations_table);
+    return method->allocations_table ? prof_allocations_wrap(method->allocations_table) : rb_ary_new();
 }
 
 /* call-seq:
@@ -389,7 +528,17 @@ Returns the measurement associated with this method. */
 static VALUE prof_method_measurement(VALUE self)
 {
     prof_method_t* method = prof_get_method(self);
-    return prof_measurement_wrap(method->measurement);
+    return prof_measurement_wrap(&method->measurement);
+}
+
+/* call-seq:
+   measurements -> [Measurement]
+
+Returns a measurement for each of the profile's measure modes. The first is the same as measurement. */
+static VALUE prof_method_measurements(VALUE self)
+{
+    prof_method_t* method = prof_get_method(self);
+    return prof_measurements_wrap(&method->measurement, method->extra_measurements);
 }
 
 /* call-seq:
@@ -400,7 +549,7 @@ Returns the source file of the method
 static VALUE prof_method_source_file(VALUE self)
 {
     prof_method_t* method = prof_get_method(self);
-    return method->source_file;
+    return method->descriptor->source_file;
 }
 
 /* call-seq:
@@ -410,7 +559,7 @@ static VALUE prof_method_source_file(VALUE self)
 static VALUE prof_method_line(VALUE self)
 {
     prof_method_t* method = prof_get_method(self);
-    return INT2FIX(method->source_line);
+    return INT2FIX(method->descriptor->source_line);
 }
 
 /* call-seq:
@@ -422,10 +571,10 @@ will have the form <Object::Object>. */
 static VALUE prof_method_klass_name(VALUE self)
 {
     prof_method_t* method = prof_get_method(self);
-    if (method->klass_name == Qnil)
-        method->klass_name = resolve_klass_name(method->klass, &method->klass_flags);
+    if (method->descriptor->klass_name == Qnil)
+        method->descriptor->klass_name = resolve_klass_name(prof_method_klass(method), &method->descriptor->klass_flags);
 
-    return method->klass_name;
+    return method->descriptor->klass_name;
 }
 
 /* call-seq:
@@ -436,7 +585,8 @@ Returns the klass flags */
 static VALUE prof_method_klass_flags(VALUE self)
 {
     prof_method_t* method = prof_get_method(self);
-    return INT2FIX(method->klass_flags);
+    prof_method_descriptor_resolve(method->descriptor);
+    return INT2FIX(method->descriptor->klass_flags);
 }
 
 /* call-seq:
@@ -448,7 +598,30 @@ methods will be returned in the format <Object::Object>#method.*/
 static VALUE prof_method_name(VALUE self)
 {
     prof_method_t* method = prof_get_method(self);
-    return method->method_name;
+    return method->descriptor->method_name;
+}
+
+/* call-seq:
+   gc_count -> integer
+
+Returns the number of garbage collections that started while this method was the
+running method. Only recorded by profiles created with track_gc: true. */
+static VALUE prof_method_gc_count(VALUE self)
+{
+    prof_method_t* method = prof_get_method(self);
+    return ULL2NUM(method->gc_count);
+}
+
+/* call-seq:
+   gc_time -> float
+
+Returns the time spent in garbage collections that started while this method was the
+running method. This time is reported under a [GC] method called by this method instead
+of in this method's self time. */
+static VALUE prof_method_gc_time(VALUE self)
+{
+    prof_method_t* method = prof_get_method(self);
+    return rb_float_new(method->gc_time / method->measurement.resolution);
 }
 
 /* call-seq:
@@ -468,6 +641,9 @@ Returns the CallTrees associated with this method. */
 static VALUE prof_method_call_trees(VALUE self)
 {
     prof_method_t* method = prof_get_method(self);
+    if (!method->call_trees)
+        method->call_trees = prof_call_trees_create();
+
     return prof_call_trees_wrap(method->call_trees);
 }
 
@@ -478,17 +654,20 @@ static VALUE prof_method_dump(VALUE self)
     VALUE result = rb_hash_new();
 
     rb_hash_aset(result, ID2SYM(rb_intern("klass_name")), prof_method_klass_name(self));
-    rb_hash_aset(result, ID2SYM(rb_intern("klass_flags")), INT2FIX(method_data->klass_flags));
-    rb_hash_aset(result, ID2SYM(rb_intern("method_name")), method_data->method_name);
+    rb_hash_aset(result, ID2SYM(rb_intern("klass_flags")), prof_method_klass_flags(self));
+    rb_hash_aset(result, ID2SYM(rb_intern("method_name")), method_data->descriptor->method_name);
 
     rb_hash_aset(result, ID2SYM(rb_intern("key")), ULL2NUM(method_data->key));
     rb_hash_aset(result, ID2SYM(rb_intern("recursive")), prof_method_recursive(self));
-    rb_hash_aset(result, ID2SYM(rb_intern("source_file")), method_data->source_file);
-    rb_hash_aset(result, ID2SYM(rb_intern("source_line")), INT2FIX(method_data->source_line));
+    rb_hash_aset(result, ID2SYM(rb_intern("source_file")), method_data->descriptor->source_file);
+    rb_hash_aset(result, ID2SYM(rb_intern("source_line")), INT2FIX(method_data->descriptor->source_line));
 
-    rb_hash_aset(result, ID2SYM(rb_intern("call_trees")), prof_call_trees_wrap(method_data->call_trees));
-    rb_hash_aset(result, ID2SYM(rb_intern("measurement")), prof_measurement_wrap(method_data->measurement));
+    rb_hash_aset(result, ID2SYM(rb_intern("call_trees")), prof_method_call_trees(self));
+    rb_hash_aset(result, ID2SYM(rb_intern("measurement")), prof_measurement_wrap(&method_data->measurement));
+    rb_hash_aset(result, ID2SYM(rb_intern("extra_measurements")), prof_measurements_wrap(NULL, method_data->extra_measurements));
     rb_hash_aset(result, ID2SYM(rb_intern("allocations")), prof_method_allocations(self));
+    rb_hash_aset(result, ID2SYM(rb_intern("gc_count")), ULL2NUM(method_data->gc_count));
+    rb_hash_aset(result, ID2SYM(rb_intern("gc_time")), LL2NUM(method_data->gc_time));
 
     return result;
 }
@@ -499,24 +678,34 @@ static VALUE prof_method_load(VALUE self, VALUE data)
     prof_method_t* method_data = prof_get_method(self);
     method_data->object = self;
 
-    method_data->klass_name = rb_hash_aref(data, ID2SYM(rb_intern("klass_name")));
-    method_data->klass_flags = FIX2INT(rb_hash_aref(data, ID2SYM(rb_intern("klass_flags"))));
-    method_data->method_name = rb_hash_aref(data, ID2SYM(rb_intern("method_name")));
+    method_data->descriptor->klass_name = rb_hash_aref(data, ID2SYM(rb_intern("klass_name")));
+    method_data->descriptor->klass_flags = FIX2INT(rb_hash_aref(data, ID2SYM(rb_intern("klass_flags"))));
+    method_data->descriptor->klass_resolved = true;
+    method_data->descriptor->method_name = rb_hash_aref(data, ID2SYM(rb_intern("method_name")));
     method_data->key = RB_NUM2ULL(rb_hash_aref(data, ID2SYM(rb_intern("key"))));
 
     method_data->recursive = rb_hash_aref(data, ID2SYM(rb_intern("recursive"))) == Qtrue ? true : false;
 
-    method_data->source_file = rb_hash_aref(data, ID2SYM(rb_intern("source_file")));
-    method_data->source_line = FIX2INT(rb_hash_aref(data, ID2SYM(rb_intern("source_line"))));
+    method_data->descriptor->source_file = rb_hash_aref(data, ID2SYM(rb_intern("source_file")));
+    method_data->descriptor->source_line = FIX2INT(rb_hash_aref(data, ID2SYM(rb_intern("source_line"))));
 
     VALUE call_trees = rb_hash_aref(data, ID2SYM(rb_intern("call_trees")));
     method_data->call_trees = prof_get_call_trees(call_trees);
 
     VALUE measurement = rb_hash_aref(data, ID2SYM(rb_intern("measurement")));
-    method_data->measurement = prof_get_measurement(measurement);
+    prof_measurement_copy_values(&method_data->measurement, prof_get_measurement(measurement));
+    prof_measurements_unwrap(method_data->extra_measurements, rb_hash_aref(data, ID2SYM(rb_intern("extra_measurements"))));
 
     VALUE allocations = rb_hash_aref(data, ID2SYM(rb_intern("allocations")));
-    prof_allocations_unwrap(method_data->allocations_table, allocations);
+    if (RARRAY_LEN(allocations) > 0)
+        prof_allocations_unwrap(prof_method_allocations_table(method_data), allocations);
+
+    VALUE gc_count = rb_hash_aref(data, ID2SYM(rb_intern("gc_count")));
+    if (!NIL_P(gc_count))
+    {
+        method_data->gc_count = NUM2ULL(gc_count);
+        method_data->gc_time = NUM2LL(rb_hash_aref(data, ID2SYM(rb_intern("gc_time"))));
+    }
     return data;
 }
 
@@ -530,6 +719,7 @@ void rp_init_method_info(void)
     rb_define_const(cRpMethodInfo, "MODULE_SINGLETON", INT2NUM(kModuleSingleton));
     rb_define_const(cRpMethodInfo, "OBJECT_SINGLETON", INT2NUM(kObjectSingleton));
     rb_define_const(cRpMethodInfo, "OTHER_SINGLETON", INT2NUM(kOtherSingleton));
+    rb_define_const(cRpMethodInfo, "SYNTHETIC", INT2NUM(kSynthetic));
 
     rb_define_alloc_func(cRpMethodInfo, prof_method_allocate);
     rb_define_method(cRpMethodInfo, "initialize", prof_method_initialize, 2);
@@ -543,10 +733,14 @@ void rp_init_method_info(void)
 
     rb_define_method(cRpMethodInfo, "allocations", prof_method_allocations, 0);
     rb_define_method(cRpMethodInfo, "measurement", prof_method_measurement, 0);
+    rb_define_method(cRpMethodInfo, "measurements", prof_method_measurements, 0);
 
     rb_define_method(cRpMethodInfo, "source_file", prof_method_source_file, 0);
     rb_define_method(cRpMethodInfo, "line", prof_method_line, 0);
 
+    rb_define_method(cRpMethodInfo, "gc_count", prof_method_gc_count, 0);
+    rb_define_method(cRpMethodInfo, "gc_time", prof_method_gc_time, 0);
+
     rb_define_method(cRpMethodInfo, "recursive?", prof_method_recursive, 0);
 
     rb_define_method(cRpMethodInfo, "_dump_data", prof_method_dump, 0);
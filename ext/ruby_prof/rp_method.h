@@ -14,47 +14,70 @@ enum {
     kClassSingleton = 0x2,                    // Singleton of a class
     kModuleSingleton = 0x4,                   // Singleton of a module
     kObjectSingleton = 0x8,                   // Singleton of an object
-    kOtherSingleton = 0x10                    // Singleton of unknown object
+    kOtherSingleton = 0x10,                   // Singleton of unknown object
+    kSynthetic = 0x20                         // Not a Ruby method, such as garbage collection
 };
 
 // Don't want to include ruby_prof.h to avoid a circular reference
 struct prof_profile_t;
+struct prof_call_tree_t;
+
+// Identity of a method. Methods created while profiling share one descriptor per method key across all
+// of a profile's threads, see prof_method_create.
+typedef struct prof_method_descriptor_t
+{
+    unsigned int klass_flags;               // Information about the type of class
+    bool klass_resolved;                    // False until klass is resolved, when the profile stops or on first use
+    VALUE klass;                            // Klass, resolved once klass_resolved is set
+    VALUE klass_name;                       // Resolved klass name for this method
+    VALUE method_name;                      // Resolved method name for this method
+    VALUE source_file;                      // Source file
+    int source_line;                        // Line number
+} prof_method_descriptor_t;
 
 // Profiling information for each method.
 // Excluded methods have no call_trees, source_klass, or source_file.
 typedef struct prof_method_t
 {
     struct prof_profile_t* profile;                  // Profile this method is associated with - needed for mark phase
-    struct prof_call_trees_t* call_trees;   // Call infos that call this method
-    st_table* allocations_table;            // Tracks object allocations
+    struct prof_call_trees_t* call_trees;   // Call infos that call this method, NULL until the first one is added
+    st_table* allocations_table;            // Tracks object allocations, NULL until the method allocates an object
 
     st_data_t key;                          // Table key
-    unsigned int klass_flags;               // Information about the type of class
-    VALUE klass;                            // Resolved klass
-    VALUE klass_name;                       // Resolved klass name for this method
-    VALUE method_name;                      // Resolved method name for this method
+    prof_method_descriptor_t* descriptor;   // Class, name and source location
+    bool owns_descriptor;                   // False if the descriptor belongs to the profile
 
     VALUE object;                           // Cached ruby object
 
     bool recursive;
     int visits;                             // Current visits on the stack
-    VALUE source_file;                      // Source file
-    int source_line;                        // Line number
 
-    prof_measurement_t* measurement;        // Stores measurement data for this method
+    prof_measurement_t measurement;         // Stores measurement data for this method, embedded since it is updated on every return
+    prof_measurement_t* extra_measurements[MAX_EXTRA_MEASUREMENTS]; // Profiles recording several measure modes
+
+    uint64_t gc_count;                      // Garbage collections started while this method was running
+    int64_t gc_time;                        // Measurement of those garbage collections
 } prof_method_t;
 
 void rp_init_method_info(void);
 
 st_data_t method_key(VALUE klass, VALUE msym);
 
+st_table* method_descriptors_create(void);
+void method_descriptors_mark(st_table* table);
+void method_descriptors_resolve(st_table* table);
+void method_descriptors_free(st_table* table);
+
 st_table* method_table_create(void);
 prof_method_t* method_table_lookup(st_table* table, st_data_t key);
 size_t method_table_insert(st_table* table, st_data_t key, prof_method_t* val);
 void method_table_free(st_table* table);
 void prof_method_table_merge(st_table* self, st_table* other);
-prof_method_t* prof_method_create(struct prof_profile_t* profile, VALUE klass, VALUE msym, VALUE source_file, int source_line);
+prof_method_t* prof_method_create(struct prof_profile_t* profile, st_data_t key, VALUE klass, VALUE msym, VALUE source_file, int source_line);
 prof_method_t* prof_get_method(VALUE self);
+VALUE prof_method_klass(prof_method_t* method);
+void prof_method_add_call_tree(prof_method_t* method, struct prof_call_tree_t* call_tree);
+st_table* prof_method_allocations_table(prof_method_t* method);
 
 VALUE prof_method_wrap(prof_method_t* result);
 void prof_method_mark(void* data);
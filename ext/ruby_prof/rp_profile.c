@@ -20,14 +20,19 @@
    */
 
 #include <assert.h>
+#include <time.h>
 
 #include "rp_allocation.h"
 #include "rp_call_trees.h"
 #include "rp_call_tree.h"
+#include "rp_event_log.h"
+#include "rp_gvl.h"
 #include "rp_profile.h"
 #include "rp_method.h"
+#include "rp_sampling.h"
 
 VALUE cProfile;
+static VALUE gc_method_name;
 
 /* support tracing ruby events from ruby-prof. useful for getting at
  what actually happens inside the ruby interpreter (and ruby-prof).
@@ -72,7 +77,28 @@ static const char* get_event_name(rb_event_flag_t event)
     }
 }
 
-thread_data_t* check_fiber(prof_profile_t* profile, double measurement)
+/* Garbage collection runs on the native thread that triggered it, which is not always the thread that delivered
+   the last event. So each native thread has a thread local pointer to the thread data of the profiled thread (or
+   fiber) that last ran on it. Like the GVL hooks' pointer (see rp_gvl.c) it is tagged with the id of the profile
+   run that set it, so pointers left behind by earlier runs are ignored. */
+typedef struct prof_gc_current_t
+{
+    uintptr_t id;
+    thread_data_t* thread_data;
+} prof_gc_current_t;
+
+static RP_THREAD_LOCAL prof_gc_current_t gc_current = {0, NULL};
+
+/* Ids are never reused, so a stale thread local pointer can not match a later run */
+static uintptr_t gc_last_id = 0;
+
+static void prof_gc_attach(prof_profile_t* profile, thread_data_t* thread_data)
+{
+    gc_current.id = profile->gc_id;
+    gc_current.thread_data = thread_data;
+}
+
+thread_data_t* check_fiber(prof_profile_t* profile, int64_t measurement)
 {
     thread_data_t* result = NULL;
 
@@ -89,11 +115,16 @@ thread_data_t* check_fiber(prof_profile_t* profile, double measurement)
             result = threads_table_insert(profile, fiber);
         }
         switch_thread(profile, result, measurement);
+
+        if (profile->gc_id)
+            prof_gc_attach(profile, result);
     }
     else
     {
         result = profile->last_thread_data;
     }
+
+    result->measurement = measurement;
     return result;
 }
 
@@ -105,7 +136,7 @@ static int excludes_method(st_data_t key, prof_profile_t* profile)
 
 static prof_method_t* create_method(prof_profile_t* profile, st_data_t key, VALUE klass, VALUE msym, VALUE source_file, int source_line)
 {
-    prof_method_t* result = prof_method_create(profile, klass, msym, source_file, source_line);
+    prof_method_t* result = prof_method_create(profile, key, klass, msym, source_file, source_line);
     method_table_insert(profile->last_thread_data->method_table, result->key, result);
 
     return result;
@@ -129,34 +160,235 @@ static prof_method_t* check_parent_method(prof_profile_t* profile, thread_data_t
 prof_method_t* check_method(prof_profile_t* profile, rb_trace_arg_t* trace_arg, rb_event_flag_t event, thread_data_t* thread_data)
 {
     VALUE klass = rb_tracearg_defined_class(trace_arg);
+    VALUE msym = rb_tracearg_callee_id(trace_arg);
+
+    // Most calls are to methods that were recently called, so check the cache before resolving the class
+    method_cache_entry_t* entry = thread_method_cache_entry(thread_data, klass, msym);
+    if (entry->klass == klass && entry->msym == msym)
+        return entry->method;
+
+    prof_method_t* result = NULL;
 
     /* Special case - skip any methods from the mProf
      module or cProfile class since they clutter
      the results but aren't important to them results. */
-    if (klass == cProfile)
-        return NULL;
+    if (klass != cProfile)
+    {
+        st_data_t key = method_key(klass, msym);
 
-    VALUE msym = rb_tracearg_callee_id(trace_arg);
+        if (!excludes_method(key, profile))
+        {
+            result = method_table_lookup(thread_data->method_table, key);
 
-    st_data_t key = method_key(klass, msym);
+            if (!result)
+            {
+                VALUE source_file = (event != RUBY_EVENT_C_CALL ? rb_tracearg_path(trace_arg) : Qnil);
+                int source_line = (event != RUBY_EVENT_C_CALL ? FIX2INT(rb_tracearg_lineno(trace_arg)) : 0);
+                result = create_method(profile, key, klass, msym, source_file, source_line);
+            }
+        }
+    }
 
-    if (excludes_method(key, profile))
-        return NULL;
+    entry->klass = klass;
+    entry->msym = msym;
+    entry->method = result;
 
-    prof_method_t* result = method_table_lookup(thread_data->method_table, key);
+    return result;
+}
 
-    if (!result)
+/* Pushes a frame for method onto the thread's stack, creating the call tree linking it to its caller if needed */
+prof_frame_t* prof_enter_method(prof_profile_t* profile, thread_data_t* thread_data, prof_method_t* method, int64_t measurement, bool paused)
+{
+    prof_frame_t* frame = prof_frame_current(thread_data->stack);
+    prof_call_tree_t* parent_call_tree = NULL;
+    prof_call_tree_t* call_tree = NULL;
+
+    // Frame can be NULL if we are switching from one fiber to another (see FiberTest#fiber_test)
+    if (frame)
     {
-        VALUE source_file = (event != RUBY_EVENT_C_CALL ? rb_tracearg_path(trace_arg) : Qnil);
-        int source_line = (event != RUBY_EVENT_C_CALL ? FIX2INT(rb_tracearg_lineno(trace_arg)) : 0);
-        result = create_method(profile, key, klass, msym, source_file, source_line);
+        parent_call_tree = frame->call_tree;
+
+        // When folding recursion a method already on the stack is charged to its existing call tree. The visits
+        // counts then keep its total time from being counted more than once, see prof_frame_pop.
+        if (profile->fold_recursion && method->visits > 0)
+            call_tree = prof_stack_find_call_tree(thread_data->stack, method);
+
+        if (!call_tree)
+            call_tree = call_tree_table_lookup(&parent_call_tree->children, method->key);
+    }
+    else if (!frame && thread_data->call_tree)
+    {
+        // There is no current parent - likely we have returned out of the highest level method we have profiled so far.
+        // This can happen with enumerators (see fiber_test.rb). So create a new dummy parent.
+        prof_method_t* parent_method = check_parent_method(profile, thread_data);
+        parent_call_tree = prof_call_tree_create(thread_data->arena, parent_method, NULL, Qnil, 0);
+        prof_method_add_call_tree(parent_method, parent_call_tree);
+        prof_call_tree_add_parent(thread_data->call_tree, parent_call_tree);
+        frame = prof_frame_unshift(thread_data->stack, parent_call_tree, thread_data->call_tree, measurement);
+        thread_data->call_tree = parent_call_tree;
     }
 
-    return result;
+    if (!call_tree)
+    {
+        // This call info does not yet exist.  So create it and add it to previous CallTree's children and the current method.
+        call_tree = prof_call_tree_create(thread_data->arena, method, parent_call_tree, frame ? frame->source_file : Qnil, frame? frame->source_line : 0);
+        prof_method_add_call_tree(method, call_tree);
+        if (parent_call_tree)
+            prof_call_tree_add_child(parent_call_tree, call_tree);
+    }
+
+    if (!thread_data->call_tree)
+        thread_data->call_tree = call_tree;
+
+    // Push a new frame onto the stack for a new c-call or ruby call (into a method)
+    prof_frame_t* next_frame = prof_frame_push(thread_data->stack, call_tree, measurement, paused);
+    next_frame->source_file = method->descriptor->source_file;
+    next_frame->source_line = method->descriptor->source_line;
+
+    return next_frame;
+}
+
+/* Pushes a frame for a method that was already running when it was first seen, making it the new root of the call tree */
+prof_frame_t* prof_enter_running_method(thread_data_t* thread_data, prof_method_t* method, int64_t measurement, bool paused)
+{
+    prof_frame_t* frame = NULL;
+    prof_call_tree_t* call_tree = prof_call_tree_create(thread_data->arena, method, NULL, method->descriptor->source_file, method->descriptor->source_line);
+    prof_method_add_call_tree(method, call_tree);
+
+    // We have climbed higher in the stack then where we started
+    if (thread_data->call_tree)
+    {
+        prof_call_tree_add_parent(thread_data->call_tree, call_tree);
+        frame = prof_frame_unshift(thread_data->stack, call_tree, thread_data->call_tree, measurement);
+    }
+    // This is the first method to be profiled
+    else
+    {
+        frame = prof_frame_push(thread_data->stack, call_tree, measurement, paused);
+    }
+
+    thread_data->call_tree = call_tree;
+    return frame;
+}
+
+/* Charges garbage collection to a [GC] call tree under the thread's current frame. The time is moved from the
+   frame's self time to its children. */
+void prof_charge_gc(thread_data_t* thread_data, uint64_t count, int64_t time)
+{
+    prof_frame_t* frame = prof_frame_current(thread_data->stack);
+    if (!frame)
+        return;
+
+    st_data_t key = method_key(Qnil, gc_method_name);
+    prof_method_t* method = method_table_lookup(thread_data->method_table, key);
+    if (!method)
+    {
+        prof_method_t* parent_method = frame->call_tree->method;
+        method = prof_method_create(parent_method->profile, key, Qnil, gc_method_name, Qnil, 0);
+        method->descriptor->klass_flags |= kSynthetic;
+        method_table_insert(thread_data->method_table, method->key, method);
+    }
+
+    prof_call_tree_t* parent_call_tree = frame->call_tree;
+    prof_call_tree_t* call_tree = call_tree_table_lookup(&parent_call_tree->children, key);
+    if (!call_tree)
+    {
+        call_tree = prof_call_tree_create(thread_data->arena, method, parent_call_tree, frame->source_file, frame->source_line);
+        prof_method_add_call_tree(method, call_tree);
+        prof_call_tree_add_child(parent_call_tree, call_tree);
+    }
+
+    call_tree->measurement.called += count;
+    call_tree->measurement.total_time += time;
+    call_tree->measurement.self_time += time;
+
+    method->measurement.called += count;
+    method->measurement.total_time += time;
+    method->measurement.self_time += time;
+
+    parent_call_tree->method->gc_count += count;
+    parent_call_tree->method->gc_time += time;
+
+    frame->child_time += time;
+}
+
+/* Garbage collection can not allocate memory, so collections are only counted here and then charged by the
+   next event to the method that was running on the thread that triggered them. Collections on a native
+   thread that has not delivered an event during this run can not be attributed and are dropped. */
+static void prof_gc_hook(VALUE trace_point, void* data)
+{
+    prof_profile_t* profile = (prof_profile_t*)(data);
+
+    if (profile->paused == Qtrue)
+        return;
+
+    rb_trace_arg_t* trace_arg = rb_tracearg_from_tracepoint(trace_point);
+    int64_t measurement = prof_measure(profile->measurer, NULL);
+
+    if (rb_tracearg_event_flag(trace_arg) == RUBY_INTERNAL_EVENT_GC_ENTER)
+    {
+        profile->gc_start = measurement;
+        if (profile->gc_count == 0)
+            profile->gc_thread_data = gc_current.id == profile->gc_id ? gc_current.thread_data : NULL;
+    }
+    else
+    {
+        profile->gc_time += measurement - profile->gc_start;
+        profile->gc_count++;
+    }
+}
+
+static void prof_flush_gc(prof_profile_t* profile)
+{
+    thread_data_t* thread_data = profile->gc_thread_data;
+
+    // Collections triggered by threads that are not profiled are dropped
+    if (thread_data && thread_data->trace && thread_data->event_log)
+    {
+        prof_event_t* event = prof_event_log_append(thread_data->event_log, EVENT_LOG_GC, NULL, profile->gc_time);
+        event->gc_count = (unsigned int)profile->gc_count;
+    }
+    else if (thread_data && thread_data->trace)
+    {
+        prof_charge_gc(thread_data, profile->gc_count, profile->gc_time);
+    }
+
+    profile->gc_time = 0;
+    profile->gc_count = 0;
+    profile->gc_thread_data = NULL;
+}
+
+static void prof_flush_allocation(prof_profile_t* profile)
+{
+    prof_allocate_memory(profile->allocated_allocation, profile->allocated_object, profile->allocation_interval);
+    profile->allocated_object = Qnil;
+    profile->allocated_allocation = NULL;
+}
+
+/* Objects are removed from the live objects table when they are freed. This hook runs during garbage
+   collection so it must not allocate. */
+static void prof_freeobj_hook(VALUE trace_point, void* data)
+{
+    prof_profile_t* profile = (prof_profile_t*)data;
+    prof_live_objects_delete(profile->live_objects, rb_tracearg_object(rb_tracearg_from_tracepoint(trace_point)));
+}
+
+/* Charges objects that are still alive to their allocations. Objects that are garbage but have not been swept
+   are still in the live objects table, so first run a full garbage collection. */
+static void prof_collect_retained(prof_profile_t* profile)
+{
+    rb_gc_start();
+
+    rb_tracepoint_disable(profile->freeobj_tracepoint);
+    profile->freeobj_tracepoint = Qnil;
+
+    prof_live_objects_retain(profile->live_objects, profile->allocation_interval);
+    prof_live_objects_free(profile->live_objects);
+    profile->live_objects = NULL;
 }
 
 /* ===========  Profiling ================= */
-static void prof_trace(prof_profile_t* profile, rb_trace_arg_t* trace_arg, double measurement)
+static void prof_trace(prof_profile_t* profile, rb_trace_arg_t* trace_arg, int64_t measurement)
 {
     static VALUE last_fiber = Qnil;
     VALUE fiber = rb_fiber_current();
@@ -186,19 +418,87 @@ static void prof_trace(prof_profile_t* profile, rb_trace_arg_t* trace_arg, doubl
     const char* source_file_char = (source_file != Qnil ? StringValuePtr(source_file) : "");
 
     fprintf(trace_file, "%2lu:%2f %-8s %s#%s    %s:%2d\n",
-            NUM2ULONG(rb_obj_id(fiber)), (double)measurement,
+            NUM2ULONG(rb_obj_id(fiber)), measurement / profile->measurer->resolution,
             event_name, class_name, method_name_char, source_file_char, source_line);
     fflush(trace_file);
     last_fiber = fiber;
 }
 
+/* Records an event for a deferred profile. Methods are still resolved here, via the method cache, but
+   call trees are not built until the profile is stopped. */
+static void prof_defer_event(prof_profile_t* profile, thread_data_t* thread_data, rb_trace_arg_t* trace_arg, rb_event_flag_t event, int64_t measurement)
+{
+    prof_event_log_t* log = thread_data->event_log;
+
+    switch (event)
+    {
+        case RUBY_EVENT_CALL:
+        case RUBY_EVENT_C_CALL:
+        {
+            prof_event_log_append(log, EVENT_LOG_CALL, check_method(profile, trace_arg, event, thread_data), measurement);
+            break;
+        }
+        case RUBY_EVENT_RETURN:
+        case RUBY_EVENT_C_RETURN:
+        {
+            prof_event_log_append(log, EVENT_LOG_RETURN, check_method(profile, trace_arg, event, thread_data), measurement);
+            break;
+        }
+        case RUBY_EVENT_LINE:
+        {
+            VALUE source_file = rb_tracearg_path(trace_arg);
+            if (source_file != log->last_source_file)
+            {
+                rb_st_insert(log->source_files, source_file, Qtrue);
+                log->last_source_file = source_file;
+            }
+
+            prof_event_log_append_line(log, check_method(profile, trace_arg, event, thread_data), measurement,
+                                       source_file, FIX2INT(rb_tracearg_lineno(trace_arg)));
+            break;
+        }
+    }
+}
+
+/* Returns whether to record an allocation when only some allocations are recorded */
+static inline bool prof_sample_allocation(prof_profile_t* profile, rb_trace_arg_t* trace_arg)
+{
+    if (profile->allocation_interval <= 1)
+        return true;
+
+    // Internal objects are never recorded, so they do not count towards the interval
+    if (BUILTIN_TYPE(rb_tracearg_object(trace_arg)) == T_IMEMO)
+        return false;
+
+    if (--profile->allocation_countdown > 0)
+        return false;
+
+    profile->allocation_countdown = prof_allocation_sample_gap(&profile->allocation_random, profile->allocation_interval);
+    return true;
+}
+
 static void prof_event_hook(VALUE trace_point, void* data)
 {
     prof_profile_t* profile = (prof_profile_t*)(data);
 
     rb_trace_arg_t* trace_arg = rb_tracearg_from_tracepoint(trace_point);
-    double measurement = prof_measure(profile->measurer, trace_arg);
     rb_event_flag_t event = rb_tracearg_event_flag(trace_arg);
+
+    /* Skip allocations that are not sampled as early as possible. They still have to be measured when the
+       measure mode counts allocations. */
+    bool skip_allocation = event == RUBY_INTERNAL_EVENT_NEWOBJ && !prof_sample_allocation(profile, trace_arg);
+    if (skip_allocation && !profile->measure_allocations)
+        return;
+
+    int64_t measurement = prof_measure(profile->measurer, trace_arg);
+
+    int64_t extra_measurements[MAX_EXTRA_MEASUREMENTS];
+    for (int i = 0; i < profile->extra_measurer_count; i++)
+        extra_measurements[i] = prof_measure(profile->extra_measurers[i], trace_arg);
+
+    if (skip_allocation)
+        return;
+
     VALUE self = rb_tracearg_self(trace_arg);
 
     if (trace_file != NULL)
@@ -206,6 +506,10 @@ static void prof_event_hook(VALUE trace_point, void* data)
         prof_trace(profile, trace_arg, measurement);
     }
 
+    // The previous object has been initialized by now so its size is known
+    if (profile->allocated_allocation)
+        prof_flush_allocation(profile);
+
     /* Special case - skip any methods from the mProf
      module since they clutter the results but aren't important. */
     if (self == mProf)
@@ -213,9 +517,22 @@ static void prof_event_hook(VALUE trace_point, void* data)
 
     thread_data_t* thread_data = check_fiber(profile, measurement);
 
+    // Allocating objects is not allowed during newobj events, so wait for the next event
+    if (profile->gc_count > 0 && event != RUBY_INTERNAL_EVENT_NEWOBJ)
+        prof_flush_gc(profile);
+
     if (!thread_data->trace)
         return;
 
+    for (int i = 0; i < profile->extra_measurer_count; i++)
+        thread_data->stack->extra_measurements[i] = extra_measurements[i];
+
+    if (thread_data->event_log)
+    {
+        prof_defer_event(profile, thread_data, trace_arg, event, measurement);
+        return;
+    }
+
     switch (event)
     {
         case RUBY_EVENT_LINE:
@@ -231,22 +548,7 @@ static void prof_event_hook(VALUE trace_point, void* data)
                 if (!method)
                     break;
 
-                prof_call_tree_t* call_tree = prof_call_tree_create(method, NULL, method->source_file, method->source_line);
-                prof_add_call_tree(method->call_trees, call_tree);
-
-                // We have climbed higher in the stack then where we started
-                if (thread_data->call_tree)
-                {
-                    prof_call_tree_add_parent(thread_data->call_tree, call_tree);
-                    frame = prof_frame_unshift(thread_data->stack, call_tree, thread_data->call_tree, measurement);
-                }
-                // This is the first method to be profiled
-                else
-                {
-                    frame = prof_frame_push(thread_data->stack, call_tree, measurement, RTEST(profile->paused));
-                }
-
-                thread_data->call_tree = call_tree;
+                frame = prof_enter_running_method(thread_data, method, measurement, RTEST(profile->paused));
             }
 
             frame->source_file = rb_tracearg_path(trace_arg);
@@ -260,55 +562,36 @@ static void prof_event_hook(VALUE trace_point, void* data)
             prof_method_t* method = check_method(profile, trace_arg, event, thread_data);
 
             if (!method)
-                break;
-
-            prof_frame_t* frame = prof_frame_current(thread_data->stack);
-            prof_call_tree_t* parent_call_tree = NULL;
-            prof_call_tree_t* call_tree = NULL;
-
-            // Frame can be NULL if we are switching from one fiber to another (see FiberTest#fiber_test)
-            if (frame)
-            {
-                parent_call_tree = frame->call_tree;
-                call_tree = call_tree_table_lookup(parent_call_tree->children, method->key);
-            }
-            else if (!frame && thread_data->call_tree)
-            {
-                // There is no current parent - likely we have returned out of the highest level method we have profiled so far.
-                // This can happen with enumerators (see fiber_test.rb). So create a new dummy parent.
-                prof_method_t* parent_method = check_parent_method(profile, thread_data);
-                parent_call_tree = prof_call_tree_create(parent_method, NULL, Qnil, 0);
-                prof_add_call_tree(parent_method->call_trees, parent_call_tree);
-                prof_call_tree_add_parent(thread_data->call_tree, parent_call_tree);
-                frame = prof_frame_unshift(thread_data->stack, parent_call_tree, thread_data->call_tree, measurement);
-                thread_data->call_tree = parent_call_tree;
-            }
-
-            if (!call_tree)
             {
-                // This call info does not yet exist.  So create it and add it to previous CallTree's children and the current method.
-                call_tree = prof_call_tree_create(method, parent_call_tree, frame ? frame->source_file : Qnil, frame? frame->source_line : 0);
-                prof_add_call_tree(method->call_trees, call_tree);
-                if (parent_call_tree)
-                    prof_call_tree_add_child(parent_call_tree, call_tree);
+                // Remember the excluded call so its return does not pop the caller
+                prof_frame_t* frame = prof_frame_current(thread_data->stack);
+                if (frame)
+                    frame->excluded_depth++;
+                break;
             }
 
-            if (!thread_data->call_tree)
-                thread_data->call_tree = call_tree;
-
-            // Push a new frame onto the stack for a new c-call or ruby call (into a method)
-            prof_frame_t* next_frame = prof_frame_push(thread_data->stack, call_tree, measurement, RTEST(profile->paused));
-            next_frame->source_file = method->source_file;
-            next_frame->source_line = method->source_line;
+            prof_frame_t* frame = prof_enter_method(profile, thread_data, method, measurement, RTEST(profile->paused));
+            frame->traced = true;
             break;
         }
         case RUBY_EVENT_RETURN:
         case RUBY_EVENT_C_RETURN:
         {
-            // We need to check for excluded methods so that we don't pop them off the stack
-            prof_method_t* method = check_method(profile, trace_arg, event, thread_data);
+            // Returns are matched against the stack since every traced call pushed a frame or was counted as excluded
+            prof_frame_t* frame = prof_frame_current(thread_data->stack);
 
-            if (!method)
+            if (!frame)
+                break;
+
+            if (frame->excluded_depth > 0)
+            {
+                frame->excluded_depth--;
+                break;
+            }
+
+            /* Frames that were not pushed by a call event belong to methods that were running before profiling
+               started. Their callers may also return through excluded methods, so check those the slow way. */
+            if (!frame->traced && !check_method(profile, trace_arg, event, thread_data))
                 break;
 
             prof_frame_pop(thread_data->stack, measurement);
@@ -323,7 +606,15 @@ static void prof_event_hook(VALUE trace_point, void* data)
 
             prof_method_t* method = prof_find_method(thread_data->stack, source_file, source_line);
             if (method)
-                prof_allocate_increment(method->allocations_table, trace_arg);
+            {
+                profile->allocated_allocation = prof_allocate_increment(prof_method_allocations_table(method), trace_arg, profile->allocation_interval);
+                if (profile->allocated_allocation)
+                {
+                    profile->allocated_object = rb_tracearg_object(trace_arg);
+                    if (profile->live_objects)
+                        prof_live_objects_insert(profile->live_objects, profile->allocated_object, profile->allocated_allocation);
+                }
+            }
 
             break;
         }
@@ -334,11 +625,15 @@ void prof_install_hook(VALUE self)
 {
     prof_profile_t* profile = prof_get_profile(self);
 
-    VALUE event_tracepoint = rb_tracepoint_new(Qnil,
-                                               RUBY_EVENT_CALL | RUBY_EVENT_RETURN |
-                                               RUBY_EVENT_C_CALL | RUBY_EVENT_C_RETURN |
-                                               RUBY_EVENT_LINE,
-                                               prof_event_hook, profile);
+    rb_event_flag_t events = RUBY_EVENT_CALL | RUBY_EVENT_RETURN;
+
+    if (profile->events >= EVENTS_C_CALLS)
+        events |= RUBY_EVENT_C_CALL | RUBY_EVENT_C_RETURN;
+
+    if (profile->events >= EVENTS_LINES)
+        events |= RUBY_EVENT_LINE;
+
+    VALUE event_tracepoint = rb_tracepoint_new(Qnil, events, prof_event_hook, profile);
     rb_ary_push(profile->tracepoints, event_tracepoint);
 
     if (profile->measurer->track_allocations)
@@ -347,6 +642,20 @@ void prof_install_hook(VALUE self)
         rb_ary_push(profile->tracepoints, allocation_tracepoint);
     }
 
+    // Not stored with the other tracepoints since it stays enabled until retained objects are counted
+    if (profile->track_retained)
+    {
+        profile->live_objects = prof_live_objects_create();
+        profile->freeobj_tracepoint = rb_tracepoint_new(Qnil, RUBY_INTERNAL_EVENT_FREEOBJ, prof_freeobj_hook, profile);
+        rb_tracepoint_enable(profile->freeobj_tracepoint);
+    }
+
+    if (profile->track_gc)
+    {
+        VALUE gc_tracepoint = rb_tracepoint_new(Qnil, RUBY_INTERNAL_EVENT_GC_ENTER | RUBY_INTERNAL_EVENT_GC_EXIT, prof_gc_hook, profile);
+        rb_ary_push(profile->tracepoints, gc_tracepoint);
+    }
+
     for (int i = 0; i < RARRAY_LEN(profile->tracepoints); i++)
     {
         rb_tracepoint_enable(rb_ary_entry(profile->tracepoints, i));
@@ -397,6 +706,16 @@ static int prof_profile_mark_methods(st_data_t key, st_data_t value, st_data_t r
     return ST_CONTINUE;
 }
 
+/* Call trees do not mark the objects they reference. Instead the objects are added to their profile's values
+   table, which is marked in one pass. Many call trees share the same source file so this keeps the cost of a
+   garbage collection proportional to the number of distinct objects instead of the size of the call trees.
+   Values are never removed, and are pinned since the call trees are not updated when objects move. */
+void prof_profile_pin_value(prof_profile_t* profile, VALUE value)
+{
+    if (!SPECIAL_CONST_P(value))
+        rb_st_insert(profile->values, value, 0);
+}
+
 static void prof_profile_mark(void* data)
 {
     prof_profile_t* profile = (prof_profile_t*)data;
@@ -404,6 +723,16 @@ static void prof_profile_mark(void* data)
     rb_gc_mark_movable(profile->tracepoints);
     rb_gc_mark_movable(profile->running);
     rb_gc_mark_movable(profile->paused);
+    rb_gc_mark_movable(profile->freeobj_tracepoint);
+
+    // Pinned since the allocation is not recorded until the next event
+    rb_gc_mark(profile->allocated_object);
+
+    if (profile->measurer)
+        prof_measurer_mark(profile->measurer);
+
+    for (int i = 0; i < profile->extra_measurer_count; i++)
+        prof_measurer_mark(profile->extra_measurers[i]);
 
     // If GC stress is true (useful for debugging), when threads_table_create is called in the
     // allocate method Ruby will immediately call this mark method. Thus the threads_tbl will be NULL.
@@ -412,6 +741,12 @@ static void prof_profile_mark(void* data)
 
     if (profile->exclude_methods_tbl)
         rb_st_foreach(profile->exclude_methods_tbl, prof_profile_mark_methods, 0);
+
+    if (profile->method_descriptors)
+        method_descriptors_mark(profile->method_descriptors);
+
+    if (profile->values)
+        rb_mark_set(profile->values);
 }
 
 void prof_profile_compact(void* data)
@@ -421,6 +756,10 @@ void prof_profile_compact(void* data)
     profile->tracepoints = rb_gc_location(profile->tracepoints);
     profile->running = rb_gc_location(profile->running);
     profile->paused = rb_gc_location(profile->paused);
+    profile->freeobj_tracepoint = rb_gc_location(profile->freeobj_tracepoint);
+
+    if (profile->live_objects)
+        prof_live_objects_compact(profile->live_objects);
 }
 
 /* Freeing the profile creates a cascade of freeing. It frees its threads table, which frees
@@ -428,11 +767,32 @@ void prof_profile_compact(void* data)
 static void prof_profile_ruby_gc_free(void* data)
 {
     prof_profile_t* profile = (prof_profile_t*)data;
+    prof_sampling_remove(profile);
+    prof_gvl_remove(profile);
     profile->last_thread_data = NULL;
 
+    // A profile that was never stopped is still tracking frees into its live objects table
+    if (profile->freeobj_tracepoint != Qnil)
+    {
+        rb_tracepoint_disable(profile->freeobj_tracepoint);
+        profile->freeobj_tracepoint = Qnil;
+    }
+
+    if (profile->live_objects)
+    {
+        prof_live_objects_free(profile->live_objects);
+        profile->live_objects = NULL;
+    }
+
     threads_table_free(profile->threads_tbl);
     profile->threads_tbl = NULL;
 
+    if (profile->fibers_tbl)
+    {
+        rb_st_free_table(profile->fibers_tbl);
+        profile->fibers_tbl = NULL;
+    }
+
     if (profile->exclude_threads_tbl)
     {
         rb_st_free_table(profile->exclude_threads_tbl);
@@ -449,9 +809,20 @@ static void prof_profile_ruby_gc_free(void* data)
     method_table_free(profile->exclude_methods_tbl);
     profile->exclude_methods_tbl = NULL;
 
+    // Freed after the threads and excluded methods that use them
+    method_descriptors_free(profile->method_descriptors);
+    profile->method_descriptors = NULL;
+
+    rb_st_free_table(profile->values);
+    profile->values = NULL;
+
     xfree(profile->measurer);
     profile->measurer = NULL;
 
+    for (int i = 0; i < profile->extra_measurer_count; i++)
+        xfree(profile->extra_measurers[i]);
+    profile->extra_measurer_count = 0;
+
     xfree(profile);
 }
 
@@ -481,12 +852,40 @@ static VALUE prof_allocate(VALUE klass)
     result = TypedData_Make_Struct(klass, prof_profile_t, &profile_type, profile);
     profile->object = result;
     profile->threads_tbl = threads_table_create();
+    profile->fibers_tbl = rb_st_init_numtable();
     profile->exclude_threads_tbl = NULL;
     profile->include_threads_tbl = NULL;
+    profile->gvl_hook = NULL;
+    profile->gvl_id = 0;
+    profile->extra_measurer_count = 0;
     profile->running = Qfalse;
     profile->allow_exceptions = false;
+    profile->events = EVENTS_LINES;
     profile->exclude_methods_tbl = method_table_create();
+    profile->method_descriptors = method_descriptors_create();
+    profile->values = rb_st_init_numtable();
     profile->running = Qfalse;
+    profile->sampling = false;
+    profile->deferred = false;
+    profile->compensate_overhead = false;
+    profile->fold_recursion = false;
+    profile->overhead = 0;
+    profile->track_gc = false;
+    profile->gc_start = 0;
+    profile->gc_time = 0;
+    profile->gc_count = 0;
+    profile->gc_thread_data = NULL;
+    profile->gc_id = 0;
+    profile->allocated_object = Qnil;
+    profile->allocated_allocation = NULL;
+    profile->allocation_interval = 1;
+    profile->allocation_countdown = 1;
+    profile->allocation_random = 0;
+    profile->measure_allocations = false;
+    profile->track_retained = false;
+    profile->live_objects = NULL;
+    profile->freeobj_tracepoint = Qnil;
+    profile->sample_interval = DEFAULT_SAMPLE_INTERVAL;
     profile->tracepoints = rb_ary_new();
     return result;
 }
@@ -500,19 +899,43 @@ static int pop_frames(VALUE key, st_data_t value, st_data_t data)
 {
     thread_data_t* thread_data = (thread_data_t*)value;
     prof_profile_t* profile = (prof_profile_t*)data;
-    double measurement = prof_measure(profile->measurer, NULL);
+    int64_t measurement = thread_measurement(profile, thread_data, prof_measure(profile->measurer, NULL));
+    thread_extra_measurements(profile, thread_data);
 
     if (profile->last_thread_data->fiber != thread_data->fiber)
         switch_thread(profile, thread_data, measurement);
 
     while (prof_frame_pop(thread_data->stack, measurement));
 
+    // The cache is only needed while profiling and methods may be excluded before the next run
+    thread_method_cache_clear(thread_data);
+
+    return ST_CONTINUE;
+}
+
+static int replay_threads(VALUE key, st_data_t value, st_data_t data)
+{
+    thread_data_t* thread_data = (thread_data_t*)value;
+    prof_profile_t* profile = (prof_profile_t*)data;
+    prof_event_log_replay(profile, thread_data, thread_measurement(profile, thread_data, profile->measurement_at_stop));
     return ST_CONTINUE;
 }
 
 static void
 prof_stop_threads(prof_profile_t* profile)
 {
+    if (profile->gc_count > 0)
+        prof_flush_gc(profile);
+
+    if (profile->allocated_allocation)
+        prof_flush_allocation(profile);
+
+    if (profile->deferred)
+    {
+        profile->measurement_at_stop = prof_measure(profile->measurer, NULL);
+        rb_st_foreach(profile->threads_tbl, replay_threads, (st_data_t)profile);
+    }
+
     rb_st_foreach(profile->threads_tbl, pop_frames, (st_data_t)profile);
 }
 
@@ -523,14 +946,35 @@ prof_stop_threads(prof_profile_t* profile)
    Returns a new profiler. Possible keyword arguments include:
 
    measure_mode:      Measure mode. Specifies the profile measure mode.
-                      If not specified, defaults to RubyProf::WALL_TIME.
+                      If not specified, defaults to RubyProf::WALL_TIME. An array of up to
+                      four modes records all of them in the same run, see MethodInfo#measurements.
    allow_exceptions:  Whether to raise exceptions encountered during profiling,
                       or to suppress all exceptions during profiling
    track_allocations: Whether to track object allocations while profiling. True or false.
+   track_retained:    Whether to record which allocated objects are still alive when the profile is
+                      stopped, see Allocation#retained. Implies track_allocations. True or false.
+   allocation_interval: Record one in this many allocations, chosen at random, and scale up
+                      the recorded counts and sizes. Defaults to 1, which records every allocation.
+   track_gc:          Whether to charge garbage collection to a [GC] method called by the method
+                      that triggered it. True or false.
    exclude_common:    Exclude common methods from the profile. True or false.
    exclude_threads:   Threads to exclude from the profiling results.
    include_threads:   Focus profiling on only the given threads. This will ignore
-                      all other threads. */
+                      all other threads.
+   events:            Which events to trace. RubyProf::EVENTS_METHODS traces Ruby method calls,
+                      RubyProf::EVENTS_C_CALLS also traces C method calls and RubyProf::EVENTS_LINES
+                      also traces line events to record where methods are called from.
+                      Defaults to RubyProf::EVENTS_LINES.
+   compensate_overhead: Estimate the cost of profiling each method call when the profile is
+                      started and subtract it from the results. True or false.
+   deferred:          Record events while profiling and build call trees when the profile
+                      is stopped. This reduces the work done while the profiled code runs
+                      at the cost of memory. True or false.
+   fold_recursion:    Charge recursive calls to the call tree of the method's nearest call on the
+                      stack instead of adding a level to the call tree. True or false.
+   sampling:          Periodically sample the call stack instead of tracing every method
+                      call. This greatly reduces overhead but call counts are estimates. True or false.
+   sample_interval:   Seconds between samples when sampling. Defaults to 0.001. */
 static VALUE prof_initialize(int argc, VALUE* argv, VALUE self)
 {
     VALUE keywords;
@@ -541,9 +985,18 @@ static VALUE prof_initialize(int argc, VALUE* argv, VALUE self)
                   rb_intern("allow_exceptions"),
                   rb_intern("exclude_common"),
                   rb_intern("exclude_threads"),
-                  rb_intern("include_threads") };
-    VALUE values[6];
-    rb_get_kwargs(keywords, table, 0, 6, values);
+                  rb_intern("include_threads"),
+                  rb_intern("sampling"),
+                  rb_intern("sample_interval"),
+                  rb_intern("events"),
+                  rb_intern("deferred"),
+                  rb_intern("compensate_overhead"),
+                  rb_intern("track_gc"),
+                  rb_intern("allocation_interval"),
+                  rb_intern("track_retained"),
+                  rb_intern("fold_recursion") };
+    VALUE values[15];
+    rb_get_kwargs(keywords, table, 0, 15, values);
 
     VALUE mode = values[0] == Qundef ? INT2NUM(MEASURE_WALL_TIME) : values[0];
     VALUE track_allocations = values[1] == Qtrue ? Qtrue : Qfalse;
@@ -551,11 +1004,81 @@ static VALUE prof_initialize(int argc, VALUE* argv, VALUE self)
     VALUE exclude_common = values[3] == Qtrue ? Qtrue : Qfalse;
     VALUE exclude_threads = values[4];
     VALUE include_threads = values[5];
+    VALUE sampling = values[6] == Qtrue ? Qtrue : Qfalse;
+    VALUE sample_interval = values[7];
+    VALUE events = values[8] == Qundef ? INT2NUM(EVENTS_LINES) : values[8];
+    VALUE deferred = values[9] == Qtrue ? Qtrue : Qfalse;
+    VALUE compensate_overhead = values[10] == Qtrue ? Qtrue : Qfalse;
+    VALUE track_gc = values[11] == Qtrue ? Qtrue : Qfalse;
+    VALUE allocation_interval = values[12];
+    VALUE track_retained = values[13] == Qtrue ? Qtrue : Qfalse;
+    VALUE fold_recursion = values[14] == Qtrue ? Qtrue : Qfalse;
+
+    VALUE modes = Qnil;
+    if (RB_TYPE_P(mode, T_ARRAY))
+    {
+        modes = mode;
+        if (RARRAY_LEN(modes) < 1 || RARRAY_LEN(modes) > MAX_MEASURE_MODES)
+            rb_raise(rb_eArgError, "A profile can record between 1 and %d measure modes", MAX_MEASURE_MODES);
+        mode = rb_ary_entry(modes, 0);
+    }
 
     Check_Type(mode, T_FIXNUM);
     prof_profile_t* profile = prof_get_profile(self);
-    profile->measurer = prof_measurer_create(NUM2INT(mode), RB_TEST(track_allocations));
+    profile->measurer = prof_measurer_create(NUM2INT(mode), RB_TEST(track_allocations) || RB_TEST(track_retained));
+    profile->track_retained = RB_TEST(track_retained);
+
+    for (int i = 1; i < (NIL_P(modes) ? 0 : RARRAY_LEN(modes)); i++)
+    {
+        VALUE extra_mode = rb_ary_entry(modes, i);
+        Check_Type(extra_mode, T_FIXNUM);
+        prof_measurer_t* measurer = prof_measurer_create(NUM2INT(extra_mode), false);
+        profile->extra_measurers[profile->extra_measurer_count++] = measurer;
+
+        // Allocation modes count newobj events
+        if (measurer->track_allocations)
+            profile->measurer->track_allocations = true;
+    }
     profile->allow_exceptions = RB_TEST(allow_exceptions);
+    profile->sampling = RB_TEST(sampling);
+
+    // Allocation measure modes count every newobj event themselves
+    profile->measure_allocations = prof_measurer_counts_allocations(profile->measurer);
+    for (int i = 0; i < profile->extra_measurer_count; i++)
+        profile->measure_allocations |= prof_measurer_counts_allocations(profile->extra_measurers[i]);
+
+    if (allocation_interval != Qundef)
+    {
+        Check_Type(allocation_interval, T_FIXNUM);
+        if (NUM2LONG(allocation_interval) < 1)
+            rb_raise(rb_eArgError, "Allocation interval must be at least 1: %ld", NUM2LONG(allocation_interval));
+        profile->allocation_interval = NUM2ULONG(allocation_interval);
+    }
+
+    Check_Type(events, T_FIXNUM);
+    if (NUM2INT(events) < EVENTS_METHODS || NUM2INT(events) > EVENTS_LINES)
+        rb_raise(rb_eArgError, "Unknown events value: %d", NUM2INT(events));
+    profile->events = (prof_events_t)NUM2INT(events);
+
+    if (sample_interval != Qundef)
+        profile->sample_interval = NUM2DBL(sample_interval);
+
+    if (profile->sampling)
+        prof_sampling_check(profile);
+
+    profile->deferred = RB_TEST(deferred);
+    profile->compensate_overhead = RB_TEST(compensate_overhead);
+    profile->fold_recursion = RB_TEST(fold_recursion);
+    if (profile->deferred && profile->sampling)
+        rb_raise(rb_eArgError, "Deferred profiles do not support sampling");
+    if (profile->deferred && profile->measurer->track_allocations)
+        rb_raise(rb_eArgError, "Deferred profiles do not support tracking or measuring allocations");
+    if (profile->extra_measurer_count > 0 && (profile->sampling || profile->deferred))
+        rb_raise(rb_eArgError, "Sampled and deferred profiles only support one measure mode");
+
+    profile->track_gc = RB_TEST(track_gc);
+    if (profile->track_gc && profile->sampling)
+        rb_raise(rb_eArgError, "Sampling does not support tracking garbage collection");
 
     if (exclude_threads != Qundef)
     {
@@ -620,6 +1143,20 @@ static VALUE prof_profile_measure_mode(VALUE self)
     return INT2NUM(profile->measurer->mode);
 }
 
+/* call-seq:
+   measure_modes -> [measure_mode]
+
+   Returns the measure modes recorded by this profile. The first is the same as measure_mode.*/
+static VALUE prof_profile_measure_modes(VALUE self)
+{
+    prof_profile_t* profile = prof_get_profile(self);
+    VALUE result = rb_ary_new();
+    rb_ary_push(result, INT2NUM(profile->measurer->mode));
+    for (int i = 0; i < profile->extra_measurer_count; i++)
+        rb_ary_push(result, INT2NUM(profile->extra_measurers[i]->mode));
+    return result;
+}
+
 /* call-seq:
    track_allocations -> boolean
 
@@ -630,6 +1167,166 @@ static VALUE prof_profile_track_allocations(VALUE self)
     return profile->measurer->track_allocations ? Qtrue : Qfalse;
 }
 
+/* call-seq:
+   events -> events
+
+   Returns which events are traced by this profile.*/
+static VALUE prof_profile_events(VALUE self)
+{
+    prof_profile_t* profile = prof_get_profile(self);
+    return INT2NUM(profile->events);
+}
+
+/* call-seq:
+   overhead -> float
+
+   Returns the estimated measurement that profiling a single call or return event adds to the
+   results. This is only calculated, when the profile is started, if the profile was created
+   with compensate_overhead: true. Otherwise it is 0.*/
+static VALUE prof_profile_overhead(VALUE self)
+{
+    prof_profile_t* profile = prof_get_profile(self);
+    return rb_float_new(profile->overhead / profile->measurer->resolution);
+}
+
+/* call-seq:
+   deferred? -> boolean
+
+   Returns if this profile builds its call trees when it is stopped.*/
+static VALUE prof_profile_deferred(VALUE self)
+{
+    prof_profile_t* profile = prof_get_profile(self);
+    return profile->deferred ? Qtrue : Qfalse;
+}
+
+/* call-seq:
+   fold_recursion? -> boolean
+
+   Returns if this profile charges recursive calls to the call tree of the method's nearest call.*/
+static VALUE prof_profile_fold_recursion(VALUE self)
+{
+    prof_profile_t* profile = prof_get_profile(self);
+    return profile->fold_recursion ? Qtrue : Qfalse;
+}
+
+/* call-seq:
+   track_retained? -> boolean
+
+   Returns if this profile records which allocated objects are still alive when it is stopped.*/
+static VALUE prof_profile_track_retained(VALUE self)
+{
+    prof_profile_t* profile = prof_get_profile(self);
+    return profile->track_retained ? Qtrue : Qfalse;
+}
+
+/* call-seq:
+   allocation_interval -> integer
+
+   Returns how many allocations this profile records one of on average. 1 means every allocation is recorded.*/
+static VALUE prof_profile_allocation_interval(VALUE self)
+{
+    prof_profile_t* profile = prof_get_profile(self);
+    return ULL2NUM(profile->allocation_interval);
+}
+
+/* call-seq:
+   track_gc? -> boolean
+
+   Returns if this profile charges garbage collection to a [GC] method.*/
+static VALUE prof_profile_track_gc(VALUE self)
+{
+    prof_profile_t* profile = prof_get_profile(self);
+    return profile->track_gc ? Qtrue : Qfalse;
+}
+
+/* call-seq:
+   sampling? -> boolean
+
+   Returns if this profile samples the call stack instead of tracing method calls.*/
+static VALUE prof_profile_sampling(VALUE self)
+{
+    prof_profile_t* profile = prof_get_profile(self);
+    return profile->sampling ? Qtrue : Qfalse;
+}
+
+#define CALIBRATION_CALLS 1000
+#define CALIBRATION_ROUNDS 5
+
+static VALUE prof_start(VALUE self);
+static VALUE prof_stop(VALUE self);
+
+static int64_t calibration_loop(VALUE calibration, ID loop, prof_measurer_t* measurer)
+{
+    int64_t start = prof_measure(measurer, NULL);
+    rb_funcall(calibration, loop, 1, INT2FIX(CALIBRATION_CALLS));
+    return prof_measure(measurer, NULL) - start;
+}
+
+static void calibration_round(VALUE calibration, prof_measurer_t* measurer, int64_t* calls, int64_t* no_calls)
+{
+    int64_t measurement = calibration_loop(calibration, rb_intern("calls"), measurer);
+    if (*calls < 0 || measurement < *calls)
+        *calls = measurement;
+
+    measurement = calibration_loop(calibration, rb_intern("no_calls"), measurer);
+    if (*no_calls < 0 || measurement < *no_calls)
+        *no_calls = measurement;
+}
+
+/* Estimates the measurement each event hook adds to the methods being profiled. A scratch profile with the
+   same options runs RubyProf::Profile::Calibration with and without its event hooks enabled. Its calls method
+   calls a trivial Ruby method in a loop, so each call is pushed and popped under a profiled frame like any
+   other. Its no_calls method is the same loop without the call, so subtracting it leaves the cost of the call
+   and return events. The fastest of several rounds is used to reduce noise. */
+static int64_t prof_calibrate_overhead(prof_profile_t* profile)
+{
+    if (profile->sampling || profile->measurer->mode == MEASURE_ALLOCATIONS ||
+        profile->measurer->mode == MEASURE_ALLOCATED_BYTES)
+        return 0;
+
+    VALUE calibration = rb_const_get(cProfile, rb_intern("Calibration"));
+    VALUE scratch = rb_obj_alloc(cProfile);
+    prof_profile_t* scratch_profile = prof_get_profile(scratch);
+    scratch_profile->measurer = prof_measurer_create(profile->measurer->mode, false);
+    scratch_profile->events = profile->events;
+    scratch_profile->deferred = profile->deferred;
+    scratch_profile->fold_recursion = profile->fold_recursion;
+
+    int64_t traced_calls = -1;
+    int64_t traced_no_calls = -1;
+    int64_t untraced_calls = -1;
+    int64_t untraced_no_calls = -1;
+
+    prof_start(scratch);
+    for (int i = 0; i < CALIBRATION_ROUNDS; i++)
+    {
+        for (int j = 0; j < RARRAY_LEN(scratch_profile->tracepoints); j++)
+            rb_tracepoint_disable(rb_ary_entry(scratch_profile->tracepoints, j));
+
+        calibration_round(calibration, scratch_profile->measurer, &untraced_calls, &untraced_no_calls);
+
+        for (int j = 0; j < RARRAY_LEN(scratch_profile->tracepoints); j++)
+            rb_tracepoint_enable(rb_ary_entry(scratch_profile->tracepoints, j));
+
+        calibration_round(calibration, scratch_profile->measurer, &traced_calls, &traced_no_calls);
+    }
+    prof_stop(scratch);
+
+    int64_t traced = traced_calls - traced_no_calls;
+    int64_t untraced = untraced_calls - untraced_no_calls;
+    int64_t result = (traced - untraced) / (2 * CALIBRATION_CALLS);
+    return result > 0 ? result : 0;
+}
+
+/* Threads from an earlier run keep their thread data, so give them this run's calibration */
+static int update_thread_overhead(VALUE key, st_data_t value, st_data_t data)
+{
+    thread_data_t* thread_data = (thread_data_t*)value;
+    prof_profile_t* profile = (prof_profile_t*)data;
+    thread_data->stack->overhead = profile->overhead;
+    return ST_CONTINUE;
+}
+
 /* call-seq:
    start -> self
 
@@ -645,9 +1342,34 @@ static VALUE prof_start(VALUE self)
         rb_raise(rb_eRuntimeError, "RubyProf.start was already called");
     }
 
+    if (profile->sampling)
+        prof_sampling_install(profile);
+
+    if (profile->compensate_overhead)
+    {
+        profile->overhead = prof_calibrate_overhead(profile);
+        rb_st_foreach(profile->threads_tbl, update_thread_overhead, (st_data_t)profile);
+    }
+
+    prof_gvl_install(profile);
+
+    if (profile->allocation_interval > 1)
+    {
+        // xorshift needs a non zero seed
+        profile->allocation_random = ((uint64_t)time(NULL) << 16) ^ (uint64_t)(uintptr_t)profile ^ 1;
+        profile->allocation_countdown = prof_allocation_sample_gap(&profile->allocation_random, profile->allocation_interval);
+    }
+
     profile->running = Qtrue;
     profile->paused = Qfalse;
     profile->last_thread_data = threads_table_insert(profile, rb_fiber_current());
+    prof_gvl_attach(profile, &profile->last_thread_data->gvl_wait);
+
+    if (profile->track_gc)
+    {
+        profile->gc_id = ++gc_last_id;
+        prof_gc_attach(profile, profile->last_thread_data);
+    }
 
     /* open trace file if environment wants it */
     trace_file_name = getenv("RUBY_PROF_TRACE");
@@ -668,7 +1390,9 @@ static VALUE prof_start(VALUE self)
         }
     }
 
-    prof_install_hook(self);
+    if (!profile->sampling)
+        prof_install_hook(self);
+
     return self;
 }
 
@@ -730,7 +1454,15 @@ static VALUE prof_stop(VALUE self)
         rb_raise(rb_eRuntimeError, "RubyProf.start was not yet called");
     }
 
-    prof_remove_hook(self);
+    if (profile->sampling)
+        prof_sampling_remove(profile);
+    else
+        prof_remove_hook(self);
+
+    prof_gvl_remove(profile);
+
+    if (profile->live_objects)
+        prof_collect_retained(profile);
 
     /* close trace file if open */
     if (trace_file != NULL)
@@ -743,6 +1475,7 @@ static VALUE prof_stop(VALUE self)
     }
 
     prof_stop_threads(profile);
+    method_descriptors_resolve(profile->method_descriptors);
 
     /* Unset the last_thread_data (very important!)
        and the threads table */
@@ -777,6 +1510,7 @@ static VALUE prof_add_thread(VALUE self, VALUE thread)
   thread_ptr->owner = OWNER_C;
 
   rb_st_insert(profile_ptr->threads_tbl, thread_ptr->fiber_id, (st_data_t)thread_ptr);
+  rb_st_insert(profile_ptr->fibers_tbl, thread_ptr->fiber, (st_data_t)thread_ptr);
   return thread;
 }
 
@@ -791,6 +1525,12 @@ static VALUE prof_remove_thread(VALUE self, VALUE thread)
   thread_data_t* thread_ptr = prof_get_thread(thread);
   VALUE fiber_id = thread_ptr->fiber_id;
   rb_st_delete(profile_ptr->threads_tbl, (st_data_t*)&fiber_id, NULL);
+
+  st_data_t fiber = thread_ptr->fiber;
+  st_data_t value;
+  if (rb_st_lookup(profile_ptr->fibers_tbl, fiber, &value) && (thread_data_t*)value == thread_ptr)
+      rb_st_delete(profile_ptr->fibers_tbl, &fiber, NULL);
+
   return thread;
 }
 
@@ -863,7 +1603,7 @@ static VALUE prof_exclude_method(VALUE self, VALUE klass, VALUE msym)
 
     if (!method)
     {
-        method = prof_method_create(profile, klass, msym, Qnil, 0);
+        method = prof_method_create(profile, key, klass, msym, Qnil, 0);
         method_table_insert(profile->exclude_methods_tbl, method->key, method);
     }
 
@@ -880,6 +1620,8 @@ VALUE prof_profile_dump(VALUE self)
     rb_hash_aset(result, ID2SYM(rb_intern("measurer_mode")), INT2NUM(profile->measurer->mode));
     rb_hash_aset(result, ID2SYM(rb_intern("measurer_track_allocations")), 
                  profile->measurer->track_allocations ? Qtrue : Qfalse);
+    rb_hash_aset(result, ID2SYM(rb_intern("measure_modes")), prof_profile_measure_modes(self));
+    rb_hash_aset(result, ID2SYM(rb_intern("track_retained")), profile->track_retained ? Qtrue : Qfalse);
 
     return result;
 }
@@ -894,6 +1636,15 @@ VALUE prof_profile_load(VALUE self, VALUE data)
     profile->measurer = prof_measurer_create((prof_measure_mode_t)(NUM2INT(measurer_mode)),
                                               measurer_track_allocations == Qtrue ? true : false);
 
+    VALUE measure_modes = rb_hash_aref(data, ID2SYM(rb_intern("measure_modes")));
+    for (int i = 1; !NIL_P(measure_modes) && i < rb_array_len(measure_modes) && i < MAX_MEASURE_MODES; i++)
+    {
+        prof_measure_mode_t mode = (prof_measure_mode_t)NUM2INT(rb_ary_entry(measure_modes, i));
+        profile->extra_measurers[profile->extra_measurer_count++] = prof_measurer_create(mode, false);
+    }
+
+    profile->track_retained = RB_TEST(rb_hash_aref(data, ID2SYM(rb_intern("track_retained"))));
+
     VALUE threads = rb_hash_aref(data, ID2SYM(rb_intern("threads")));
     for (int i = 0; i < rb_array_len(threads); i++)
     {
@@ -908,8 +1659,13 @@ VALUE prof_profile_load(VALUE self, VALUE data)
 void rp_init_profile(void)
 {
     cProfile = rb_define_class_under(mProf, "Profile", rb_cObject);
+    gc_method_name = ID2SYM(rb_intern("[GC]"));
     rb_define_alloc_func(cProfile, prof_allocate);
 
+    rb_define_const(mProf, "EVENTS_METHODS", INT2NUM(EVENTS_METHODS));
+    rb_define_const(mProf, "EVENTS_C_CALLS", INT2NUM(EVENTS_C_CALLS));
+    rb_define_const(mProf, "EVENTS_LINES", INT2NUM(EVENTS_LINES));
+
     rb_define_singleton_method(cProfile, "profile", prof_profile_class, -1);
     rb_define_method(cProfile, "initialize", prof_initialize, -1);
     rb_define_method(cProfile, "profile", prof_profile_instance, 0);
@@ -922,7 +1678,16 @@ void rp_init_profile(void)
 
     rb_define_method(cProfile, "exclude_method!", prof_exclude_method, 2);
     rb_define_method(cProfile, "measure_mode", prof_profile_measure_mode, 0);
+    rb_define_method(cProfile, "measure_modes", prof_profile_measure_modes, 0);
     rb_define_method(cProfile, "track_allocations?", prof_profile_track_allocations, 0);
+    rb_define_method(cProfile, "events", prof_profile_events, 0);
+    rb_define_method(cProfile, "deferred?", prof_profile_deferred, 0);
+    rb_define_method(cProfile, "overhead", prof_profile_overhead, 0);
+    rb_define_method(cProfile, "sampling?", prof_profile_sampling, 0);
+    rb_define_method(cProfile, "track_gc?", prof_profile_track_gc, 0);
+    rb_define_method(cProfile, "allocation_interval", prof_profile_allocation_interval, 0);
+    rb_define_method(cProfile, "track_retained?", prof_profile_track_retained, 0);
+    rb_define_method(cProfile, "fold_recursion?", prof_profile_fold_recursion, 0);
 
     rb_define_method(cProfile, "threads", prof_threads, 0);
     rb_define_method(cProfile, "add_thread", prof_add_thread, 1);
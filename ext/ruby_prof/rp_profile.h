@@ -4,11 +4,21 @@
 #pragma once
 
 #include "ruby_prof.h"
+#include "rp_allocation.h"
+#include "rp_live_objects.h"
 #include "rp_measurement.h"
 #include "rp_thread.h"
 
 extern VALUE cProfile;
 
+// Which events are traced. Each level includes the events of the previous levels.
+typedef enum
+{
+    EVENTS_METHODS,                       // Ruby method calls and returns
+    EVENTS_C_CALLS,                       // Also C method calls and returns
+    EVENTS_LINES                          // Also line events, used to record call sites
+} prof_events_t;
+
 typedef struct prof_profile_t
 {
     VALUE object;
@@ -16,17 +26,52 @@ typedef struct prof_profile_t
     VALUE paused;
 
     prof_measurer_t* measurer;
+    prof_measurer_t* extra_measurers[MAX_EXTRA_MEASUREMENTS]; /* Other measure modes recorded in the same run */
+    int extra_measurer_count;
 
     VALUE tracepoints;
 
     st_table* threads_tbl;
+    st_table* fibers_tbl;               /* Threads keyed on their fiber, used to switch fibers without computing ids */
     st_table* exclude_threads_tbl;
     st_table* include_threads_tbl;
     st_table* exclude_methods_tbl;
+    st_table* method_descriptors;       /* Identities of the methods called by any thread, see prof_method_create */
+    st_table* values;                   /* Objects referenced by the threads' call trees, see prof_profile_pin_value */
     thread_data_t* last_thread_data;
-    double measurement_at_pause_resume;
+    int64_t measurement_at_pause_resume;
+    int64_t measurement_at_stop;
     bool allow_exceptions;
+    prof_events_t events;
+    bool sampling;
+    bool deferred;
+    bool compensate_overhead;
+    bool fold_recursion;                /* Recursive calls reuse the call tree of the method's nearest call */
+    int64_t overhead;                   /* Estimated measurement charged to methods by each event hook */
+    bool track_gc;
+    int64_t gc_start;                   /* Measurement when the current garbage collection started */
+    int64_t gc_time;                    /* Garbage collection not yet charged to a method */
+    uint64_t gc_count;
+    thread_data_t* gc_thread_data;      /* Thread that was running when the uncharged collections started */
+    uintptr_t gc_id;                    /* Tags the thread local current thread data, zero unless tracking GC */
+    VALUE allocated_object;             /* Last object allocated, its size is not known until the next event */
+    prof_allocation_t* allocated_allocation;
+    uint64_t allocation_interval;       /* Record one in this many allocations on average */
+    uint64_t allocation_countdown;      /* Allocations until the next one is recorded */
+    uint64_t allocation_random;         /* Random number state used to pick recorded allocations */
+    bool measure_allocations;           /* A measurer counts newobj events, so every one must be measured */
+    bool track_retained;
+    prof_live_objects_t* live_objects;  /* Recorded objects that have not been freed */
+    VALUE freeobj_tracepoint;
+    double sample_interval;
+    void* gvl_hook;                     /* Thread event hook that measures GVL waits, see rp_gvl.c */
+    uintptr_t gvl_id;
 } prof_profile_t;
 
 void rp_init_profile(void);
 prof_profile_t* prof_get_profile(VALUE self);
+thread_data_t* check_fiber(prof_profile_t* profile, int64_t measurement);
+prof_frame_t* prof_enter_method(prof_profile_t* profile, thread_data_t* thread_data, prof_method_t* method, int64_t measurement, bool paused);
+prof_frame_t* prof_enter_running_method(thread_data_t* thread_data, prof_method_t* method, int64_t measurement, bool paused);
+void prof_charge_gc(thread_data_t* thread_data, uint64_t count, int64_t time);
+void prof_profile_pin_value(prof_profile_t* profile, VALUE value);
@@ -0,0 +1,369 @@
+/* Copyright (C) 2005-2019 Shugo Maeda <shugo@ruby-lang.org> and Charlie Savage <cfis@savagexi.com>
+   Please see the LICENSE file for copyright and distribution information */
+
+/* Statistical sampling support. Instead of tracing every method call and return, a timer signal
+   periodically schedules a postponed job that captures the current fiber's stack via rb_profile_frames.
+   Each sample is reconciled against the thread's stack of frames - frames that are no longer on the
+   sampled stack are popped and new ones are pushed. Thus sampled profiles are built from the same
+   prof_call_tree_t and prof_method_t structures as traced profiles and work with all the printers.
+
+   Note call counts are estimates since a method that is called repeatedly between two samples
+   is only counted once. In addition, Ruby reports blocks using their enclosing method so they are
+   attributed to that method. */
+
+/* Needed for sigaction and setitimer since the extension is compiled in strict C mode */
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE 1
+#endif
+
+#include "rp_sampling.h"
+#include "rp_call_tree.h"
+#include "rp_call_trees.h"
+#include "rp_method.h"
+
+#include <ruby/thread.h>
+#include <ruby/version.h>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+#define MAX_SAMPLE_DEPTH 2048
+
+typedef struct prof_sampler_t
+{
+    prof_profile_t* profile;              /* Profile being sampled, only one at a time is supported */
+    VALUE start_fiber;                    /* Fiber that started the profile */
+    VALUE* start_frames;                  /* Frames on the stack when the profile started, outermost first */
+    int start_depth;
+    st_table* exclude_keys;               /* Keys of excluded methods */
+#if !defined(_WIN32)
+    int timer;
+    int signal;
+    struct sigaction old_action;
+    rb_internal_thread_event_hook_t* thread_hook;
+    volatile pthread_t running_thread;    /* Native thread that holds the GVL */
+    volatile sig_atomic_t has_running_thread;
+#endif
+} prof_sampler_t;
+
+static prof_sampler_t sampler;
+static VALUE sample_frames[MAX_SAMPLE_DEPTH];
+static int sample_lines[MAX_SAMPLE_DEPTH];
+
+#if RUBY_API_VERSION_CODE >= 30300
+static rb_postponed_job_handle_t sample_job_handle = POSTPONED_JOB_HANDLE_INVALID;
+#endif
+
+/* Sampled frames do not provide the class a method is defined on, just its path. Thus methods are keyed on
+   the class path which is only computed the first time a frame is seen. */
+static st_data_t sample_method_key(VALUE classpath, VALUE msym, bool singleton)
+{
+    st_data_t hash = rb_hash_start(singleton ? 1 : 0);
+    hash = rb_hash_uint(hash, classpath == Qnil ? 0 : rb_str_hash(classpath));
+    hash = rb_hash_uint(hash, msym);
+    hash = rb_hash_end(hash);
+
+    return hash;
+}
+
+static int collect_exclude_keys(st_data_t key, st_data_t value, st_data_t data)
+{
+    st_table* exclude_keys = (st_table*)data;
+    prof_method_t* method = (prof_method_t*)value;
+
+    VALUE klass = prof_method_klass(method);
+    if (klass != Qnil && !(method->descriptor->klass_flags & (kObjectSingleton | kOtherSingleton)))
+    {
+        bool singleton = method->descriptor->klass_flags & (kClassSingleton | kModuleSingleton);
+        st_data_t sample_key = sample_method_key(rb_class_path(klass), method->descriptor->method_name, singleton);
+        rb_st_insert(exclude_keys, sample_key, Qtrue);
+    }
+
+    return ST_CONTINUE;
+}
+
+static bool sample_excludes_method(VALUE classpath, st_data_t key)
+{
+    /* Skip any methods from the RubyProf module or Profile class since they clutter the results */
+    if (classpath != Qnil && (strcmp(StringValueCStr(classpath), "RubyProf::Profile") == 0 ||
+                              strcmp(StringValueCStr(classpath), "RubyProf") == 0))
+        return true;
+
+    return rb_st_lookup(sampler.exclude_keys, key, NULL);
+}
+
+static prof_method_t* sample_frame_method(prof_profile_t* profile, thread_data_t* thread_data, VALUE frame)
+{
+    st_data_t value;
+    if (rb_st_lookup(thread_data->frames_table, frame, &value))
+        return (prof_method_t*)value;
+
+    VALUE classpath = rb_profile_frame_classpath(frame);
+    VALUE method_name = rb_profile_frame_method_name(frame);
+    bool singleton = RTEST(rb_profile_frame_singleton_method_p(frame));
+    // Blocks such as rescue clauses and the top level script do not have method names so use their labels instead
+    VALUE msym = rb_str_intern(method_name == Qnil ? rb_profile_frame_label(frame) : method_name);
+    st_data_t key = sample_method_key(classpath, msym, singleton);
+
+    prof_method_t* result = NULL;
+
+    if (!sample_excludes_method(classpath, key))
+    {
+        result = method_table_lookup(thread_data->method_table, key);
+
+        if (!result)
+        {
+            VALUE first_lineno = rb_profile_frame_first_lineno(frame);
+            result = prof_method_create(profile, key, Qnil, msym, rb_profile_frame_path(frame),
+                                        first_lineno == Qnil ? 0 : FIX2INT(first_lineno));
+            result->descriptor->klass_name = classpath;
+
+            if (singleton && classpath != Qnil && RSTRING_PTR(classpath)[0] == '#')
+                result->descriptor->klass_flags = kOtherSingleton;
+            else if (singleton)
+                result->descriptor->klass_flags = kClassSingleton;
+
+            method_table_insert(thread_data->method_table, key, result);
+        }
+    }
+
+    // Excluded frames are remembered as NULL so they are only checked once
+    rb_st_insert(thread_data->frames_table, frame, (st_data_t)result);
+    return result;
+}
+
+static void prof_sample(void* data)
+{
+    prof_profile_t* profile = sampler.profile;
+
+    if (!profile || profile->running != Qtrue || profile->paused == Qtrue)
+        return;
+
+    int64_t measurement = prof_measure(profile->measurer, NULL);
+    thread_data_t* thread_data = check_fiber(profile, measurement);
+
+    if (!thread_data->trace)
+        return;
+
+    if (!thread_data->frames_table)
+        thread_data->frames_table = rb_st_init_numtable();
+
+    int depth = rb_profile_frames(0, MAX_SAMPLE_DEPTH, sample_frames, sample_lines);
+
+    /* Frames are returned innermost first. For the fiber that started the profile, skip the frames that were
+       already on the stack except the last one, which is the method that started profiling. */
+    int outermost = depth - 1;
+    if (thread_data->fiber == sampler.start_fiber)
+    {
+        int common = 0;
+        while (common < sampler.start_depth && common < depth &&
+               sample_frames[depth - 1 - common] == sampler.start_frames[common])
+        {
+            common++;
+        }
+
+        if (common > 0)
+            outermost = depth - common;
+    }
+
+    prof_stack_t* stack = thread_data->stack;
+    prof_frame_t* cursor = stack->start;
+    bool diverged = false;
+
+    for (int i = outermost; i >= 0; i--)
+    {
+        prof_method_t* method = sample_frame_method(profile, thread_data, sample_frames[i]);
+
+        if (!method)
+            continue;
+
+        // Step over a parent inserted because the stack's root changed
+        if (!diverged && cursor == stack->start && cursor < stack->ptr &&
+            cursor->call_tree->method != method && prof_method_klass(cursor->call_tree->method) == cProfile)
+        {
+            cursor++;
+        }
+
+        prof_frame_t* frame = NULL;
+
+        if (!diverged && cursor < stack->ptr && cursor->call_tree->method == method)
+        {
+            // This frame is still on the stack
+            frame = cursor;
+            cursor++;
+        }
+        else
+        {
+            if (!diverged)
+            {
+                // Return from all the methods that are no longer on the stack
+                while (stack->ptr > cursor)
+                    prof_frame_pop(stack, measurement);
+
+                diverged = true;
+            }
+
+            if (stack->ptr == stack->start && thread_data->call_tree &&
+                thread_data->call_tree->method != method && prof_method_klass(thread_data->call_tree->method) == cProfile)
+            {
+                prof_frame_push(stack, thread_data->call_tree, measurement, RTEST(profile->paused));
+            }
+
+            if (stack->ptr == stack->start && thread_data->call_tree && thread_data->call_tree->method == method)
+                frame = prof_frame_push(stack, thread_data->call_tree, measurement, RTEST(profile->paused));
+            else
+                frame = prof_enter_method(profile, thread_data, method, measurement, RTEST(profile->paused));
+        }
+
+        frame->source_file = rb_profile_frame_path(sample_frames[i]);
+        frame->source_line = sample_lines[i];
+    }
+
+    if (!diverged)
+    {
+        while (stack->ptr > cursor)
+            prof_frame_pop(stack, measurement);
+    }
+}
+
+#if !defined(_WIN32)
+static void prof_sample_thread_event(rb_event_flag_t event, const rb_internal_thread_event_data_t* event_data, void* data)
+{
+    if (event == RUBY_INTERNAL_THREAD_EVENT_RESUMED)
+    {
+        sampler.running_thread = pthread_self();
+        sampler.has_running_thread = 1;
+    }
+    else if (pthread_equal(sampler.running_thread, pthread_self()))
+    {
+        sampler.has_running_thread = 0;
+    }
+}
+
+static void prof_sample_signal_handler(int signal, siginfo_t* info, void* context)
+{
+    /* The kernel can deliver the signal to any thread, including ones that are blocked waiting for the GVL.
+       Forward it to the thread that is running Ruby code since that is the one that will run the job. */
+    pthread_t running_thread = sampler.running_thread;
+    if (sampler.has_running_thread && !pthread_equal(running_thread, pthread_self()))
+    {
+        pthread_kill(running_thread, signal);
+        return;
+    }
+
+#if RUBY_API_VERSION_CODE >= 30300
+    rb_postponed_job_trigger(sample_job_handle);
+#else
+    rb_postponed_job_register_one(0, prof_sample, NULL);
+#endif
+}
+#endif
+
+void prof_sampling_check(prof_profile_t* profile)
+{
+#if defined(_WIN32)
+    rb_raise(rb_eNotImpError, "Sampling is not supported on this platform");
+#else
+    if (profile->sample_interval <= 0)
+        rb_raise(rb_eArgError, "The sample interval must be greater than zero");
+
+    if (profile->measurer->mode != MEASURE_WALL_TIME && profile->measurer->mode != MEASURE_TSC_TIME &&
+        profile->measurer->mode != MEASURE_PROCESS_TIME)
+        rb_raise(rb_eArgError, "Sampling is only supported with the wall time, tsc time and process time measure modes");
+
+    if (profile->measurer->track_allocations)
+        rb_raise(rb_eArgError, "Sampling does not support tracking allocations");
+#endif
+}
+
+void prof_sampling_install(prof_profile_t* profile)
+{
+#if !defined(_WIN32)
+    if (sampler.profile)
+        rb_raise(rb_eRuntimeError, "Only one profile can be sampled at a time");
+
+#if RUBY_API_VERSION_CODE >= 30300
+    if (sample_job_handle == POSTPONED_JOB_HANDLE_INVALID)
+    {
+        sample_job_handle = rb_postponed_job_preregister(0, prof_sample, NULL);
+        if (sample_job_handle == POSTPONED_JOB_HANDLE_INVALID)
+            rb_raise(rb_eRuntimeError, "Could not register sampling job");
+    }
+#endif
+
+    sampler.exclude_keys = rb_st_init_numtable();
+    if (profile->exclude_methods_tbl)
+        rb_st_foreach(profile->exclude_methods_tbl, collect_exclude_keys, (st_data_t)sampler.exclude_keys);
+
+    // Remember the frames that were already running so they can be skipped
+    int depth = rb_profile_frames(0, MAX_SAMPLE_DEPTH, sample_frames, sample_lines);
+    sampler.start_frames = ALLOC_N(VALUE, depth > 0 ? depth : 1);
+    for (int i = 0; i < depth; i++)
+        sampler.start_frames[i] = sample_frames[depth - 1 - i];
+    sampler.start_depth = depth;
+    sampler.start_fiber = rb_fiber_current();
+    sampler.running_thread = pthread_self();
+    sampler.has_running_thread = 1;
+    sampler.thread_hook = rb_internal_thread_add_event_hook(prof_sample_thread_event,
+                                                            RUBY_INTERNAL_THREAD_EVENT_RESUMED |
+                                                            RUBY_INTERNAL_THREAD_EVENT_SUSPENDED |
+                                                            RUBY_INTERNAL_THREAD_EVENT_EXITED, NULL);
+    sampler.profile = profile;
+
+    // Use wall clock time or cpu time to deliver samples depending on the measure mode
+    sampler.timer = profile->measurer->mode == MEASURE_PROCESS_TIME ? ITIMER_PROF : ITIMER_REAL;
+    sampler.signal = profile->measurer->mode == MEASURE_PROCESS_TIME ? SIGPROF : SIGALRM;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = prof_sample_signal_handler;
+    action.sa_flags = SA_RESTART | SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(sampler.signal, &action, &sampler.old_action);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = (time_t)profile->sample_interval;
+    timer.it_interval.tv_usec = (suseconds_t)((profile->sample_interval - (double)timer.it_interval.tv_sec) * 1000000);
+    if (timer.it_interval.tv_sec == 0 && timer.it_interval.tv_usec == 0)
+        timer.it_interval.tv_usec = 1;
+    timer.it_value = timer.it_interval;
+    setitimer(sampler.timer, &timer, NULL);
+#endif
+}
+
+void prof_sampling_remove(prof_profile_t* profile)
+{
+#if !defined(_WIN32)
+    if (sampler.profile != profile)
+        return;
+
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(sampler.timer, &timer, NULL);
+    sigaction(sampler.signal, &sampler.old_action, NULL);
+    rb_internal_thread_remove_event_hook(sampler.thread_hook);
+    sampler.thread_hook = NULL;
+
+    rb_st_free_table(sampler.exclude_keys);
+    sampler.exclude_keys = NULL;
+    xfree(sampler.start_frames);
+    sampler.start_frames = NULL;
+    sampler.start_depth = 0;
+    sampler.start_fiber = Qnil;
+    sampler.profile = NULL;
+#endif
+}
+
+static int mark_frames(st_data_t key, st_data_t value, st_data_t data)
+{
+    rb_gc_mark((VALUE)key);
+    return ST_CONTINUE;
+}
+
+void prof_sampling_mark_frames(st_table* frames_table)
+{
+    rb_st_foreach(frames_table, mark_frames, 0);
+}
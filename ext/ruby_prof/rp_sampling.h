@@ -0,0 +1,14 @@
+/* Copyright (C) 2005-2019 Shugo Maeda <shugo@ruby-lang.org> and Charlie Savage <cfis@savagexi.com>
+   Please see the LICENSE file for copyright and distribution information */
+
+#pragma once
+
+#include "ruby_prof.h"
+#include "rp_profile.h"
+
+#define DEFAULT_SAMPLE_INTERVAL 0.001
+
+void prof_sampling_check(prof_profile_t* profile);
+void prof_sampling_install(prof_profile_t* profile);
+void prof_sampling_remove(prof_profile_t* profile);
+void prof_sampling_mark_frames(st_table* frames_table);
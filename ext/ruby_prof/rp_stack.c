@@ -12,6 +12,11 @@ prof_stack_t* prof_stack_create(void)
     stack->start = ZALLOC_N(prof_frame_t, INITIAL_STACK_SIZE);
     stack->ptr = stack->start;
     stack->end = stack->start + INITIAL_STACK_SIZE;
+    stack->overhead = 0;
+    stack->extra_count = 0;
+    stack->found_method = NULL;
+    stack->found_top = NULL;
+    stack->found_depth = 0;
 
     return stack;
 }
@@ -72,18 +77,24 @@ prof_frame_t* prof_stack_pop(prof_stack_t* stack)
 }
 
 // ----------------  Frame Methods  ----------------------------
-void prof_frame_pause(prof_frame_t* frame, double current_measurement)
+void prof_frame_pause(prof_stack_t* stack, prof_frame_t* frame, int64_t current_measurement)
 {
     if (frame && prof_frame_is_unpaused(frame))
+    {
         frame->pause_time = current_measurement;
+        for (int i = 0; i < stack->extra_count; i++)
+            frame->extra_pause_time[i] = stack->extra_measurements[i];
+    }
 }
 
-void prof_frame_unpause(prof_frame_t* frame, double current_measurement)
+void prof_frame_unpause(prof_stack_t* stack, prof_frame_t* frame, int64_t current_measurement)
 {
     if (prof_frame_is_paused(frame))
     {
         frame->dead_time += (current_measurement - frame->pause_time);
         frame->pause_time = -1;
+        for (int i = 0; i < stack->extra_count; i++)
+            frame->extra_dead_time[i] += stack->extra_measurements[i] - frame->extra_pause_time[i];
     }
 }
 
@@ -92,7 +103,7 @@ prof_frame_t* prof_frame_current(prof_stack_t* stack)
     return prof_stack_last(stack);
 }
 
-prof_frame_t* prof_frame_push(prof_stack_t* stack, prof_call_tree_t* call_tree, double measurement, bool paused)
+prof_frame_t* prof_frame_push(prof_stack_t* stack, prof_call_tree_t* call_tree, int64_t measurement, bool paused)
 {
     prof_frame_t* result = prof_stack_push(stack);
     prof_frame_t* parent_frame = prof_stack_parent(stack);
@@ -101,55 +112,87 @@ prof_frame_t* prof_frame_push(prof_stack_t* stack, prof_call_tree_t* call_tree,
 
     result->start_time = measurement;
     result->pause_time = -1; // init as not paused.
-    result->switch_time = 0;
+    result->switch_time = -1;
     result->wait_time = 0;
+    result->gvl_wait_time = 0;
+    result->switch_gvl_time = 0;
     result->child_time = 0;
     result->dead_time = 0;
+    result->overhead = 0;
     result->source_file = Qnil;
     result->source_line = 0;
+    result->traced = false;
+    result->excluded_depth = 0;
 
-    call_tree->measurement->called++;
+    for (int i = 0; i < stack->extra_count; i++)
+    {
+        result->extra_start_time[i] = stack->extra_measurements[i];
+        result->extra_child_time[i] = 0;
+        result->extra_dead_time[i] = 0;
+    }
+
+    call_tree->measurement.called++;
     call_tree->visits++;
 
+    // A folded frame reuses a call tree that is already on the stack, so the top call tree no longer
+    // determines the frames below it
+    if (call_tree->visits > 1)
+        stack->found_method = NULL;
+
     if (call_tree->method->visits > 0)
     {
         call_tree->method->recursive = true;
     }
-    call_tree->method->measurement->called++;
+    call_tree->method->measurement.called++;
     call_tree->method->visits++;
 
+    for (int i = 0; i < stack->extra_count; i++)
+    {
+        call_tree->extra_measurements[i]->called++;
+        call_tree->method->extra_measurements[i]->called++;
+    }
+
     // Unpause the parent frame, if it exists.
     // If currently paused then:
     //   1) The child frame will begin paused.
     //   2) The parent will inherit the child's dead time.
     if (parent_frame)
-        prof_frame_unpause(parent_frame, measurement);
+        prof_frame_unpause(stack, parent_frame, measurement);
 
     if (paused)
     {
-        prof_frame_pause(result, measurement);
+        prof_frame_pause(stack, result, measurement);
     }
 
     // Return the result
     return result;
 }
 
-prof_frame_t* prof_frame_unshift(prof_stack_t* stack, prof_call_tree_t* parent_call_tree, prof_call_tree_t* call_tree, double measurement)
+prof_frame_t* prof_frame_unshift(prof_stack_t* stack, prof_call_tree_t* parent_call_tree, prof_call_tree_t* call_tree, int64_t measurement)
 {
     if (prof_stack_last(stack))
         rb_raise(rb_eRuntimeError, "Stack unshift can only be called with an empty stack");
 
-    parent_call_tree->measurement->total_time = call_tree->measurement->total_time;
-    parent_call_tree->measurement->self_time = 0;
-    parent_call_tree->measurement->wait_time = call_tree->measurement->wait_time;
+    parent_call_tree->measurement.total_time = call_tree->measurement.total_time;
+    parent_call_tree->measurement.self_time = 0;
+    parent_call_tree->measurement.wait_time = call_tree->measurement.wait_time;
+    parent_call_tree->measurement.gvl_wait_time = call_tree->measurement.gvl_wait_time;
+
+    parent_call_tree->method->measurement.total_time += call_tree->measurement.total_time;
+    parent_call_tree->method->measurement.wait_time += call_tree->measurement.wait_time;
+    parent_call_tree->method->measurement.gvl_wait_time += call_tree->measurement.gvl_wait_time;
 
-    parent_call_tree->method->measurement->total_time += call_tree->measurement->total_time;
-    parent_call_tree->method->measurement->wait_time += call_tree->measurement->wait_time;
+    for (int i = 0; i < stack->extra_count; i++)
+    {
+        parent_call_tree->extra_measurements[i]->total_time = call_tree->extra_measurements[i]->total_time;
+        parent_call_tree->extra_measurements[i]->self_time = 0;
+        parent_call_tree->method->extra_measurements[i]->total_time += call_tree->extra_measurements[i]->total_time;
+    }
 
     return prof_frame_push(stack, parent_call_tree, measurement, false);
 }
 
-prof_frame_t* prof_frame_pop(prof_stack_t* stack, double measurement)
+prof_frame_t* prof_frame_pop(prof_stack_t* stack, int64_t measurement)
 {
     prof_frame_t* frame = prof_stack_pop(stack);
 
@@ -157,35 +200,74 @@ prof_frame_t* prof_frame_pop(prof_stack_t* stack, double measurement)
         return NULL;
 
     /* Calculate the total time this method took */
-    prof_frame_unpause(frame, measurement);
+    prof_frame_unpause(stack, frame, measurement);
+
+    int64_t total_time = measurement - frame->start_time - frame->dead_time;
+    int64_t self_time = total_time - frame->child_time - frame->wait_time;
 
-    double total_time = measurement - frame->start_time - frame->dead_time;
-    double self_time = total_time - frame->child_time - frame->wait_time;
+    /* When compensating for the profiler's overhead, a frame is charged for about one event hook of its own
+       call and return plus two for each call made by its children. */
+    if (stack->overhead > 0)
+    {
+        total_time -= frame->overhead + stack->overhead;
+        if (total_time < 0)
+            total_time = 0;
+
+        self_time = total_time - frame->child_time - frame->wait_time;
+        if (self_time < 0)
+            self_time = 0;
+    }
 
     /* Update information about the current method */
     prof_call_tree_t* call_tree = frame->call_tree;
 
     // Update method measurement
-    call_tree->method->measurement->self_time += self_time;
-    call_tree->method->measurement->wait_time += frame->wait_time;
+    call_tree->method->measurement.self_time += self_time;
+    call_tree->method->measurement.wait_time += frame->wait_time;
+    call_tree->method->measurement.gvl_wait_time += frame->gvl_wait_time;
     if (call_tree->method->visits == 1)
-        call_tree->method->measurement->total_time += total_time;
+        call_tree->method->measurement.total_time += total_time;
 
-    call_tree->method->visits--;
-
-    // Update method measurement
-    call_tree->measurement->self_time += self_time;
-    call_tree->measurement->wait_time += frame->wait_time;
+    // Update call tree measurement
+    call_tree->measurement.self_time += self_time;
+    call_tree->measurement.wait_time += frame->wait_time;
+    call_tree->measurement.gvl_wait_time += frame->gvl_wait_time;
     if (call_tree->visits == 1)
-        call_tree->measurement->total_time += total_time;
+        call_tree->measurement.total_time += total_time;
 
+    prof_frame_t* parent_frame = prof_stack_last(stack);
+
+    for (int i = 0; i < stack->extra_count; i++)
+    {
+        int64_t extra_total_time = stack->extra_measurements[i] - frame->extra_start_time[i] - frame->extra_dead_time[i];
+        int64_t extra_self_time = extra_total_time - frame->extra_child_time[i];
+
+        call_tree->method->extra_measurements[i]->self_time += extra_self_time;
+        if (call_tree->method->visits == 1)
+            call_tree->method->extra_measurements[i]->total_time += extra_total_time;
+
+        call_tree->extra_measurements[i]->self_time += extra_self_time;
+        if (call_tree->visits == 1)
+            call_tree->extra_measurements[i]->total_time += extra_total_time;
+
+        if (parent_frame)
+        {
+            parent_frame->extra_child_time[i] += extra_total_time;
+            parent_frame->extra_dead_time[i] += frame->extra_dead_time[i];
+        }
+    }
+
+    if (call_tree->visits > 1)
+        stack->found_method = NULL;
+
+    call_tree->method->visits--;
     call_tree->visits--;
 
-    prof_frame_t* parent_frame = prof_stack_last(stack);
     if (parent_frame)
     {
         parent_frame->child_time += total_time;
         parent_frame->dead_time += frame->dead_time;
+        parent_frame->overhead += frame->overhead + 2 * stack->overhead;
     }
 
     frame->source_file = Qnil;
@@ -193,20 +275,76 @@ prof_frame_t* prof_frame_pop(prof_stack_t* stack, double measurement)
     return frame;
 }
 
+/* Source paths are interned when methods are created, and Ruby usually interns the paths it reports, so most
+   files match by pointer. Two different interned strings can not be equal, so only paths that Ruby did not
+   intern, such as those of eval'd code, are compared by value. This runs for every frame searched during an
+   allocation, so it must not allocate and should rarely have to look at the characters. */
+static inline bool source_file_equal(VALUE source_file, VALUE other)
+{
+    if (source_file == other)
+        return true;
+
+    if (!RB_TYPE_P(source_file, T_STRING) || !RB_TYPE_P(other, T_STRING))
+        return false;
+
+    if (FL_TEST_RAW(source_file, RSTRING_FSTR) && FL_TEST_RAW(other, RSTRING_FSTR))
+        return false;
+
+    long length = RSTRING_LEN(source_file);
+    return length == RSTRING_LEN(other) && memcmp(RSTRING_PTR(source_file), RSTRING_PTR(other), length) == 0;
+}
+
+/* Returns the method on the stack whose source contains the given location */
 prof_method_t* prof_find_method(prof_stack_t* stack, VALUE source_file, int source_line)
 {
     prof_frame_t* frame = prof_stack_last(stack);
+    if (!frame)
+        return NULL;
+
+    /* Consecutive allocations usually come from the same method. The last method found is still the answer
+       if the top of the stack has not changed, since its call tree determines every frame below it, and the
+       frames above the method were from other files. Pushing or popping a folded frame clears the cache. */
+    prof_method_t* found = stack->found_method;
+    if (found && stack->found_top == frame->call_tree && stack->found_depth == stack->ptr - stack->start &&
+        source_file_equal(found->descriptor->source_file, source_file) && source_line >= found->descriptor->source_line)
+    {
+        return found;
+    }
+
+    bool other_files = true;
     while (frame >= stack->start)
     {
         if (!frame->call_tree)
             return NULL;
 
-        if (rb_str_equal(source_file, frame->call_tree->method->source_file) &&
-            source_line >= frame->call_tree->method->source_line)
+        prof_method_t* method = frame->call_tree->method;
+        if (source_file_equal(method->descriptor->source_file, source_file))
         {
-            return frame->call_tree->method;
+            if (source_line >= method->descriptor->source_line)
+            {
+                if (other_files)
+                {
+                    stack->found_method = method;
+                    stack->found_top = prof_stack_last(stack)->call_tree;
+                    stack->found_depth = stack->ptr - stack->start;
+                }
+                return method;
+            }
+            other_files = false;
         }
         frame--;
     }
     return NULL;
 }
+
+/* Returns the call tree of the innermost frame running the given method, or NULL if it is not on the stack */
+prof_call_tree_t* prof_stack_find_call_tree(prof_stack_t* stack, prof_method_t* method)
+{
+    for (prof_frame_t* frame = stack->ptr - 1; frame >= stack->start; frame--)
+    {
+        if (frame->call_tree && frame->call_tree->method == method)
+            return frame->call_tree;
+    }
+
+    return NULL;
+}
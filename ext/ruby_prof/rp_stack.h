@@ -18,33 +18,55 @@ typedef struct prof_frame_t
     VALUE source_file;
     unsigned int source_line;
 
-    double start_time;
-    double switch_time;  /* Time at switch to different thread */
-    double wait_time;
-    double child_time;
-    double pause_time; // Time pause() was initiated
-    double dead_time; // Time to ignore (i.e. total amount of time between pause/resume blocks)
+    int64_t overhead;            /* Estimated profiler overhead of the calls made by this frame's children */
+
+    bool traced;                 /* Pushed by a call event versus inserted for a method that was already running */
+    unsigned int excluded_depth; /* Excluded methods called by this frame that have not yet returned */
+
+    int64_t start_time;
+    int64_t switch_time;  /* Time at switch to different thread, -1 if it is not waiting */
+    int64_t switch_gvl_time;  /* The thread's GVL wait time at the switch */
+    int64_t wait_time;
+    int64_t gvl_wait_time;    /* Part of wait_time spent waiting to acquire the GVL */
+    int64_t child_time;
+    int64_t pause_time; // Time pause() was initiated
+    int64_t dead_time; // Time to ignore (i.e. total amount of time between pause/resume blocks)
+
+    /* The same values for the profile's extra measure modes. Wait time is only tracked for the first mode. */
+    int64_t extra_start_time[MAX_EXTRA_MEASUREMENTS];
+    int64_t extra_child_time[MAX_EXTRA_MEASUREMENTS];
+    int64_t extra_pause_time[MAX_EXTRA_MEASUREMENTS];
+    int64_t extra_dead_time[MAX_EXTRA_MEASUREMENTS];
 } prof_frame_t;
 
 static inline bool prof_frame_is_paused(prof_frame_t* f) { return f->pause_time >= 0; }
 static inline bool prof_frame_is_unpaused(prof_frame_t* f) { return f->pause_time < 0; }
 
-void prof_frame_pause(prof_frame_t*, double current_measurement);
-void prof_frame_unpause(prof_frame_t*, double current_measurement);
-
 /* Current stack of active methods.*/
 typedef struct prof_stack_t
 {
     prof_frame_t* start;
     prof_frame_t* end;
     prof_frame_t* ptr;
+    int64_t overhead;            /* Estimated profiler overhead of a single event, zero unless compensating */
+    int extra_count;             /* Number of extra measure modes recorded by the profile */
+    int64_t extra_measurements[MAX_EXTRA_MEASUREMENTS]; /* Extra measurements at the last event of this thread */
+
+    /* The last method found by prof_find_method and the top of the stack when it was found */
+    prof_method_t* found_method;
+    prof_call_tree_t* found_top;
+    ptrdiff_t found_depth;
 } prof_stack_t;
 
+void prof_frame_pause(prof_stack_t* stack, prof_frame_t* frame, int64_t current_measurement);
+void prof_frame_unpause(prof_stack_t* stack, prof_frame_t* frame, int64_t current_measurement);
+
 prof_stack_t* prof_stack_create(void);
 void prof_stack_free(prof_stack_t* stack);
 
 prof_frame_t* prof_frame_current(prof_stack_t* stack);
-prof_frame_t* prof_frame_push(prof_stack_t* stack, prof_call_tree_t* call_tree, double measurement, bool paused);
-prof_frame_t* prof_frame_unshift(prof_stack_t* stack, prof_call_tree_t* parent_call_tree, prof_call_tree_t* call_tree, double measurement);
-prof_frame_t* prof_frame_pop(prof_stack_t* stack, double measurement);
+prof_frame_t* prof_frame_push(prof_stack_t* stack, prof_call_tree_t* call_tree, int64_t measurement, bool paused);
+prof_frame_t* prof_frame_unshift(prof_stack_t* stack, prof_call_tree_t* parent_call_tree, prof_call_tree_t* call_tree, int64_t measurement);
+prof_frame_t* prof_frame_pop(prof_stack_t* stack, int64_t measurement);
 prof_method_t* prof_find_method(prof_stack_t* stack, VALUE source_file, int source_line);
+prof_call_tree_t* prof_stack_find_call_tree(prof_stack_t* stack, prof_method_t* method);
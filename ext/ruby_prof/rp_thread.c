@@ -17,7 +17,9 @@ You cannot create an instance of RubyProf::Thread, instead you access it from a
   end */
 
 #include "rp_thread.h"
+#include "rp_event_log.h"
 #include "rp_profile.h"
+#include "rp_sampling.h"
 
 VALUE cRpThread;
 
@@ -28,13 +30,20 @@ thread_data_t* thread_data_create(void)
     result->owner = OWNER_C;
     result->stack = prof_stack_create();
     result->method_table = method_table_create();
+    result->frames_table = NULL;
+    result->method_cache = NULL;
+    result->event_log = NULL;
     result->call_tree = NULL;
+    result->arena = prof_arena_create();
     result->object = Qnil;
     result->methods = Qnil;
     result->fiber_id = Qnil;
     result->thread_id = Qnil;
     result->trace = true;
     result->fiber = Qnil;
+    result->measurement = 0;
+    result->gvl_wait.ready_time = -1;
+    result->gvl_wait.total_time = 0;
     return result;
 }
 
@@ -75,6 +84,26 @@ void prof_thread_mark(void* data)
         prof_call_tree_mark(thread->call_tree);
 
     rb_st_foreach(thread->method_table, mark_methods, 0);
+
+    if (thread->frames_table)
+        prof_sampling_mark_frames(thread->frames_table);
+
+    if (thread->event_log)
+        prof_event_log_mark(thread->event_log);
+
+    // Cached classes and method ids are compared by address so they must not move
+    if (thread->method_cache)
+    {
+        for (int i = 0; i < METHOD_CACHE_SIZE; i++)
+        {
+            method_cache_entry_t* entry = &thread->method_cache[i];
+            if (entry->klass)
+            {
+                rb_gc_mark(entry->klass);
+                rb_gc_mark(entry->msym);
+            }
+        }
+    }
 }
 
 void prof_thread_compact(void* data)
@@ -98,14 +127,43 @@ static void prof_thread_free(thread_data_t* thread_data)
 
     method_table_free(thread_data->method_table);
 
+    if (thread_data->frames_table)
+        rb_st_free_table(thread_data->frames_table);
+
+    thread_method_cache_clear(thread_data);
+
+    if (thread_data->event_log)
+        prof_event_log_free(thread_data->event_log);
+
     if (thread_data->call_tree)
         prof_call_tree_free(thread_data->call_tree);
 
+    // Free after the call trees, which still need to unlink their Ruby objects
+    prof_arena_free(thread_data->arena);
+
     prof_stack_free(thread_data->stack);
 
     xfree(thread_data);
 }
 
+/* Returns the cache entry for the given class and method id. The caller must check the entry's
+   klass and msym to see if it is a hit. */
+method_cache_entry_t* thread_method_cache_entry(thread_data_t* thread_data, VALUE klass, VALUE msym)
+{
+    if (!thread_data->method_cache)
+        thread_data->method_cache = ZALLOC_N(method_cache_entry_t, METHOD_CACHE_SIZE);
+
+    // Heap objects are at least 8 byte aligned and static symbols store their id above the low 8 bits
+    size_t index = ((klass >> 3) * 31 + (msym >> 8)) & (METHOD_CACHE_SIZE - 1);
+    return &thread_data->method_cache[index];
+}
+
+void thread_method_cache_clear(thread_data_t* thread_data)
+{
+    xfree(thread_data->method_cache);
+    thread_data->method_cache = NULL;
+}
+
 void prof_thread_ruby_gc_free(void* data)
 {
     thread_data_t* thread_data = (thread_data_t*)data;
@@ -170,7 +228,8 @@ thread_data_t* prof_get_thread(VALUE self)
 }
 
 // ======   Thread Table  ======
-// The thread table is hash keyed on ruby fiber_id that stores instances of thread_data_t.
+// The thread table is hash keyed on ruby fiber_id that stores instances of thread_data_t. While profiling,
+// threads are found using the profile's fibers table instead since computing a fiber's id can allocate.
 
 st_table* threads_table_create(void)
 {
@@ -195,8 +254,8 @@ thread_data_t* threads_table_lookup(void* prof, VALUE fiber)
     thread_data_t* result = NULL;
     st_data_t val;
 
-    VALUE fiber_id = rb_obj_id(fiber);
-    if (rb_st_lookup(profile->threads_tbl, fiber_id, &val))
+    // Fibers are pinned by their thread data so their address is a stable key
+    if (rb_st_lookup(profile->fibers_tbl, fiber, &val))
     {
         result = (thread_data_t*)val;
     }
@@ -214,6 +273,13 @@ thread_data_t* threads_table_insert(void* prof, VALUE fiber)
     result->fiber_id = rb_obj_id(fiber);
     result->thread_id = rb_obj_id(thread);
     rb_st_insert(profile->threads_tbl, (st_data_t)result->fiber_id, (st_data_t)result);
+    rb_st_insert(profile->fibers_tbl, (st_data_t)fiber, (st_data_t)result);
+
+    if (profile->deferred)
+        result->event_log = prof_event_log_create();
+
+    result->stack->overhead = profile->overhead;
+    result->stack->extra_count = profile->extra_measurer_count;
 
     // Are we tracing this thread?
     if (profile->include_threads_tbl && !rb_st_lookup(profile->include_threads_tbl, thread, 0))
@@ -233,37 +299,106 @@ thread_data_t* threads_table_insert(void* prof, VALUE fiber)
 }
 
 // ======   Profiling Methods  ======
-void switch_thread(void* prof, thread_data_t* thread_data, double measurement)
+void switch_thread(void* prof, thread_data_t* thread_data, int64_t measurement)
 {
     prof_profile_t* profile = prof;
+    thread_data_t* last_thread_data = profile->last_thread_data;
 
     /* Get current frame for this thread */
     prof_frame_t* frame = prof_frame_current(thread_data->stack);
-    if (frame)
+    if (thread_data->event_log)
+    {
+        prof_event_log_append(thread_data->event_log, EVENT_LOG_RESUME, NULL, measurement);
+    }
+    else if (frame && frame->switch_time >= 0)
     {
-        frame->wait_time += measurement - frame->switch_time;
-        frame->switch_time = 0;
+        int64_t wait_time = measurement - frame->switch_time;
+        frame->wait_time += wait_time;
+        frame->switch_time = -1;
+
+        // Part of the wait was spent waiting for the GVL after the thread was ready to run
+        if (profile->gvl_hook)
+        {
+            int64_t gvl_wait_time = thread_data->gvl_wait.total_time - frame->switch_gvl_time;
+            frame->gvl_wait_time += gvl_wait_time < 0 ? 0 : (gvl_wait_time > wait_time ? wait_time : gvl_wait_time);
+        }
     }
 
-    /* Save on the last thread the time of the context switch
-       and reset this thread's last context switch to 0.*/
-    if (profile->last_thread_data)
+    prof_gvl_attach(profile, &thread_data->gvl_wait);
+
+    /* Per thread measurers stop counting while a thread is not running, so a thread does not wait on other
+       threads and the measurement, taken on this thread, can not be compared with the last thread's. Fibers
+       of the same thread share its count, so they still wait on each other. */
+    if (!last_thread_data ||
+        (profile->measurer->thread_local && last_thread_data->thread_id != thread_data->thread_id))
     {
-        prof_frame_t* last_frame = prof_frame_current(profile->last_thread_data->stack);
+        profile->last_thread_data = thread_data;
+        return;
+    }
+
+    last_thread_data->measurement = measurement;
+
+    /* Save on the last thread the time of the context switch */
+    if (last_thread_data->event_log)
+    {
+        prof_event_log_append(last_thread_data->event_log, EVENT_LOG_SUSPEND, NULL, measurement);
+    }
+    else
+    {
+        prof_frame_t* last_frame = prof_frame_current(last_thread_data->stack);
         if (last_frame)
+        {
             last_frame->switch_time = measurement;
+            last_frame->switch_gvl_time = last_thread_data->gvl_wait.total_time;
+        }
     }
 
     profile->last_thread_data = thread_data;
 }
 
+/* Returns the measurement to use for a thread that may not be running. Per thread measurers can only read the
+   running thread's count, so other threads use the measurement taken at their last event. */
+int64_t thread_measurement(void* prof, thread_data_t* thread_data, int64_t measurement)
+{
+    prof_profile_t* profile = prof;
+
+    if (profile->measurer->thread_local && thread_data->thread_id != rb_obj_id(rb_thread_current()))
+        return thread_data->measurement;
+    else
+        return measurement;
+}
+
+/* Updates a thread's extra measurements outside of an event, keeping those of per thread measurers when the
+   thread is not running. */
+void thread_extra_measurements(void* prof, thread_data_t* thread_data)
+{
+    prof_profile_t* profile = prof;
+    if (profile->extra_measurer_count == 0)
+        return;
+
+    bool running = thread_data->thread_id == rb_obj_id(rb_thread_current());
+    for (int i = 0; i < profile->extra_measurer_count; i++)
+    {
+        if (running || !profile->extra_measurers[i]->thread_local)
+            thread_data->stack->extra_measurements[i] = prof_measure(profile->extra_measurers[i], NULL);
+    }
+}
+
 int pause_thread(st_data_t key, st_data_t value, st_data_t data)
 {
     thread_data_t* thread_data = (thread_data_t*)value;
     prof_profile_t* profile = (prof_profile_t*)data;
+    int64_t measurement = thread_measurement(profile, thread_data, profile->measurement_at_pause_resume);
+    thread_extra_measurements(profile, thread_data);
+
+    if (thread_data->event_log)
+    {
+        prof_event_log_append(thread_data->event_log, EVENT_LOG_PAUSE, NULL, measurement);
+        return ST_CONTINUE;
+    }
 
     prof_frame_t* frame = prof_frame_current(thread_data->stack);
-    prof_frame_pause(frame, profile->measurement_at_pause_resume);
+    prof_frame_pause(thread_data->stack, frame, measurement);
 
     return ST_CONTINUE;
 }
@@ -272,9 +407,17 @@ int unpause_thread(st_data_t key, st_data_t value, st_data_t data)
 {
     thread_data_t* thread_data = (thread_data_t*)value;
     prof_profile_t* profile = (prof_profile_t*)data;
+    int64_t measurement = thread_measurement(profile, thread_data, profile->measurement_at_pause_resume);
+    thread_extra_measurements(profile, thread_data);
+
+    if (thread_data->event_log)
+    {
+        prof_event_log_append(thread_data->event_log, EVENT_LOG_UNPAUSE, NULL, measurement);
+        return ST_CONTINUE;
+    }
 
     prof_frame_t* frame = prof_frame_current(thread_data->stack);
-    prof_frame_unpause(frame, profile->measurement_at_pause_resume);
+    prof_frame_unpause(thread_data->stack, frame, measurement);
 
     return ST_CONTINUE;
 }
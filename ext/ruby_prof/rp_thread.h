@@ -4,8 +4,21 @@
 #pragma once
 
 #include "ruby_prof.h"
+#include "rp_arena.h"
+#include "rp_gvl.h"
 #include "rp_stack.h"
 
+#define METHOD_CACHE_SIZE 256
+
+/* Direct mapped cache of recently called methods. Entries are keyed on the unresolved defined class
+   and method id reported by the tracepoint. Excluded methods are cached with a NULL method. */
+typedef struct method_cache_entry_t
+{
+    VALUE klass;
+    VALUE msym;
+    struct prof_method_t* method;
+} method_cache_entry_t;
+
 /* Profiling information for a thread. */
 typedef struct thread_data_t
 {
@@ -15,10 +28,16 @@ typedef struct thread_data_t
     prof_stack_t* stack;              /* Stack of frames */
     bool trace;                       /* Are we tracking this thread */
     prof_call_tree_t* call_tree;      /* The root of the call tree*/
+    prof_arena_t* arena;              /* Memory for the call trees created while profiling */
     VALUE thread_id;                  /* Thread id */
     VALUE fiber_id;                   /* Fiber id */
     VALUE methods;                    /* Array of RubyProf::MethodInfo */
     st_table* method_table;           /* Methods called in the thread */
+    st_table* frames_table;           /* Sampled frames mapped to methods */
+    method_cache_entry_t* method_cache; /* Recently called methods, allocated on first use */
+    struct prof_event_log_t* event_log; /* Events recorded for deferred profiles until they are replayed */
+    int64_t measurement;              /* Last measurement taken while this thread was running */
+    prof_gvl_wait_t gvl_wait;         /* Time spent waiting for the GVL, see rp_gvl.c */
 } thread_data_t;
 
 void rp_init_thread(void);
@@ -31,6 +50,11 @@ thread_data_t* prof_get_thread(VALUE self);
 VALUE prof_thread_wrap(thread_data_t* thread);
 void prof_thread_mark(void* data);
 
-void switch_thread(void* profile, thread_data_t* thread_data, double measurement);
+method_cache_entry_t* thread_method_cache_entry(thread_data_t* thread_data, VALUE klass, VALUE msym);
+void thread_method_cache_clear(thread_data_t* thread_data);
+
+void switch_thread(void* profile, thread_data_t* thread_data, int64_t measurement);
+int64_t thread_measurement(void* profile, thread_data_t* thread_data, int64_t measurement);
+void thread_extra_measurements(void* profile, thread_data_t* thread_data);
 int pause_thread(st_data_t key, st_data_t value, st_data_t data);
 int unpause_thread(st_data_t key, st_data_t value, st_data_t data);
@@ -17,6 +17,11 @@
 #define rb_st_lookup st_lookup
 #endif
 
+#if defined(_MSC_VER)
+#define RP_THREAD_LOCAL __declspec(thread)
+#else
+#define RP_THREAD_LOCAL _Thread_local
+#endif
 
 extern VALUE mProf;
 
@@ -20,6 +20,7 @@ require 'ruby-prof/thread'
 module RubyProf
   autoload :CallTreeVisitor, 'ruby-prof/call_tree_visitor'
   autoload :AbstractPrinter, 'ruby-prof/printers/abstract_printer'
+  autoload :AllocationPrinter, 'ruby-prof/printers/allocation_printer'
   autoload :CallInfoPrinter, 'ruby-prof/printers/call_info_printer'
   autoload :CallStackPrinter, 'ruby-prof/printers/call_stack_printer'
   autoload :CallTreePrinter, 'ruby-prof/printers/call_tree_printer'
@@ -37,10 +38,30 @@ module RubyProf
     case ENV["RUBY_PROF_MEASURE_MODE"]
     when "wall", "wall_time"
       RubyProf.measure_mode = RubyProf::WALL_TIME
+    when "tsc", "tsc_time"
+      RubyProf.measure_mode = RubyProf::TSC_TIME
     when "allocations"
       RubyProf.measure_mode = RubyProf::ALLOCATIONS
+    when "allocated_bytes"
+      RubyProf.measure_mode = RubyProf::ALLOCATED_BYTES
     when "process", "process_time"
       RubyProf.measure_mode = RubyProf::PROCESS_TIME
+    when "thread", "thread_cpu_time"
+      RubyProf.measure_mode = RubyProf::THREAD_CPU_TIME
+    when "instructions"
+      RubyProf.measure_mode = RubyProf::INSTRUCTIONS
+    when "cycles", "cpu_cycles"
+      RubyProf.measure_mode = RubyProf::CPU_CYCLES
+    when "cache_misses"
+      RubyProf.measure_mode = RubyProf::CACHE_MISSES
+    when "branch_misses"
+      RubyProf.measure_mode = RubyProf::BRANCH_MISSES
+    when "task_clock"
+      RubyProf.measure_mode = RubyProf::TASK_CLOCK
+    when "page_faults"
+      RubyProf.measure_mode = RubyProf::PAGE_FAULTS
+    when "context_switches"
+      RubyProf.measure_mode = RubyProf::CONTEXT_SWITCHES
     else
       # the default is defined in the measure_mode reader
     end
@@ -26,6 +26,16 @@ module RubyProf
       self.measurement.wait_time
     end
 
+    # The part of wait_time spent waiting to acquire the GVL
+    def gvl_wait_time
+      self.measurement.gvl_wait_time
+    end
+
+    # The part of wait_time spent blocked, for example sleeping or waiting on IO
+    def blocked_time
+      self.measurement.blocked_time
+    end
+
     # The time spent in child methods resulting from the parent method calling the target method
     def children_time
       self.total_time - self.self_time - self.wait_time
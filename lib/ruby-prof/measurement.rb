@@ -6,6 +6,11 @@ module RubyProf
       self.total_time - self.self_time - self.wait_time
     end
 
+    # The part of wait_time that was not spent waiting for the GVL
+    def blocked_time
+      self.wait_time - self.gvl_wait_time
+    end
+
     def to_s
       "c: #{called}, tt: #{total_time}, st: #{self_time}"
     end
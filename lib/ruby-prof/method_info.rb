@@ -12,7 +12,10 @@ module RubyProf
     # * <Class:MyObject>#test - A method defined in a singleton class.
     # * <Module:MyObject>#test - A method defined in a singleton module.
     # * <Object:MyObject>#test - A method defined in a singleton object.
+    # * [GC] - Time spent in garbage collection, only included when profiling with track_gc: true
     def full_name
+      return method_name.to_s if self.klass_flags == SYNTHETIC
+
       decorated_class_name = case self.klass_flags
                              when 0x2
                                "<Class::#{klass_name}>"
@@ -47,6 +50,16 @@ module RubyProf
       self.measurement.wait_time
     end
 
+    # The part of wait_time this method was ready to run but waiting to acquire the GVL
+    def gvl_wait_time
+      self.measurement.gvl_wait_time
+    end
+
+    # The part of wait_time this method was blocked, for example sleeping or waiting on IO
+    def blocked_time
+      self.measurement.blocked_time
+    end
+
     # The time this method's children took to execute
     def children_time
       self.total_time - self.self_time - self.wait_time
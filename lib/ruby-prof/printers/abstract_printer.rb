@@ -99,14 +99,16 @@ module RubyProf
     end
 
     def print_footer(thread)
-      metric_data = {
-        0 => { label: "time", prefix: "", suffix: "spent" },
-        1 => { label: "time", prefix: "", suffix: "spent" },
-        2 => { label: "allocations", prefix: "number of ", suffix: "made" },
-        3 => { label: "memory", prefix: "", suffix: "used" }
-      }
-
-      metric = metric_data[@result.measure_mode]
+      metric = case @result.measure_mode
+                 when WALL_TIME, PROCESS_TIME, THREAD_CPU_TIME, TSC_TIME, TASK_CLOCK
+                   { label: "time", prefix: "", suffix: "spent" }
+                 when ALLOCATIONS
+                   { label: "allocations", prefix: "number of ", suffix: "made" }
+                 when ALLOCATED_BYTES
+                   { label: "memory", prefix: "", suffix: "allocated" }
+                 else
+                   { label: @result.measure_mode_name.downcase, prefix: "number of ", suffix: "counted" }
+               end
 
       metric_label = metric[:label]
       metric_suffix = metric[:suffix]
@@ -0,0 +1,72 @@
+# encoding: utf-8
+
+module RubyProf
+  # Generates a text report of the allocation sites recorded by tracking allocations,
+  # ranked by memory. Profiles that track retained objects can also be ranked by
+  # the objects that were still alive when the profile was stopped.
+  # To use the allocation printer:
+  #
+  #   result = RubyProf::Profile.profile(track_retained: true) do
+  #     [code to profile]
+  #   end
+  #
+  #   printer = RubyProf::AllocationPrinter.new(result)
+  #   printer.print(STDOUT, sort_method: :retained_memory)
+  #
+  # Available sort methods are :memory, :count, :retained_memory and :retained.
+  class AllocationPrinter < AbstractPrinter
+    # Override to default sort by retained memory if it was tracked
+    def print(output = STDOUT, sort_method: nil, **options)
+      sort_method ||= @result.track_retained? ? :retained_memory : :memory
+      super(output, sort_method: sort_method, **options)
+    end
+
+    private
+
+    def print_header(thread)
+      @output << "Thread ID: %d\n" % thread.id
+      @output << "Fiber ID: %d\n" % thread.fiber_id unless thread.id == thread.fiber_id
+      @output << "Sort by: #{sort_method}\n"
+      @output << "\n"
+      print_column_headers
+    end
+
+    def print_column_headers
+      @output << "     count        memory  retained  ret memory  class                          method                         location\n"
+    end
+
+    def print_methods(thread)
+      allocations = thread.methods.flat_map do |method|
+        method.allocations.map {|allocation| [method, allocation]}
+      end
+
+      allocations.sort_by {|_, allocation| allocation.send(sort_method)}.reverse_each do |method, allocation|
+        @output << "%10d  %12d  %8d  %10d  %-30s %-30s %s:%d\n" % [
+                      allocation.count,           # count
+                      allocation.memory,          # memory
+                      allocation.retained,        # retained
+                      allocation.retained_memory, # ret memory
+                      allocation.klass_name,      # class
+                      method.full_name,           # method
+                      allocation.source_file,     # location
+                      allocation.line]
+      end
+    end
+
+    def print_footer(thread)
+      @output << <<~EOT
+
+        Columns are:
+
+          count       - The number of objects allocated at this location.
+          memory      - The bytes allocated at this location.
+          retained    - The number of those objects still alive when the profile was stopped.
+          ret memory  - The bytes used by the retained objects.
+          class       - The class of the allocated objects.
+          method      - The method that allocated the objects.
+          location    - The source location of the allocation.
+
+      EOT
+    end
+  end
+end
@@ -35,6 +35,19 @@ module RubyProf
         when RubyProf::WALL_TIME
           @value_scale = 1_000_000
           @event_specification << 'wall_time'
+        when RubyProf::TSC_TIME
+          @value_scale = 1_000_000
+          @event_specification << 'tsc_time'
+        when RubyProf::TASK_CLOCK
+          @value_scale = 1_000_000
+          @event_specification << 'task_clock'
+        when RubyProf::THREAD_CPU_TIME
+          @value_scale = 1_000_000
+          @event_specification << 'thread_cpu_time'
+        when RubyProf::INSTRUCTIONS, RubyProf::CPU_CYCLES, RubyProf::CACHE_MISSES, RubyProf::BRANCH_MISSES,
+             RubyProf::PAGE_FAULTS, RubyProf::CONTEXT_SWITCHES, RubyProf::ALLOCATED_BYTES
+          @value_scale = 1
+          @event_specification << @result.measure_mode_string
         when RubyProf.const_defined?(:ALLOCATIONS) && RubyProf::ALLOCATIONS
           @value_scale = 1
           @event_specification << 'allocations'
@@ -8,10 +8,30 @@ module RubyProf
       case self.measure_mode
         when WALL_TIME
           "wall_time"
+        when TSC_TIME
+          "tsc_time"
         when PROCESS_TIME
           "process_time"
+        when THREAD_CPU_TIME
+          "thread_cpu_time"
         when ALLOCATIONS
           "allocations"
+        when ALLOCATED_BYTES
+          "allocated_bytes"
+        when INSTRUCTIONS
+          "instructions"
+        when CPU_CYCLES
+          "cpu_cycles"
+        when CACHE_MISSES
+          "cache_misses"
+        when BRANCH_MISSES
+          "branch_misses"
+        when TASK_CLOCK
+          "task_clock"
+        when PAGE_FAULTS
+          "page_faults"
+        when CONTEXT_SWITCHES
+          "context_switches"
         when MEMORY
           "memory"
       end
@@ -21,10 +41,30 @@ module RubyProf
       case self.measure_mode
         when WALL_TIME
           "Wall Time"
+        when TSC_TIME
+          "TSC Time"
         when PROCESS_TIME
           "Process Time"
+        when THREAD_CPU_TIME
+          "Thread CPU Time"
         when ALLOCATIONS
           "Allocations"
+        when ALLOCATED_BYTES
+          "Allocated Bytes"
+        when INSTRUCTIONS
+          "Instructions"
+        when CPU_CYCLES
+          "CPU Cycles"
+        when CACHE_MISSES
+          "Cache Misses"
+        when BRANCH_MISSES
+          "Branch Misses"
+        when TASK_CLOCK
+          "Task Clock"
+        when PAGE_FAULTS
+          "Page Faults"
+        when CONTEXT_SWITCHES
+          "Context Switches"
         when MEMORY
           "Memory"
       end
@@ -79,5 +119,29 @@ module RubyProf
 
       self
     end
+
+    # Run by the profiler to time its event hooks when compensate_overhead is set. The two
+    # loops fire the same line events and only differ by the call to a Ruby method, which
+    # fires a call and a return event for every events option.
+    class Calibration # :nodoc:
+      def self.calls(count)
+        i = 0
+        while i < count
+          call
+          i += 1
+        end
+      end
+
+      def self.no_calls(count)
+        i = 0
+        while i < count
+          _ = i
+          i += 1
+        end
+      end
+
+      def self.call
+      end
+    end
   end
 end
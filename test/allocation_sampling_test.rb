@@ -0,0 +1,71 @@
+#!/usr/bin/env ruby
+# encoding: UTF-8
+
+require File.expand_path('../test_helper', __FILE__)
+
+class AllocationSamplingTest < TestCase
+  COUNT = 20_000
+
+  def allocate_strings
+    COUNT.times { String.new }
+  end
+
+  def string_allocation(result)
+    method = result.threads.first.methods.detect {|m| m.full_name == 'AllocationSamplingTest#allocate_strings'}
+    method.allocations.detect {|allocation| allocation.klass_name == 'String'}
+  end
+
+  def test_default
+    profile = RubyProf::Profile.new(track_allocations: true)
+    assert_equal(1, profile.allocation_interval)
+
+    result = profile.profile { allocate_strings }
+    allocation = string_allocation(result)
+    assert_equal(COUNT, allocation.count)
+    assert_equal(COUNT, allocation.samples)
+  end
+
+  def test_interval
+    result = RubyProf::Profile.profile(track_allocations: true, allocation_interval: 10) do
+      allocate_strings
+    end
+    assert_equal(10, result.allocation_interval)
+
+    allocation = string_allocation(result)
+    assert_in_delta(COUNT / 10, allocation.samples, COUNT / 40)
+    assert_equal(allocation.samples * 10, allocation.count)
+    assert_equal(allocation.count * 40, allocation.memory)
+    assert_equal(40, allocation.max_memory)
+  end
+
+  def test_measure_allocations
+    result = RubyProf::Profile.profile(measure_mode: RubyProf::ALLOCATIONS, allocation_interval: 100) do
+      allocate_strings
+    end
+
+    # The measure mode still counts every allocation
+    method = result.threads.first.methods.detect {|m| m.full_name == 'AllocationSamplingTest#allocate_strings'}
+    assert_equal(COUNT, method.total_time)
+
+    allocation = string_allocation(result)
+    assert_operator(allocation.samples, :<, COUNT / 50)
+  end
+
+  def test_invalid
+    assert_raises(ArgumentError) do
+      RubyProf::Profile.new(track_allocations: true, allocation_interval: 0)
+    end
+  end
+
+  def test_marshal
+    result = RubyProf::Profile.profile(track_allocations: true, allocation_interval: 10) do
+      allocate_strings
+    end
+
+    allocation = string_allocation(result)
+    loaded = string_allocation(Marshal.load(Marshal.dump(result)))
+    assert_equal(allocation.count, loaded.count)
+    assert_equal(allocation.samples, loaded.samples)
+    assert_equal(allocation.memory, loaded.memory)
+  end
+end
@@ -67,6 +67,23 @@ class CallTreeTest < Minitest::Test
     assert_equal(call_tree_parent, call_tree_child.parent)
   end
 
+  def test_add_children
+    call_tree_parent = RubyProf::CallTree.new(RubyProf::MethodInfo.new(Base64, :encode64))
+
+    # Enough children to move them out of the parent into a separate table
+    names = [:pack, :push, :pop, :shift, :unshift, :map, :each, :select, :reject, :sort, :min, :max]
+    children = names.map do |name|
+      call_tree_parent.add_child(RubyProf::CallTree.new(RubyProf::MethodInfo.new(Array, name)))
+    end
+
+    assert_equal(children, call_tree_parent.children)
+
+    error = assert_raises(IndexError) do
+      call_tree_parent.add_child(RubyProf::CallTree.new(RubyProf::MethodInfo.new(Array, :sort)))
+    end
+    assert_equal("Child call tree already exists", error.message)
+  end
+
   def test_add_child_gc
     GC.stress = true
 
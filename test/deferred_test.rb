@@ -0,0 +1,115 @@
+#!/usr/bin/env ruby
+# encoding: UTF-8
+
+require File.expand_path('../test_helper', __FILE__)
+
+# --  Tests ----
+class DeferredTest < TestCase
+  class Worker
+    def run
+      3.times { work }
+      fiber = Fiber.new do
+        work
+        Fiber.yield
+        work
+      end
+      fiber.resume
+      fiber.resume
+    end
+
+    def work
+      Array.new(10) { |i| i.to_s }
+    end
+  end
+
+  def profile(deferred, &block)
+    RubyProf::Profile.profile(deferred: deferred, &block)
+  end
+
+  def method_summary(result)
+    result.threads.map do |thread|
+      thread.methods.map do |method|
+        [method.full_name, method.called]
+      end.sort
+    end.sort
+  end
+
+  def call_tree_summary(call_tree, depth = 0)
+    result = [[depth, call_tree.target.full_name, call_tree.called]]
+    call_tree.children.sort_by { |child| child.target.full_name }.each do |child|
+      result.concat(call_tree_summary(child, depth + 1))
+    end
+    result
+  end
+
+  def test_deferred?
+    refute(RubyProf::Profile.new.deferred?)
+    assert(RubyProf::Profile.new(deferred: true).deferred?)
+  end
+
+  def test_same_results
+    worker = Worker.new
+    expected = profile(false) { worker.run }
+    actual = profile(true) { worker.run }
+
+    assert_equal(method_summary(expected), method_summary(actual))
+    assert_equal(expected.threads.map { |thread| call_tree_summary(thread.call_tree) }.sort,
+                 actual.threads.map { |thread| call_tree_summary(thread.call_tree) }.sort)
+  end
+
+  def line_summary(call_tree)
+    result = [[call_tree.target.full_name, call_tree.source_file, call_tree.line]]
+    call_tree.children.sort_by { |child| child.target.full_name }.each do |child|
+      result.concat(line_summary(child))
+    end
+    result
+  end
+
+  def test_same_lines
+    worker = Worker.new
+    # Enough events to fill several chunks of the event log. Both profiles start on the same line.
+    expected, actual = [false, true].map do |deferred|
+      profile(deferred) { 200.times { worker.run } }
+    end
+
+    assert_equal(method_summary(expected), method_summary(actual))
+    assert_equal(expected.threads.map { |thread| line_summary(thread.call_tree) }.sort,
+                 actual.threads.map { |thread| line_summary(thread.call_tree) }.sort)
+  end
+
+  def test_pause_resume
+    worker = Worker.new
+    result = RubyProf::Profile.new(deferred: true)
+    result.start
+    result.pause
+    sleep(0.1)
+    result.resume
+    worker.work
+    result.stop
+
+    assert_operator(result.threads.first.total_time, :<, 0.05)
+  end
+
+  def test_wall_time
+    result = RubyProf::Profile.profile(deferred: true) do
+      sleep(0.1)
+    end
+
+    method = result.threads.first.methods.find { |m| m.full_name == "Kernel#sleep" }
+    assert_in_delta(0.1, method.total_time, 0.05)
+  end
+
+  def test_invalid_options
+    assert_raises(ArgumentError) do
+      RubyProf::Profile.new(deferred: true, sampling: true)
+    end
+
+    assert_raises(ArgumentError) do
+      RubyProf::Profile.new(deferred: true, track_allocations: true)
+    end
+
+    assert_raises(ArgumentError) do
+      RubyProf::Profile.new(deferred: true, measure_mode: RubyProf::ALLOCATIONS)
+    end
+  end
+end
@@ -345,6 +345,25 @@ class ExcludeMethodsTest < TestCase
     end
   end
 
+  def test_exclude_method_between_runs
+    obj = ExcludeMethodsClass.new
+    prf = RubyProf::Profile.new
+
+    prf.start
+    obj.a
+    prf.stop
+
+    prf.exclude_method!(ExcludeMethodsClass, :b)
+
+    prf.start
+    obj.a
+    prf.stop
+
+    method_names = prf.threads.first.methods.map(&:full_name)
+    assert_includes(method_names, 'ExcludeMethodsClass#a')
+    refute_includes(method_names, 'ExcludeMethodsClass#b')
+  end
+
   private
 
   def assert_method_has_been_excluded(result, excluded_method)
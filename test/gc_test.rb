@@ -101,4 +101,18 @@ end
       refute_nil(call_tree.source_file)
     end
   end
+
+  def test_compact_call_trees
+    profile = run_profile
+    call_tree = profile.threads.first.call_tree.children.first
+    measurement = call_tree.measurement
+    source_file = call_tree.source_file
+
+    GC.compact if GC.respond_to?(:compact)
+
+    child = profile.threads.first.call_tree.children.first
+    assert_same(call_tree, child)
+    assert_same(measurement, child.measurement)
+    assert_equal(source_file, child.source_file)
+  end
 end
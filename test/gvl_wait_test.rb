@@ -0,0 +1,81 @@
+#!/usr/bin/env ruby
+# encoding: UTF-8
+
+require File.expand_path('../test_helper', __FILE__)
+
+class GvlWaitTest < TestCase
+  def setup
+    super
+    skip("Thread event hooks require Ruby 3.2 or later") if Gem::Version.new(RUBY_VERSION) < Gem::Version.new('3.2')
+  end
+
+  def busy_wait(seconds)
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    while Process.clock_gettime(Process::CLOCK_MONOTONIC) - start < seconds
+    end
+  end
+
+  def thread_methods(result, thread)
+    result.threads.detect {|t| t.id == thread.object_id}.methods
+  end
+
+  def test_contention
+    threads = nil
+    result = RubyProf::Profile.profile(measure_mode: RubyProf::WALL_TIME) do
+      threads = 2.times.map do
+        Thread.new { busy_wait(0.3) }
+      end
+      threads.each(&:join)
+    end
+
+    threads.each do |thread|
+      methods = thread_methods(result, thread)
+      wait_time = methods.sum(&:wait_time)
+      gvl_wait_time = methods.sum(&:gvl_wait_time)
+
+      # Each thread waits for the other one to release the GVL
+      assert_operator(gvl_wait_time, :>, 0.05)
+      assert_operator(gvl_wait_time, :<=, wait_time)
+      methods.each do |method|
+        assert_in_delta(method.wait_time - method.gvl_wait_time, method.blocked_time, 0.000001)
+      end
+    end
+  end
+
+  def test_sleep
+    thread = nil
+    result = RubyProf::Profile.profile(measure_mode: RubyProf::WALL_TIME) do
+      thread = Thread.new { sleep(0.2) }
+      # Run while the thread sleeps without holding the GVL
+      sleep(0.01) while thread.alive?
+    end
+
+    method = thread_methods(result, thread).detect {|m| m.full_name == 'Kernel#sleep'}
+    assert_in_delta(0.2, method.wait_time, 0.05 * delta_multiplier)
+    assert_in_delta(0.2, method.blocked_time, 0.05 * delta_multiplier)
+    assert_in_delta(0.0, method.gvl_wait_time, 0.05 * delta_multiplier)
+  end
+
+  def test_process_time
+    result = RubyProf::Profile.profile(measure_mode: RubyProf::PROCESS_TIME) do
+      2.times.map { Thread.new { busy_wait(0.1) } }.each(&:join)
+    end
+
+    result.threads.each do |thread|
+      thread.methods.each do |method|
+        assert_equal(0, method.gvl_wait_time)
+        assert_equal(method.wait_time, method.blocked_time)
+      end
+    end
+  end
+
+  def test_marshal
+    result = RubyProf::Profile.profile(measure_mode: RubyProf::WALL_TIME) do
+      2.times.map { Thread.new { busy_wait(0.2) } }.each(&:join)
+    end
+
+    loaded = Marshal.load(Marshal.dump(result))
+    expected = result.threads.map {|thread| thread.methods.map(&:gvl_wait_time)}
+    assert_equal(expected, loaded.threads.map {|thread| thread.methods.map(&:gvl_wait_time)})
+  end
+end
@@ -0,0 +1,77 @@
+#!/usr/bin/env ruby
+# encoding: UTF-8
+
+require File.expand_path('../test_helper', __FILE__)
+require_relative './measure_allocations'
+
+class MeasureAllocatedBytesTest < TestCase
+  LARGE_STRING_SIZE = 1_000_000
+
+  def make_large_string
+    'a' * LARGE_STRING_SIZE
+  end
+
+  def test_allocated_bytes
+    result = RubyProf::Profile.profile(measure_mode: RubyProf::ALLOCATED_BYTES) do
+      make_large_string
+      Allocator.new.run
+    end
+
+    assert_equal("allocated_bytes", result.measure_mode_string)
+    assert(result.track_allocations?)
+
+    thread = result.threads.first
+    assert_operator(thread.total_time, :>=, LARGE_STRING_SIZE)
+
+    method = result.threads.first.methods.find { |m| m.full_name == 'String#*' }
+    assert_operator(method.self_time, :>=, LARGE_STRING_SIZE)
+
+    method = result.threads.first.methods.find { |m| m.full_name == 'Allocator#make_hashes' }
+    assert_operator(method.total_time, :>, 0)
+    assert_operator(method.total_time, :<, LARGE_STRING_SIZE)
+  end
+
+  def test_concurrent_profiles
+    [RubyProf::ALLOCATIONS, RubyProf::ALLOCATED_BYTES].each do |mode|
+      single = RubyProf::Profile.profile(measure_mode: mode) do
+        Allocator.new.make_hashes
+      end
+
+      # Each profile counts its own allocations, not the events of the other one too
+      outer = RubyProf::Profile.new(measure_mode: mode)
+      inner = RubyProf::Profile.new(measure_mode: mode)
+      outer.start
+      inner.start
+      Allocator.new.make_hashes
+      inner_result = inner.stop
+      outer_result = outer.stop
+
+      expected = single.threads.first.methods.find { |m| m.full_name == 'Allocator#make_hashes' }.total_time
+      [inner_result, outer_result].each do |result|
+        method = result.threads.first.methods.find { |m| m.full_name == 'Allocator#make_hashes' }
+        assert_equal(expected, method.total_time)
+      end
+    end
+  end
+
+  def test_allocation_memory
+    result = RubyProf::Profile.profile(track_allocations: true) do
+      make_large_string
+      Allocator.new.run
+    end
+
+    method = result.threads.first.methods.find { |m| m.full_name == 'MeasureAllocatedBytesTest#make_large_string' }
+    allocation = method.allocations.find { |a| a.klass_name == 'String' && a.max_memory >= LARGE_STRING_SIZE }
+    assert(allocation)
+    assert_operator(allocation.memory, :>=, allocation.max_memory)
+
+    method = result.threads.first.methods.find { |m| m.full_name == 'Allocator#make_hashes' }
+    allocations = method.allocations.select { |a| a.klass_name == 'Hash' }
+    assert_equal(5, allocations.length)
+    allocations.each do |allocation|
+      assert_equal(1, allocation.count)
+      assert_operator(allocation.max_memory, :>, 0)
+      assert_equal(allocation.max_memory, allocation.memory)
+    end
+  end
+end
@@ -0,0 +1,90 @@
+#!/usr/bin/env ruby
+# encoding: UTF-8
+
+require File.expand_path('../test_helper', __FILE__)
+require_relative './measure_times'
+
+class MeasurePerfEventTest < TestCase
+  def setup
+    super
+    skip("Perf events are only supported on Linux") unless RUBY_PLATFORM.include?("linux")
+  end
+
+  def test_supported
+    assert_includes([true, false], RubyProf.perf_event_supported?(RubyProf::INSTRUCTIONS))
+    assert_raises(ArgumentError) do
+      RubyProf.perf_event_supported?(RubyProf::WALL_TIME)
+    end
+  end
+
+  def test_task_clock
+    skip("Task clock is not available") unless RubyProf.perf_event_supported?(RubyProf::TASK_CLOCK)
+
+    profile = RubyProf::Profile.new(measure_mode: RubyProf::TASK_CLOCK)
+    assert_equal("task_clock", profile.measure_mode_string)
+
+    cpu_time = 0
+    result = profile.profile do
+      start = Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID)
+      RubyProf::C1.busy_wait
+      cpu_time = Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID) - start
+      RubyProf::C1.sleep_wait
+    end
+
+    methods = result.threads.first.methods
+    busy = methods.detect {|method| method.full_name == '<Class::RubyProf::C1>#busy_wait'}
+    sleep = methods.detect {|method| method.full_name == 'Kernel#sleep'}
+
+    assert_in_delta(cpu_time, busy.total_time, 0.03 * delta_multiplier)
+    assert_in_delta(0.0, sleep.total_time, 0.03 * delta_multiplier)
+  end
+
+  def test_page_faults
+    skip("Page faults are not available") unless RubyProf.perf_event_supported?(RubyProf::PAGE_FAULTS)
+
+    result = RubyProf::Profile.profile(measure_mode: RubyProf::PAGE_FAULTS) do
+      Array.new(10_000_000, 1)
+    end
+
+    method = result.threads.first.methods.detect {|method| method.full_name == 'Array#initialize'}
+    assert_operator(method.total_time, :>, 0)
+    assert_equal(method.total_time.to_i, method.total_time)
+  end
+
+  def test_threads
+    skip("Task clock is not available") unless RubyProf.perf_event_supported?(RubyProf::TASK_CLOCK)
+
+    cpu_time = 0
+    result = RubyProf::Profile.profile(measure_mode: RubyProf::TASK_CLOCK) do
+      Thread.new do
+        start = Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID)
+        RubyProf::C1.busy_wait
+        cpu_time = Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID) - start
+      end.join
+    end
+
+    thread = result.threads.detect {|t| t.methods.any? {|method| method.full_name == '<Class::RubyProf::C1>#busy_wait'}}
+    busy = thread.methods.detect {|method| method.full_name == '<Class::RubyProf::C1>#busy_wait'}
+    assert_in_delta(cpu_time, busy.total_time, 0.03 * delta_multiplier)
+
+    # The main thread's counter stops while it waits, so it is not charged for the other thread
+    main = result.threads.detect {|t| t.id == Thread.current.object_id}
+    join = main.methods.detect {|method| method.full_name == 'Thread#join'}
+    assert_in_delta(0.0, join.total_time, 0.03 * delta_multiplier)
+    main.methods.each do |method|
+      assert_operator(method.wait_time, :>=, 0)
+      assert_operator(method.self_time, :>=, 0)
+    end
+  end
+
+  def test_hardware_fallback
+    skip("Hardware counters are available") if RubyProf.perf_event_supported?(RubyProf::INSTRUCTIONS)
+    skip("Task clock is not available") unless RubyProf.perf_event_supported?(RubyProf::TASK_CLOCK)
+
+    profile = nil
+    assert_output(nil, /Hardware performance counters are not available/) do
+      profile = RubyProf::Profile.new(measure_mode: RubyProf::INSTRUCTIONS)
+    end
+    assert_equal(RubyProf::TASK_CLOCK, profile.measure_mode)
+  end
+end
@@ -0,0 +1,76 @@
+#!/usr/bin/env ruby
+# encoding: UTF-8
+
+require File.expand_path('../test_helper', __FILE__)
+require_relative './measure_times'
+
+class MeasureThreadCpuTimeTest < TestCase
+  def test_mode
+    profile = RubyProf::Profile.new(measure_mode: RubyProf::THREAD_CPU_TIME)
+    assert_equal(RubyProf::THREAD_CPU_TIME, profile.measure_mode)
+    assert_equal("thread_cpu_time", profile.measure_mode_string)
+  end
+
+  def test_sleep
+    result = RubyProf::Profile.profile(measure_mode: RubyProf::THREAD_CPU_TIME) do
+      RubyProf::C1.sleep_wait
+    end
+
+    method = result.threads.first.methods.detect {|m| m.full_name == 'Kernel#sleep'}
+    assert_in_delta(0.0, method.total_time, 0.05 * delta_multiplier)
+  end
+
+  def test_busy_wait
+    cpu_time = 0
+    result = RubyProf::Profile.profile(measure_mode: RubyProf::THREAD_CPU_TIME) do
+      start = Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID)
+      RubyProf::C1.busy_wait
+      cpu_time = Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID) - start
+    end
+
+    method = result.threads.first.methods.detect {|m| m.full_name == '<Class::RubyProf::C1>#busy_wait'}
+    assert_in_delta(cpu_time, method.total_time, 0.03 * delta_multiplier)
+  end
+
+  def test_other_threads_not_charged
+    worker_cpu_time = 0
+    result = RubyProf::Profile.profile(measure_mode: RubyProf::THREAD_CPU_TIME) do
+      thread = Thread.new do
+        start = Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID)
+        RubyProf::C1.busy_wait
+        worker_cpu_time = Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID) - start
+      end
+      thread.join
+    end
+
+    main = result.threads.detect {|t| t.id == Thread.current.object_id}
+    join = main.methods.detect {|m| m.full_name == 'Thread#join'}
+    assert_in_delta(0.0, join.total_time, 0.05 * delta_multiplier)
+    assert_in_delta(0.0, join.wait_time, 0.05 * delta_multiplier)
+    main.methods.each do |method|
+      assert_operator(method.wait_time, :>=, 0)
+      assert_operator(method.self_time, :>=, 0)
+    end
+
+    worker = result.threads.detect {|t| t.id != Thread.current.object_id}
+    busy = worker.methods.detect {|m| m.full_name == '<Class::RubyProf::C1>#busy_wait'}
+    assert_in_delta(worker_cpu_time, busy.total_time, 0.03 * delta_multiplier)
+    assert_in_delta(0.0, busy.wait_time, 0.01 * delta_multiplier)
+  end
+
+  def test_process_time_charges_other_threads
+    worker_cpu_time = 0
+    result = RubyProf::Profile.profile(measure_mode: RubyProf::PROCESS_TIME) do
+      thread = Thread.new do
+        start = Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID)
+        RubyProf::C1.busy_wait
+        worker_cpu_time = Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID) - start
+      end
+      thread.join
+    end
+
+    main = result.threads.detect {|t| t.id == Thread.current.object_id}
+    join = main.methods.detect {|m| m.full_name == 'Thread#join'}
+    assert_operator(join.total_time, :>, worker_cpu_time / 2)
+  end
+end
@@ -0,0 +1,55 @@
+#!/usr/bin/env ruby
+# encoding: UTF-8
+
+require File.expand_path('../test_helper', __FILE__)
+require_relative './measure_times'
+
+class MeasureTscTimeTest < TestCase
+  def test_mode
+    profile = RubyProf::Profile.new(measure_mode: RubyProf::TSC_TIME)
+    assert_equal(RubyProf::TSC_TIME, profile.measure_mode)
+    assert_equal("tsc_time", profile.measure_mode_string)
+  end
+
+  def test_tsc_invariant
+    assert_includes([true, false], RubyProf.tsc_invariant?)
+  end
+
+  def test_class_methods
+    result = RubyProf::Profile.profile(measure_mode: RubyProf::TSC_TIME) do
+      RubyProf::C1.sleep_wait
+    end
+
+    thread = result.threads.first
+    assert_in_delta(0.1, thread.total_time, 0.03 * delta_multiplier)
+
+    methods = result.threads.first.methods.sort.reverse
+    assert_equal(3, methods.length)
+
+    assert_equal('MeasureTscTimeTest#test_class_methods', methods[0].full_name)
+    assert_equal('<Class::RubyProf::C1>#sleep_wait', methods[1].full_name)
+    assert_equal('Kernel#sleep', methods[2].full_name)
+
+    assert_in_delta(0.1, methods[0].total_time, 0.03 * delta_multiplier)
+    assert_in_delta(0, methods[0].self_time, 0.03 * delta_multiplier)
+
+    assert_in_delta(0.1, methods[1].total_time, 0.03 * delta_multiplier)
+    assert_in_delta(0, methods[1].self_time, 0.03 * delta_multiplier)
+
+    assert_in_delta(0.1, methods[2].total_time, 0.03 * delta_multiplier)
+    assert_in_delta(0.1, methods[2].self_time, 0.03 * delta_multiplier)
+  end
+
+  def test_matches_wall_time
+    wall_time = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    result = RubyProf::Profile.profile(measure_mode: RubyProf::TSC_TIME) do
+      RubyProf::C1.busy_wait
+    end
+    wall_time = Process.clock_gettime(Process::CLOCK_MONOTONIC) - wall_time
+
+    thread = result.threads.first
+    assert_operator(thread.total_time, :>, 0)
+    assert_operator(thread.total_time, :<=, wall_time)
+    assert_in_delta(wall_time, thread.total_time, 0.03 * delta_multiplier)
+  end
+end
@@ -56,6 +56,26 @@ class MeasurementTest < Minitest::Test
     assert_equal(3, measurement2.called)
   end
 
+  def test_merge_precision
+    measurement1 = RubyProf::Measurement.new(100_000.0, 100_000.0, 0, 1)
+    measurement2 = RubyProf::Measurement.new(0.000001, 0.000001, 0, 1)
+
+    1000.times do
+      measurement1.merge!(measurement2)
+    end
+
+    assert_equal(100_000.001, measurement1.total_time)
+    assert_equal(100_000.001, measurement1.self_time)
+  end
+
+  def test_large_called
+    measurement = RubyProf::Measurement.new(4, 3, 1, 2**40)
+    assert_equal(2**40, measurement.called)
+
+    measurement.merge!(RubyProf::Measurement.new(4, 3, 1, 2**40))
+    assert_equal(2**41, measurement.called)
+  end
+
   def test_set_total_time
     measurement = RubyProf::Measurement.new(4, 3, 1, 1)
     measurement.total_time = 5.1
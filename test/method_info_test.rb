@@ -97,4 +97,23 @@ class MethodInfoTest < Minitest::Test
     method_info = RubyProf::MethodInfo.new(Base64, :encode64)
     assert_equal("Base64#encode64 (c: 0, tt: 0.0, st: 0.0, wt: 0.0, ct: 0.0)", method_info.to_s)
   end
+
+  def test_profiled
+    object = Object.new
+    def object.singleton_method; end
+
+    profile = RubyProf::Profile.profile do
+      object.singleton_method
+    end
+
+    methods = profile.threads.first.methods
+    method_info = methods.find { |method| method.method_name == :singleton_method }
+    assert_equal(RubyProf::MethodInfo::OBJECT_SINGLETON, method_info.klass_flags)
+    assert_equal("Object", method_info.klass_name)
+
+    methods.each do |method|
+      assert_kind_of(RubyProf::CallTrees, method.call_trees)
+      assert_empty(method.allocations)
+    end
+  end
 end
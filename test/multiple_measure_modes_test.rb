@@ -0,0 +1,74 @@
+#!/usr/bin/env ruby
+# encoding: UTF-8
+
+require File.expand_path('../test_helper', __FILE__)
+require_relative './measure_times'
+
+class MultipleMeasureModesTest < TestCase
+  MODES = [RubyProf::WALL_TIME, RubyProf::THREAD_CPU_TIME, RubyProf::ALLOCATIONS]
+
+  def test_measure_modes
+    profile = RubyProf::Profile.new(measure_mode: MODES)
+    assert_equal(RubyProf::WALL_TIME, profile.measure_mode)
+    assert_equal(MODES, profile.measure_modes)
+
+    profile = RubyProf::Profile.new(measure_mode: RubyProf::PROCESS_TIME)
+    assert_equal([RubyProf::PROCESS_TIME], profile.measure_modes)
+  end
+
+  def test_invalid
+    assert_raises(ArgumentError) do
+      RubyProf::Profile.new(measure_mode: [])
+    end
+
+    assert_raises(ArgumentError) do
+      RubyProf::Profile.new(measure_mode: [RubyProf::WALL_TIME] * 5)
+    end
+
+    assert_raises(ArgumentError) do
+      RubyProf::Profile.new(measure_mode: MODES, sampling: true)
+    end
+  end
+
+  def test_measurements
+    result = RubyProf::Profile.profile(measure_mode: MODES) do
+      RubyProf::C1.sleep_wait
+      3.times { Array.new }
+    end
+
+    methods = result.threads.first.methods
+    sleep_method = methods.detect {|m| m.full_name == 'Kernel#sleep'}
+    wall, cpu, allocations = sleep_method.measurements
+    assert_same(sleep_method.measurement, wall)
+    assert_in_delta(0.1, wall.total_time, 0.05 * delta_multiplier)
+    assert_in_delta(0.0, cpu.total_time, 0.05 * delta_multiplier)
+    assert_equal(0, allocations.total_time)
+    assert_equal(1, cpu.called)
+
+    new_method = methods.detect {|m| m.full_name == '<Class::Array>#new'}
+    measurements = new_method.measurements
+    assert_equal(3, measurements.length)
+    assert_equal(3, measurements[2].total_time)
+    assert_equal([3, 3, 3], measurements.map(&:called))
+
+    call_tree = result.threads.first.call_tree
+    assert_equal(3, call_tree.measurements.length)
+    assert_in_delta(wall.total_time, call_tree.measurements[0].total_time, 0.05 * delta_multiplier)
+    assert_equal(3, call_tree.measurements[2].total_time)
+  end
+
+  def test_marshal
+    result = RubyProf::Profile.profile(measure_mode: MODES) do
+      3.times { Array.new }
+    end
+
+    loaded = Marshal.load(Marshal.dump(result))
+    assert_equal(MODES, loaded.measure_modes)
+
+    method = result.threads.first.methods.detect {|m| m.full_name == '<Class::Array>#new'}
+    loaded_method = loaded.threads.first.methods.detect {|m| m.full_name == '<Class::Array>#new'}
+    assert_equal(method.measurements.map(&:total_time), loaded_method.measurements.map(&:total_time))
+    assert_equal(result.threads.first.call_tree.measurements.map(&:total_time),
+                 loaded.threads.first.call_tree.measurements.map(&:total_time))
+  end
+end
@@ -159,4 +159,17 @@ class PrintersTest < TestCase
       end
     end
   end
+
+  def test_print_footer_counter_modes
+    result = RubyProf::Profile.profile(measure_mode: RubyProf::TSC_TIME) { run_primes(200) }
+    output = StringIO.new
+    RubyProf::GraphPrinter.new(result).print(output)
+    assert_match("The total time spent by this method and its children.", output.string)
+
+    skip "perf events are not available" unless RUBY_PLATFORM =~ /linux/ && RubyProf.perf_event_supported?(RubyProf::PAGE_FAULTS)
+    result = RubyProf::Profile.profile(measure_mode: RubyProf::PAGE_FAULTS) { run_primes(200) }
+    output = StringIO.new
+    RubyProf::GraphPrinter.new(result).print(output)
+    assert_match("The total number of page faults counted by this method and its children.", output.string)
+  end
 end
@@ -15,6 +15,99 @@ class ProfileTest < TestCase
     assert_equal("process_time", profile.measure_mode_string)
   end
 
+  def test_events
+    profile = RubyProf::Profile.new
+    assert_equal(RubyProf::EVENTS_LINES, profile.events)
+
+    profile = RubyProf::Profile.new(events: RubyProf::EVENTS_METHODS)
+    assert_equal(RubyProf::EVENTS_METHODS, profile.events)
+
+    assert_raises(ArgumentError) do
+      RubyProf::Profile.new(events: 42)
+    end
+  end
+
+  def test_events_methods
+    result = RubyProf::Profile.profile(events: RubyProf::EVENTS_METHODS) do
+      create_call_tree_1
+    end
+
+    method_names = result.threads.first.methods.map(&:full_name)
+    assert_includes(method_names, "Object#create_call_tree_1")
+    refute_includes(method_names, "Class#new")
+  end
+
+  def test_events_c_calls
+    result = RubyProf::Profile.profile(events: RubyProf::EVENTS_C_CALLS) do
+      create_call_tree_1
+    end
+
+    method_names = result.threads.first.methods.map(&:full_name)
+    assert_includes(method_names, "Object#create_call_tree_1")
+    assert_includes(method_names, "Class#new")
+  end
+
+  def test_overhead
+    profile = RubyProf::Profile.new
+    profile.profile { create_call_tree_1 }
+    assert_equal(0.0, profile.overhead)
+
+    profile = RubyProf::Profile.new(compensate_overhead: true)
+    result = profile.profile { create_call_tree_1 }
+    assert_operator(profile.overhead, :>, 0.0)
+
+    result.threads.first.methods.each do |method|
+      assert_operator(method.total_time, :>=, 0.0)
+      assert_operator(method.self_time, :>=, 0.0)
+    end
+  end
+
+  def overhead_call
+  end
+
+  def overhead_calls
+    i = 0
+    while i < 10_000
+      overhead_call
+      i += 1
+    end
+  end
+
+  def test_overhead_compensation
+    [RubyProf::EVENTS_METHODS, RubyProf::EVENTS_C_CALLS, RubyProf::EVENTS_LINES].each do |events|
+      uncompensated = RubyProf::Profile.profile(events: events) { overhead_calls }
+      profile = RubyProf::Profile.new(events: events, compensate_overhead: true)
+      compensated = profile.profile { overhead_calls }
+      assert_operator(profile.overhead, :>, 0.0)
+
+      uncompensated_method = uncompensated.threads.first.methods.detect {|method| method.full_name == 'ProfileTest#overhead_calls'}
+      compensated_method = compensated.threads.first.methods.detect {|method| method.full_name == 'ProfileTest#overhead_calls'}
+      assert_operator(compensated_method.total_time, :<, uncompensated_method.total_time)
+      assert_operator(compensated_method.self_time, :<, uncompensated_method.self_time)
+      assert_operator(compensated_method.self_time, :>=, 0.0)
+    end
+  end
+
+  def test_overhead_includes_frames
+    # The calibration method is not excluded, so its calls are pushed and popped like any other
+    result = RubyProf::Profile.profile(events: RubyProf::EVENTS_METHODS) do
+      RubyProf::Profile::Calibration.calls(10)
+    end
+    method = result.threads.first.methods.detect {|m| m.full_name == '<Class::RubyProf::Profile::Calibration>#call'}
+    assert_equal(10, method.called)
+
+    # So each event costs more than a whole iteration of the same loop with the hooks disabled
+    count = 100_000
+    RubyProf::Profile::Calibration.calls(count)
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    RubyProf::Profile::Calibration.calls(count)
+    untraced = (Process.clock_gettime(Process::CLOCK_MONOTONIC) - start) / count
+
+    profile = RubyProf::Profile.new(events: RubyProf::EVENTS_METHODS, compensate_overhead: true)
+    profile.profile { overhead_call }
+    assert_operator(profile.overhead, :>, untraced)
+  end
+
   def test_add_thread
     profile = RubyProf::Profile.new
     assert_empty(profile.threads)
@@ -29,6 +29,43 @@ module SimpleRecursion
       render_partial(i)
     end
   end
+
+  def countdown(n)
+    return if n == 0
+    countdown(n - 1)
+  end
+
+  # Mutually recursive methods
+  def ping(n)
+    pong(n - 1) if n > 0
+  end
+
+  def pong(n)
+    ping(n - 1) if n > 0
+  end
+end
+
+# Allocations from blocks run by a folded frame. outer and middle are in another file, so the
+# allocations are attributed to first or second, whichever is on the stack.
+module FoldAllocations
+  module_eval(<<~RUBY, "fold_allocations.rb", 1)
+    def self.outer
+      block_given? ? yield : middle
+    end
+
+    def self.middle
+      first
+      second
+    end
+  RUBY
+
+  def self.first
+    outer { [self] }
+  end
+
+  def self.second
+    outer { [self] }
+  end
 end
 
 # --  Tests ----
@@ -793,4 +830,63 @@ class RecursiveTest < TestCase
       assert_equal(0, method.call_trees.callees.length)
     end
   end
+
+  def test_fold_recursion
+    result = RubyProf::Profile.profile(fold_recursion: true) do
+      countdown(100)
+    end
+    assert(result.fold_recursion?)
+
+    method = result.threads.first.methods.find { |m| m.full_name == 'SimpleRecursion#countdown' }
+    assert_equal(101, method.called)
+    assert(method.recursive?)
+
+    # Every recursive call is charged to the first call's call tree
+    assert_equal(1, method.call_trees.call_trees.length)
+    call_tree = method.call_trees.call_trees.first
+    assert_equal(101, call_tree.called)
+    assert_equal(method.total_time, call_tree.total_time)
+    assert_equal(method.self_time, call_tree.self_time)
+    assert(call_tree.children.none? { |child| child.target == method })
+  end
+
+  def test_fold_mutual_recursion
+    result = RubyProf::Profile.profile(fold_recursion: true) do
+      ping(100)
+    end
+
+    # No method appears twice on a path through the call tree
+    paths = [[result.threads.first.call_tree]]
+    until paths.empty?
+      path = paths.pop
+      assert_equal(path.map(&:target).uniq, path.map(&:target))
+      path.last.children.each { |child| paths << path + [child] }
+    end
+
+    ping = result.threads.first.methods.find { |m| m.full_name == 'SimpleRecursion#ping' }
+    pong = result.threads.first.methods.find { |m| m.full_name == 'SimpleRecursion#pong' }
+    assert_equal(51, ping.called)
+    assert_equal(50, pong.called)
+    assert_equal(1, ping.call_trees.call_trees.length)
+    assert_equal(1, pong.call_trees.call_trees.length)
+    assert_equal(ping.total_time, ping.call_trees.call_trees.first.total_time)
+    assert_operator(pong.call_trees.call_trees.first.total_time, :<=, ping.total_time)
+  end
+
+  def test_fold_recursion_allocations
+    # Warm up the call sites so the only allocations while profiling are the blocks' arrays
+    FoldAllocations.outer
+
+    result = RubyProf::Profile.profile(fold_recursion: true, track_allocations: true) do
+      FoldAllocations.outer
+    end
+
+    # The stacks [outer, middle, first, outer] and [outer, middle, second, outer] have the same
+    # top call tree, but each block's allocation belongs to the method that defined it
+    methods = result.threads.first.methods
+    first = methods.find { |m| m.full_name == '<Module::FoldAllocations>#first' }
+    second = methods.find { |m| m.full_name == '<Module::FoldAllocations>#second' }
+    assert_equal(1, first.allocations.sum(&:count))
+    assert_equal(1, second.allocations.sum(&:count))
+  end
 end
@@ -0,0 +1,95 @@
+#!/usr/bin/env ruby
+# encoding: UTF-8
+
+require File.expand_path('../test_helper', __FILE__)
+
+class RetainedTest < TestCase
+  COUNT = 1000
+
+  def setup
+    super
+    @kept = []
+  end
+
+  def keep_strings
+    COUNT.times { @kept << "a" * 100 }
+  end
+
+  def discard_strings
+    COUNT.times { "b" * 100 }
+  end
+
+  def string_allocation(result, method_name)
+    method = result.threads.first.methods.detect {|m| m.full_name == "RetainedTest##{method_name}"}
+    method.allocations.detect {|allocation| allocation.klass_name == 'String' && allocation.line}
+  end
+
+  def test_disabled
+    result = RubyProf::Profile.profile(track_allocations: true) { keep_strings }
+    refute(result.track_retained?)
+
+    allocation = string_allocation(result, :keep_strings)
+    assert_equal(0, allocation.retained)
+    assert_equal(0, allocation.retained_memory)
+  end
+
+  def test_implies_track_allocations
+    profile = RubyProf::Profile.new(track_retained: true)
+    assert(profile.track_retained?)
+    assert(profile.track_allocations?)
+  end
+
+  def test_retained
+    result = RubyProf::Profile.profile(track_retained: true) do
+      keep_strings
+      discard_strings
+    end
+
+    kept = string_allocation(result, :keep_strings)
+    assert_equal(COUNT, kept.retained)
+    assert_operator(kept.retained_memory, :>=, COUNT * 100)
+
+    discarded = string_allocation(result, :discard_strings)
+    assert_operator(discarded.count, :>=, COUNT)
+    assert_operator(discarded.retained, :<, COUNT / 10)
+  end
+
+  def test_compaction
+    skip("GC.compact is not supported") unless GC.respond_to?(:compact)
+
+    result = RubyProf::Profile.profile(track_retained: true) do
+      keep_strings
+      discard_strings
+      GC.compact
+      @kept.clear
+    end
+
+    kept = string_allocation(result, :keep_strings)
+    assert_operator(kept.retained, :<, COUNT / 10)
+  rescue NotImplementedError
+    skip("GC.compact is not supported")
+  end
+
+  def test_marshal
+    result = RubyProf::Profile.profile(track_retained: true) { keep_strings }
+    loaded = Marshal.load(Marshal.dump(result))
+    assert(loaded.track_retained?)
+
+    allocation = string_allocation(result, :keep_strings)
+    loaded_allocation = string_allocation(loaded, :keep_strings)
+    assert_equal(allocation.retained, loaded_allocation.retained)
+    assert_equal(allocation.retained_memory, loaded_allocation.retained_memory)
+  end
+
+  def test_printer
+    result = RubyProf::Profile.profile(track_retained: true) do
+      discard_strings
+      keep_strings
+    end
+
+    output = StringIO.new
+    RubyProf::AllocationPrinter.new(result).print(output)
+    assert_match(/Sort by: retained_memory/, output.string)
+    assert_operator(output.string.index("RetainedTest#keep_strings"), :<, output.string.index("RetainedTest#discard_strings"))
+  end
+end
@@ -0,0 +1,115 @@
+#!/usr/bin/env ruby
+# encoding: UTF-8
+
+require File.expand_path('../test_helper', __FILE__)
+require 'stringio'
+
+# --  Tests ----
+class SamplingTest < TestCase
+  def busy(duration)
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    while Process.clock_gettime(Process::CLOCK_MONOTONIC) - start < duration
+    end
+  end
+
+  def run_primes_twice
+    busy(0.05)
+    busy(0.05)
+  end
+
+  def test_sampling?
+    refute(RubyProf::Profile.new.sampling?)
+    assert(RubyProf::Profile.new(sampling: true).sampling?)
+  end
+
+  def test_methods
+    result = RubyProf::Profile.profile(sampling: true, sample_interval: 0.001) do
+      run_primes_twice
+    end
+
+    assert_equal(1, result.threads.length)
+    thread = result.threads.first
+    assert_in_delta(0.1, thread.total_time, 0.05)
+
+    method_names = thread.methods.map(&:full_name)
+    assert_includes(method_names, "SamplingTest#run_primes_twice")
+    assert_includes(method_names, "SamplingTest#busy")
+
+    method = thread.methods.find {|m| m.full_name == "SamplingTest#busy"}
+    assert_in_delta(0.1, method.total_time, 0.05)
+    assert_equal(__FILE__, method.source_file)
+  end
+
+  def test_excludes_profile_methods
+    result = RubyProf::Profile.profile(sampling: true) do
+      busy(0.02)
+    end
+
+    method_names = result.threads.first.methods.map(&:full_name)
+    refute(method_names.any? {|name| name.start_with?("RubyProf::Profile#")})
+  end
+
+  def test_exclude_method
+    profile = RubyProf::Profile.new(sampling: true)
+    profile.exclude_method!(SamplingTest, :run_primes_twice)
+    result = profile.profile do
+      run_primes_twice
+    end
+
+    method_names = result.threads.first.methods.map(&:full_name)
+    refute_includes(method_names, "SamplingTest#run_primes_twice")
+    assert_includes(method_names, "SamplingTest#busy")
+  end
+
+  def test_threads
+    result = RubyProf::Profile.profile(sampling: true) do
+      thread = Thread.new do
+        busy(0.05)
+      end
+      busy(0.05)
+      thread.join
+    end
+
+    assert_equal(2, result.threads.length)
+  end
+
+  def test_printers
+    result = RubyProf::Profile.profile(sampling: true) do
+      run_primes_twice
+    end
+
+    [RubyProf::FlatPrinter, RubyProf::GraphPrinter, RubyProf::GraphHtmlPrinter,
+     RubyProf::CallStackPrinter, RubyProf::CallInfoPrinter, RubyProf::FlameGraphPrinter].each do |klass|
+      output = StringIO.new
+      klass.new(result).print(output)
+      refute_empty(output.string)
+    end
+  end
+
+  def test_invalid_options
+    assert_raises(ArgumentError) do
+      RubyProf::Profile.new(sampling: true, measure_mode: RubyProf::ALLOCATIONS)
+    end
+
+    assert_raises(ArgumentError) do
+      RubyProf::Profile.new(sampling: true, track_allocations: true)
+    end
+
+    assert_raises(ArgumentError) do
+      RubyProf::Profile.new(sampling: true, sample_interval: 0)
+    end
+  end
+
+  def test_one_at_a_time
+    profile = RubyProf::Profile.new(sampling: true)
+    profile.start
+    begin
+      error = assert_raises(RuntimeError) do
+        RubyProf::Profile.new(sampling: true).start
+      end
+      assert_equal("Only one profile can be sampled at a time", error.message)
+    ensure
+      profile.stop
+    end
+  end
+end
@@ -133,6 +133,28 @@ class ThreadTest < TestCase
     end
   end
 
+  def test_shared_methods
+    result = RubyProf::Profile.profile(measure_mode: RubyProf::WALL_TIME) do
+      thread = Thread.new do
+        [1, 2].sort
+      end
+      thread.join
+      [3, 4].sort
+    end
+
+    sorts = result.threads.map do |thread|
+      thread.methods.detect {|method| method.full_name == 'Array#sort'}
+    end
+    assert_equal(2, sorts.compact.size)
+
+    # Each thread has its own measurements but the methods share their class name
+    refute_same(sorts[0], sorts[1])
+    assert_equal(1, sorts[0].called)
+    assert_equal(1, sorts[1].called)
+    assert_same(sorts[0].klass_name, sorts[1].klass_name)
+    assert_equal(sorts[0].source_file, sorts[1].source_file)
+  end
+
   def test_thread_timings
     profile = RubyProf::Profile.new(measure_mode: RubyProf::WALL_TIME)
     profile.start
@@ -0,0 +1,154 @@
+#!/usr/bin/env ruby
+# encoding: UTF-8
+
+require File.expand_path('../test_helper', __FILE__)
+
+class TrackGcTest < TestCase
+  def collect
+    GC.start
+  end
+
+  # GC.compact and Thread.stop are C methods, so no traced event follows the collection on this thread
+  def compact_and_stop
+    GC.compact
+    Thread.stop
+  end
+
+  # The worker delivers no traced event between waking up and collecting
+  def stop_compact_and_stop
+    Thread.stop
+    GC.compact
+    Thread.stop
+  end
+
+  def noop
+  end
+
+  def find_gc_method(result)
+    result.threads.first.methods.detect {|method| method.full_name == '[GC]'}
+  end
+
+  def test_disabled
+    profile = RubyProf::Profile.new
+    refute(profile.track_gc?)
+
+    result = profile.profile do
+      collect
+    end
+
+    assert_nil(find_gc_method(result))
+    result.threads.first.methods.each do |method|
+      assert_equal(0, method.gc_count)
+    end
+  end
+
+  def test_gc_method
+    profile = RubyProf::Profile.new(track_gc: true)
+    assert(profile.track_gc?)
+
+    result = profile.profile do
+      collect
+    end
+
+    gc_method = find_gc_method(result)
+    refute_nil(gc_method)
+    assert_equal(RubyProf::MethodInfo::SYNTHETIC, gc_method.klass_flags)
+    assert_operator(gc_method.called, :>=, 1)
+    assert_operator(gc_method.total_time, :>, 0)
+    assert_equal(gc_method.total_time, gc_method.self_time)
+
+    # GC is charged to the method that was running when it started
+    call_tree = gc_method.call_trees.call_trees.first
+    parent = call_tree.parent.target
+    assert_equal(gc_method.called, parent.gc_count)
+    assert_in_delta(gc_method.total_time, parent.gc_time, 0.000001)
+    assert_operator(parent.children_time, :>=, gc_method.total_time - 0.000001)
+  end
+
+  def test_other_thread
+    skip("GC.compact is not supported") unless GC.respond_to?(:compact)
+
+    thread = nil
+
+    # C calls are not traced, so the main thread's call to noop is the first event after the worker collects
+    result = RubyProf::Profile.profile(track_gc: true, events: RubyProf::EVENTS_METHODS) do
+      thread = Thread.new { compact_and_stop }
+      Thread.pass until thread.status == "sleep"
+      noop
+      thread.wakeup
+      thread.join
+    end
+
+    main = result.threads.detect {|t| t.id == Thread.current.object_id}
+    assert_nil(main.methods.detect {|method| method.full_name == '[GC]'})
+
+    worker = result.threads.detect {|t| t.id == thread.object_id}
+    gc_method = worker.methods.detect {|method| method.full_name == '[GC]'}
+    refute_nil(gc_method)
+    assert_equal('TrackGcTest#compact_and_stop', gc_method.call_trees.call_trees.first.parent.target.full_name)
+  end
+
+  def test_other_thread_traced_last
+    skip("GC.compact is not supported") unless GC.respond_to?(:compact)
+
+    thread = nil
+
+    # The main thread's call to noop is the last traced event before the worker wakes up and collects
+    result = RubyProf::Profile.profile(track_gc: true, events: RubyProf::EVENTS_METHODS) do
+      thread = Thread.new { stop_compact_and_stop }
+      Thread.pass until thread.status == "sleep"
+      noop
+      thread.wakeup
+      Thread.pass until thread.status == "sleep"
+      noop
+      thread.wakeup
+      thread.join
+    end
+
+    main = result.threads.detect {|t| t.id == Thread.current.object_id}
+    assert_nil(main.methods.detect {|method| method.full_name == '[GC]'})
+
+    worker = result.threads.detect {|t| t.id == thread.object_id}
+    gc_method = worker.methods.detect {|method| method.full_name == '[GC]'}
+    refute_nil(gc_method)
+    assert_equal('TrackGcTest#stop_compact_and_stop', gc_method.call_trees.call_trees.first.parent.target.full_name)
+  end
+
+  def test_deferred
+    result = RubyProf::Profile.profile(track_gc: true, deferred: true) do
+      collect
+    end
+
+    gc_method = find_gc_method(result)
+    refute_nil(gc_method)
+    assert_operator(gc_method.called, :>=, 1)
+    assert_operator(gc_method.total_time, :>, 0)
+  end
+
+  def test_marshal
+    result = RubyProf::Profile.profile(track_gc: true) do
+      collect
+    end
+
+    gc_method = find_gc_method(result)
+    parent = gc_method.call_trees.call_trees.first.parent.target
+
+    loaded = Marshal.load(Marshal.dump(result))
+    loaded_gc_method = find_gc_method(loaded)
+    refute_nil(loaded_gc_method)
+    assert_equal(gc_method.called, loaded_gc_method.called)
+
+    loaded_parent = loaded.threads.first.methods.detect {|method| method.full_name == parent.full_name}
+    assert_equal(parent.gc_count, loaded_parent.gc_count)
+    assert_equal(parent.gc_time, loaded_parent.gc_time)
+  end
+
+  def test_sampling
+    skip("Sampling is not supported on this platform") if windows?
+
+    exception = assert_raises(ArgumentError) do
+      RubyProf::Profile.new(track_gc: true, sampling: true)
+    end
+    assert_equal("Sampling does not support tracking garbage collection", exception.message)
+  end
+end